@@ -0,0 +1,539 @@
+// Batched file I/O
+//
+// Reading or writing many small files one call at a time keeps a single
+// request in flight, and a fast SSD spends most of its time waiting for the
+// next one. readFiles and writeFiles work on a whole list of files in phases
+// instead: every file is opened, then every read (or write) is issued, then
+// every file is closed.
+//
+// On Linux 5.6 and later each phase goes through an io_uring: the submission
+// queue is filled with up to IO_RING_DEPTH requests and handed to the kernel
+// with one io_uring_enter, so the device sees them all at once. The ring is
+// set up with the raw system calls; there is no library to link.
+//
+// Where io_uring is missing or blocked (old kernels, kernel.io_uring_disabled,
+// seccomp filters in containers), or "io:threads" is set in config.txt, the
+// same work is spread over the worker pool one file per task, which still
+// keeps a request in flight per worker.
+//
+// Callers hand over a few hundred files at a time, so memory use is bounded
+// by the batch and not by the size of the tree.
+
+const unsigned IO_RING_DEPTH = 256;
+const size_t IO_MAX_REQUEST = 1 << 30; // read and write take a 32-bit length
+
+// How callers batch: files per call, and the largest file read or written
+// whole. Bigger files keep their streaming paths, which use bounded memory
+// and copy in the kernel where they can.
+const size_t IO_BATCH_FILES = 256;
+const size_t IO_BATCH_MAX_FILE = 256 * 1024;
+
+// One file to read in full. path is filled in by the caller, the rest by
+// readFiles.
+struct FileRead
+{
+    std::string path;
+    int error = 0;       // errno if the file could not be opened or read
+    struct stat st = {}; // valid if error is 0
+    bool read = false;   // data holds the whole file
+    std::string data;
+};
+
+// One file to write; the old file at path is replaced. st describes the new
+// file if ok is set.
+struct FileWrite
+{
+    std::string path;
+    std::string data;
+    mode_t mode = 0644;
+    bool ok = false;
+    struct stat st = {};
+};
+
+// Decides from a file's stat data whether to read it; files it turns down
+// are only opened and stat'ed
+using ReadFilter = std::function<bool(const FileRead&)>;
+
+// A minimal io_uring: the submission and completion queues shared with the
+// kernel, used by one thread at a time
+struct IoRing
+{
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    void* sqMap = MAP_FAILED;
+    void* cqMap = MAP_FAILED;
+    size_t sqMapSize = 0, cqMapSize = 0, sqesSize = 0;
+
+    bool open(unsigned depth)
+    {
+        io_uring_params params = {};
+        fd = syscall(__NR_io_uring_setup, depth, &params);
+        if (fd < 0)
+        {
+            return false;
+        }
+        // Opening, reading and closing through the ring came with 5.6, the
+        // same release as this feature flag
+        if (!(params.features & IORING_FEAT_RW_CUR_POS))
+        {
+            return false;
+        }
+
+        entries = params.sq_entries;
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqMap = mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void* sqesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqMap == MAP_FAILED || cqMap == MAP_FAILED || sqesMap == MAP_FAILED)
+        {
+            if (sqesMap != MAP_FAILED) munmap(sqesMap, sqesSize);
+            return false;
+        }
+
+        char* sq = static_cast<char*>(sqMap);
+        char* cq = static_cast<char*>(cqMap);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqes = static_cast<io_uring_sqe*>(sqesMap);
+        return true;
+    }
+
+    ~IoRing()
+    {
+        if (sqes) munmap(sqes, sqesSize);
+        if (sqMap != MAP_FAILED) munmap(sqMap, sqMapSize);
+        if (cqMap != MAP_FAILED) munmap(cqMap, cqMapSize);
+        if (fd >= 0) close(fd);
+    }
+
+    // Runs count requests, entries at a time; prepare fills in the i-th.
+    // results[i] gets its return value, a negative errno on failure. Returns
+    // false if the ring itself failed, which leaves results incomplete.
+    bool run(size_t count, const std::function<void(size_t, io_uring_sqe&)>& prepare, std::vector<int>& results)
+    {
+        results.assign(count, -ECANCELED);
+        for (size_t first = 0; first < count; first += entries)
+        {
+            unsigned batch = std::min<size_t>(entries, count - first);
+            unsigned tail = *sqTail; // only this thread moves the tail
+            for (unsigned k = 0; k < batch; ++k)
+            {
+                unsigned slot = (tail + k) & *sqMask;
+                io_uring_sqe& sqe = sqes[slot];
+                memset(&sqe, 0, sizeof(sqe));
+                prepare(first + k, sqe);
+                sqe.user_data = first + k;
+                sqArray[slot] = slot;
+            }
+            __atomic_store_n(sqTail, tail + batch, __ATOMIC_RELEASE);
+
+            unsigned unsubmitted = batch, completed = 0;
+            while (completed < batch)
+            {
+                // The kernel only waits if everything was submitted
+                int submitted = syscall(__NR_io_uring_enter, fd, unsubmitted, batch - completed, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                {
+                    return false;
+                }
+                unsubmitted -= std::max(submitted, 0);
+
+                unsigned head = *cqHead;
+                unsigned available = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+                for (; head != available; ++head)
+                {
+                    const io_uring_cqe& cqe = cqes[head & *cqMask];
+                    results[cqe.user_data] = cqe.res;
+                    ++completed;
+                }
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            }
+        }
+        return true;
+    }
+};
+
+// This thread's ring; empty if io_uring cannot be used
+std::unique_ptr<IoRing>& threadRing()
+{
+    thread_local std::unique_ptr<IoRing> ring;
+    thread_local bool tried = false;
+    if (!tried)
+    {
+        tried = true;
+        ring = std::make_unique<IoRing>();
+        if (getConfig("io", "auto") == "threads" || !ring->open(IO_RING_DEPTH))
+        {
+            ring.reset();
+        }
+    }
+    return ring;
+}
+
+IoRing* ioRing()
+{
+    return threadRing().get();
+}
+
+// The ring failed: later batches on this thread go to the worker pool
+void dropIoRing()
+{
+    threadRing().reset();
+}
+
+// Reads one file with ordinary system calls; the worker pool fallback
+void readFileNow(FileRead& file, const ReadFilter& wanted)
+{
+    int fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &file.st) != 0)
+    {
+        file.error = errno;
+        if (fd >= 0) close(fd);
+        return;
+    }
+    traceCount(TraceFilesOpened);
+
+    if (!wanted || wanted(file))
+    {
+        file.data.resize(file.st.st_size);
+        size_t done = 0;
+        while (done < file.data.size())
+        {
+            ssize_t got = pread(fd, &file.data[done], file.data.size() - done, done);
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                break;
+            }
+            done += got;
+        }
+        traceCount(TraceBytesRead, done);
+        file.data.resize(done); // the file may have shrunk meanwhile
+        file.read = true;
+    }
+    close(fd);
+}
+
+// Writes one file with ordinary system calls; the worker pool fallback
+void writeFileNow(FileWrite& file)
+{
+    if (unlink(file.path.c_str()) != 0 && errno != ENOENT)
+    {
+        return;
+    }
+    int fd = open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, file.mode);
+    if (fd < 0)
+    {
+        return;
+    }
+    traceCount(TraceFilesOpened);
+    bool ok = writeAll(fd, file.data.data(), file.data.size()) && fstat(fd, &file.st) == 0;
+    file.ok = close(fd) == 0 && ok;
+}
+
+// Opens every file through the ring, creating files with modes[i] if given;
+// fds[i] is a negative errno where that failed
+bool ringOpen(IoRing& ring, const std::vector<std::string*>& paths, int flags, const std::vector<mode_t>& modes,
+              std::vector<int>& fds)
+{
+    std::vector<int> results;
+    bool ok = ring.run(paths.size(), [&](size_t i, io_uring_sqe& sqe) {
+        sqe.opcode = IORING_OP_OPENAT;
+        sqe.fd = AT_FDCWD;
+        sqe.addr = reinterpret_cast<uintptr_t>(paths[i]->c_str());
+        sqe.open_flags = flags;
+        sqe.len = modes.empty() ? 0 : modes[i];
+    }, results);
+    fds = results;
+    for (int fd : fds)
+    {
+        if (fd >= 0) traceCount(TraceFilesOpened);
+    }
+    return ok;
+}
+
+// Reads (or writes) size bytes of every buffer at offset 0 through the ring,
+// resubmitting whatever a short transfer left over. done[i] is how much was
+// transferred; error[i] is set on failure.
+bool ringTransfer(IoRing& ring, bool writing, const std::vector<int>& fds, const std::vector<char*>& buffers,
+                  const std::vector<size_t>& sizes, std::vector<size_t>& done, std::vector<int>& errors)
+{
+    done.assign(fds.size(), 0);
+    errors.assign(fds.size(), 0);
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        if (fds[i] >= 0 && sizes[i] > 0)
+        {
+            pending.push_back(i);
+        }
+    }
+
+    while (!pending.empty())
+    {
+        std::vector<int> results;
+        bool ok = ring.run(pending.size(), [&](size_t k, io_uring_sqe& sqe) {
+            size_t i = pending[k];
+            sqe.opcode = writing ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe.fd = fds[i];
+            sqe.addr = reinterpret_cast<uintptr_t>(buffers[i] + done[i]);
+            sqe.len = std::min(sizes[i] - done[i], IO_MAX_REQUEST);
+            sqe.off = done[i];
+        }, results);
+        if (!ok)
+        {
+            return false;
+        }
+
+        std::vector<size_t> again;
+        for (size_t k = 0; k < pending.size(); ++k)
+        {
+            size_t i = pending[k];
+            if (results[k] == -EINTR || results[k] == -EAGAIN)
+            {
+                again.push_back(i);
+            }
+            else if (results[k] < 0)
+            {
+                errors[i] = -results[k];
+            }
+            else if (results[k] > 0)
+            {
+                traceCount(writing ? TraceBytesWritten : TraceBytesRead, results[k]);
+                done[i] += results[k];
+                if (done[i] < sizes[i])
+                {
+                    again.push_back(i);
+                }
+            }
+            else if (writing)
+            {
+                errors[i] = EIO; // a write that makes no progress
+            }
+            // A read of 0 bytes is the end of a file that shrank
+        }
+        pending.swap(again);
+    }
+    return true;
+}
+
+// Closes every open file through the ring; closeErrors[i] is set where
+// closing failed. If the ring fails, files are left open rather than risk
+// closing a descriptor number that has already been reused.
+bool ringClose(IoRing& ring, const std::vector<int>& fds, std::vector<int>& closeErrors)
+{
+    std::vector<size_t> opened;
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        if (fds[i] >= 0) opened.push_back(i);
+    }
+    std::vector<int> results;
+    bool ok = ring.run(opened.size(), [&](size_t k, io_uring_sqe& sqe) {
+        sqe.opcode = IORING_OP_CLOSE;
+        sqe.fd = fds[opened[k]];
+    }, results);
+
+    closeErrors.assign(fds.size(), 0);
+    for (size_t k = 0; ok && k < opened.size(); ++k)
+    {
+        if (results[k] < 0)
+        {
+            closeErrors[opened[k]] = -results[k];
+        }
+    }
+    return ok;
+}
+
+// Reads every file in full, or, where wanted says no, only stats it
+void readFiles(std::vector<FileRead>& files, const ReadFilter& wanted = nullptr)
+{
+    TraceSpan span("io: read files");
+    IoRing* ring = ioRing();
+    std::vector<std::string*> paths;
+    for (auto& file : files)
+    {
+        paths.push_back(&file.path);
+    }
+
+    std::vector<int> fds;
+    if (!ring || !ringOpen(*ring, paths, O_RDONLY | O_CLOEXEC, {}, fds))
+    {
+        if (ring)
+        {
+            // Whatever the ring did open is closed, then everything redone
+            for (int fd : fds) if (fd >= 0) close(fd);
+            dropIoRing();
+        }
+        runParallel(files.size(), [&](size_t i) { readFileNow(files[i], wanted); });
+        return;
+    }
+
+    // The inode was just read in by the open, so fstat does no I/O
+    std::vector<char*> buffers(files.size(), nullptr);
+    std::vector<size_t> sizes(files.size(), 0);
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        FileRead& file = files[i];
+        if (fds[i] < 0 || fstat(fds[i], &file.st) != 0)
+        {
+            file.error = fds[i] < 0 ? -fds[i] : errno;
+            continue;
+        }
+        if (!wanted || wanted(file))
+        {
+            file.data.resize(file.st.st_size);
+            buffers[i] = file.data.data();
+            sizes[i] = file.data.size();
+            file.read = true;
+        }
+    }
+
+    std::vector<size_t> done;
+    std::vector<int> errors, closeErrors;
+    bool ok = ringTransfer(*ring, false, fds, buffers, sizes, done, errors);
+    ok = ringClose(*ring, fds, closeErrors) && ok;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (!ok || errors[i])
+        {
+            files[i].read = false;
+            files[i].error = ok ? errors[i] : EIO;
+        }
+        else if (files[i].read)
+        {
+            files[i].data.resize(done[i]);
+        }
+    }
+    if (!ok)
+    {
+        dropIoRing();
+    }
+}
+
+// Writes every file, replacing what is at its path. The old file is unlinked
+// rather than truncated, since it may be a hard link to an object.
+void writeFiles(std::vector<FileWrite>& files)
+{
+    TraceSpan span("io: write files");
+    IoRing* ring = ioRing();
+    if (!ring)
+    {
+        runParallel(files.size(), [&](size_t i) { writeFileNow(files[i]); });
+        return;
+    }
+
+    std::vector<std::string*> paths;
+    std::vector<mode_t> modes;
+    std::vector<size_t> replace; // files whose old version is out of the way
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (unlink(files[i].path.c_str()) == 0 || errno == ENOENT)
+        {
+            replace.push_back(i);
+            paths.push_back(&files[i].path);
+            modes.push_back(files[i].mode);
+        }
+    }
+
+    std::vector<int> fds;
+    if (!ringOpen(*ring, paths, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, modes, fds))
+    {
+        for (int fd : fds) if (fd >= 0) close(fd);
+        dropIoRing();
+        runParallel(files.size(), [&](size_t i) { writeFileNow(files[i]); });
+        return;
+    }
+
+    std::vector<char*> buffers;
+    std::vector<size_t> sizes;
+    for (size_t i : replace)
+    {
+        buffers.push_back(files[i].data.data());
+        sizes.push_back(files[i].data.size());
+    }
+    std::vector<size_t> done;
+    std::vector<int> errors, closeErrors;
+    bool ok = ringTransfer(*ring, true, fds, buffers, sizes, done, errors);
+    for (size_t k = 0; k < replace.size(); ++k)
+    {
+        FileWrite& file = files[replace[k]];
+        file.ok = ok && fds[k] >= 0 && !errors[k] && done[k] == sizes[k] && fstat(fds[k], &file.st) == 0;
+    }
+    ok = ringClose(*ring, fds, closeErrors) && ok;
+    for (size_t k = 0; k < replace.size(); ++k)
+    {
+        files[replace[k]].ok = files[replace[k]].ok && ok && !closeErrors[k];
+    }
+    if (!ok)
+    {
+        dropIoRing();
+    }
+}
+
+// Reads many loose objects at once. loaded[i] tells whether contents[i]
+// holds the file content of ids[i]. Objects stored larger than maxSize,
+// chunked or packed ones, and any that could not be read are left to the
+// caller, who can still use readObject or streamObject on them.
+void readObjects(const std::vector<std::string>& ids, size_t maxSize, std::vector<std::string>& contents,
+                 std::vector<bool>& loaded)
+{
+    std::vector<FileRead> files(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        files[i].path = objectPath(ids[i]);
+    }
+    readFiles(files, [&](const FileRead& file) { return (uint64_t)file.st.st_size <= maxSize; });
+
+    // Decompressing is the expensive part, so it runs on all cores
+    contents.assign(ids.size(), "");
+    std::vector<char> decoded(ids.size(), false);
+    runParallel(ids.size(), [&](size_t i) {
+        std::string& data = files[i].data;
+        if (!files[i].read)
+        {
+            return;
+        }
+        if (data.size() >= 16 && memcmp(data.data(), OBJECT_MAGIC, sizeof(OBJECT_MAGIC)) == 0)
+        {
+            // magic | uint64 size | blocks
+            uint64_t total;
+            memcpy(&total, data.data() + 8, 8);
+            std::string content;
+            content.reserve(total);
+            bool ok = decompressBlocks(data.data() + 16, data.size() - 16, [&](const char* block, size_t size) {
+                content.append(block, size);
+                return true;
+            });
+            if (!ok || content.size() != total)
+            {
+                return;
+            }
+            data.swap(content);
+        }
+        if (data.size() >= sizeof(CHUNK_MAGIC) && memcmp(data.data(), CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) == 0)
+        {
+            return; // a manifest; the chunks are read by readObject
+        }
+        contents[i].swap(data);
+        decoded[i] = true;
+    });
+    loaded.assign(decoded.begin(), decoded.end());
+}
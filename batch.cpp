@@ -0,0 +1,247 @@
+// Batch mode
+//
+// `minigit batch` reads one command per line from stdin and runs them all in
+// one process, e.g.
+//
+//   add src/a.cpp src/b.cpp
+//   commit -m "Update parser"
+//   log
+//
+// Arguments are split like a shell would: whitespace separates them, single
+// or double quotes group them, and a backslash escapes the next character.
+// After each command's output a line "--- <exit status>" marks its end, so a
+// driver can tell where one answer stops. "exit" or "quit" ends the session.
+//
+// `minigit batch --socket <path>` serves the same protocol on a Unix socket,
+// one connection at a time, until a client sends "shutdown".
+//
+// What each process caches (the mapped commit graph, packed-refs, pack
+// indexes, recent snapshots) stays warm from one command to the next. The
+// caches compare stat data before use, so changes made by other processes
+// are still picked up.
+
+int runCommand(const std::vector<std::string>& args);
+
+bool inBatchMode = false;
+
+// Splits a command line into arguments. Returns false on an unterminated quote.
+bool splitCommandLine(const std::string& line, std::vector<std::string>& args)
+{
+    args.clear();
+    std::string current;
+    bool inArgument = false;
+    char quote = 0;
+
+    for (size_t i = 0; i < line.size(); ++i)
+    {
+        char c = line[i];
+        if (c == '\\' && quote != '\'' && i + 1 < line.size())
+        {
+            current += line[++i];
+            inArgument = true;
+        }
+        else if (quote)
+        {
+            if (c == quote)
+            {
+                quote = 0;
+            }
+            else
+            {
+                current += c;
+            }
+        }
+        else if (c == '"' || c == '\'')
+        {
+            quote = c;
+            inArgument = true;
+        }
+        else if (std::isspace(static_cast<unsigned char>(c)))
+        {
+            if (inArgument)
+            {
+                args.push_back(current);
+                current.clear();
+                inArgument = false;
+            }
+        }
+        else
+        {
+            current += c;
+            inArgument = true;
+        }
+    }
+
+    if (inArgument)
+    {
+        args.push_back(current);
+    }
+    return quote == 0;
+}
+
+enum class BatchResult
+{
+    Continue,
+    Close,
+    Shutdown
+};
+
+// Runs one line, with everything the command prints going to out
+BatchResult runBatchLine(const std::string& line, std::ostream& out)
+{
+    std::vector<std::string> args;
+    if (!splitCommandLine(line, args))
+    {
+        out << "Error: Unterminated quote.\n--- 1\n";
+        out.flush();
+        return BatchResult::Continue;
+    }
+    if (args.empty())
+    {
+        return BatchResult::Continue;
+    }
+    if (args[0] == "exit" || args[0] == "quit")
+    {
+        return BatchResult::Close;
+    }
+    if (args[0] == "shutdown")
+    {
+        return BatchResult::Shutdown;
+    }
+
+    // Settings may have been changed by another process
+    reloadConfig();
+
+    std::streambuf* saved = std::cout.rdbuf(out.rdbuf());
+    int status;
+    try
+    {
+        status = runCommand(args);
+    }
+    catch (const std::exception& error)
+    {
+        std::cout << "Error: " << error.what() << "\n";
+        status = 1;
+    }
+    std::cout.flush();
+    std::cout.rdbuf(saved);
+
+    out << "--- " << status << "\n";
+    out.flush();
+    return BatchResult::Continue;
+}
+
+// Serves batch commands on a Unix socket until a client sends "shutdown"
+int serveBatchSocket(const std::string& path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        std::cout << "Error: Socket path is too long.\n";
+        return 1;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    // A socket left behind by a previous server is replaced; other files are not
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            std::cout << "Error: '" << path << "' exists and is not a socket.\n";
+            return 1;
+        }
+        unlink(path.c_str());
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(server, 16) != 0)
+    {
+        std::cout << "Error: Could not listen on '" << path << "': " << strerror(errno) << "\n";
+        if (server >= 0) close(server);
+        return 1;
+    }
+    chmod(path.c_str(), 0600); // only the owner may drive the repository
+    signal(SIGPIPE, SIG_IGN);  // a client hanging up must not kill the server
+
+    std::cout << "Serving batch commands on " << path << "\n";
+    std::cout.flush();
+
+    bool running = true;
+    while (running)
+    {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        std::string pending;
+        char buffer[64 * 1024];
+        bool open = true;
+        while (open)
+        {
+            ssize_t got = read(client, buffer, sizeof(buffer));
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                break;
+            }
+            pending.append(buffer, got);
+
+            size_t start = 0, newline;
+            while (open && (newline = pending.find('\n', start)) != std::string::npos)
+            {
+                std::ostringstream reply;
+                BatchResult result = runBatchLine(pending.substr(start, newline - start), reply);
+                start = newline + 1;
+
+                std::string text = reply.str();
+                open = writeAll(client, text.data(), text.size()) && result == BatchResult::Continue;
+                running = result != BatchResult::Shutdown;
+            }
+            pending.erase(0, start);
+        }
+        close(client);
+    }
+
+    close(server);
+    unlink(path.c_str());
+    return 0;
+}
+
+// batch [--socket <path>]
+int runBatch(const std::vector<std::string>& args)
+{
+    if (inBatchMode)
+    {
+        std::cout << "Already in batch mode.\n";
+        return 1;
+    }
+    inBatchMode = true;
+
+    if (args.size() == 3 && args[1] == "--socket")
+    {
+        return serveBatchSocket(args[2]);
+    }
+    if (args.size() != 1)
+    {
+        std::cout << "Usage: minigit batch [--socket <path>]\n";
+        return 1;
+    }
+
+    std::string line;
+    while (std::getline(std::cin, line))
+    {
+        if (runBatchLine(line, std::cout) != BatchResult::Continue)
+        {
+            break;
+        }
+    }
+    return 0;
+}
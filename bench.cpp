@@ -0,0 +1,410 @@
+// Benchmarks
+//
+//   minigit bench generate <dir> [options]
+//       Builds a synthetic repository in <dir>.
+//
+//   minigit bench run [--scale 1k|100k|1M] [--iterations N] [--out file] [options]
+//       Generates a repository in a temporary directory, times the main
+//       operations on it and prints the results as JSON.
+//
+// Options:
+//   --files N          files in the first commit (set by --scale for run)
+//   --file-size B      approximate size of each file in bytes
+//   --commits N        commits on main, each editing a share of the files
+//   --branches N       branches, each with one commit of its own
+//   --edit-ratio R     share of the files each commit edits (0..1)
+//   --seed S           random seed; the same options give the same repository
+//   --keep             run only: keep the generated repository
+//
+// Files are lines of random words, so diff and merge have real work to do.
+// Everything runs in-process through the same functions the commands use,
+// with their output discarded while timing.
+
+bool diffCommits(const std::string& id1, const std::string& id2, DiffFormat format);
+
+struct BenchOptions
+{
+    size_t files = 1000;
+    size_t fileSize = 1024;
+    size_t commits = 10;
+    size_t branches = 4;
+    double editRatio = 0.01;
+    uint64_t seed = 1;
+    size_t iterations = 5;
+    std::string scale = "1k";
+    std::string out;
+    bool keep = false;
+};
+
+// Discards everything written to std::cout while it exists
+struct QuietOutput
+{
+    std::streambuf* saved;
+    QuietOutput() : saved(std::cout.rdbuf(nullptr)) {}
+    ~QuietOutput() { std::cout.rdbuf(saved); }
+};
+
+struct BenchRepo
+{
+    BenchOptions options;
+    std::mt19937_64 random;
+    std::vector<std::string> files;
+    size_t edits = 0; // files changed per commit
+
+    explicit BenchRepo(const BenchOptions& options)
+        : options(options), random(options.seed)
+    {
+        edits = std::max<size_t>(1, options.files * options.editRatio);
+    }
+
+    std::string randomLine()
+    {
+        static const char* words[] = {"alpha", "beta", "gamma", "delta", "index", "commit", "branch", "merge",
+                                      "object", "tree", "value", "return", "static", "const", "void", "struct"};
+        std::string line;
+        size_t count = 4 + random() % 8;
+        for (size_t i = 0; i < count; ++i)
+        {
+            line += words[random() % 16];
+            line += i + 1 < count ? ' ' : '\n';
+        }
+        return line;
+    }
+
+    void writeNewFile(const std::string& path)
+    {
+        std::string content;
+        while (content.size() < options.fileSize)
+        {
+            content += randomLine();
+        }
+        std::ofstream(path, std::ios::binary) << content;
+    }
+
+    // Rewrites one line somewhere in the file
+    void editFile(const std::string& path)
+    {
+        std::vector<std::string> lines;
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            lines.push_back(line + "\n");
+        }
+        in.close();
+
+        if (lines.empty())
+        {
+            lines.push_back(randomLine());
+        }
+        else
+        {
+            lines[random() % lines.size()] = randomLine();
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        for (const auto& l : lines)
+        {
+            out << l;
+        }
+    }
+
+    // Picks files to edit from [begin, end) of the file list
+    std::vector<std::string> pickFiles(size_t count, size_t begin, size_t end)
+    {
+        std::vector<std::string> picked;
+        for (size_t i = 0; i < count && begin < end; ++i)
+        {
+            picked.push_back(files[begin + random() % (end - begin)]);
+        }
+        std::sort(picked.begin(), picked.end());
+        picked.erase(std::unique(picked.begin(), picked.end()), picked.end());
+        return picked;
+    }
+
+    std::vector<std::string> editSome(size_t begin, size_t end)
+    {
+        std::vector<std::string> picked = pickFiles(edits, begin, end);
+        for (const auto& path : picked)
+        {
+            editFile(path);
+        }
+        return picked;
+    }
+
+    // Builds the repository in the current directory
+    void generate()
+    {
+        QuietOutput quiet;
+        initMiniGit();
+
+        // 1000 files per directory keeps directories a realistic size
+        for (size_t i = 0; i < options.files; ++i)
+        {
+            std::string dir = "src/d" + std::to_string(i / 1000);
+            if (i % 1000 == 0)
+            {
+                fs::create_directories(dir);
+            }
+            files.push_back(dir + "/f" + std::to_string(i) + ".txt");
+            writeNewFile(files.back());
+        }
+        addFiles({"src"});
+        createCommit("Initial commit");
+
+        for (size_t c = 1; c < options.commits; ++c)
+        {
+            addFiles(editSome(0, files.size()));
+            createCommit("Commit " + std::to_string(c));
+        }
+
+        for (size_t b = 0; b < options.branches; ++b)
+        {
+            std::string name = "bench-" + std::to_string(b);
+            createBranch(name);
+            checkoutBranch(name);
+            addFiles(editSome(0, files.size()));
+            createCommit("Work on " + name);
+            checkoutBranch("main");
+        }
+    }
+};
+
+struct BenchResult
+{
+    std::string operation;
+    size_t items = 0; // work per iteration: files edited, commits logged, or 1
+    std::vector<double> milliseconds;
+
+    BenchResult(const std::string& operation, size_t items) : operation(operation), items(items) {}
+};
+
+template <typename Function>
+double timeMilliseconds(Function function)
+{
+    QuietOutput quiet;
+    auto start = std::chrono::steady_clock::now();
+    function();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Nearest-rank percentile of sorted samples
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+std::string benchJson(const BenchOptions& options, double generateMs, const std::vector<BenchResult>& results)
+{
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3);
+    json << "{\n";
+    json << "  \"scale\": \"" << options.scale << "\",\n";
+    json << "  \"files\": " << options.files << ",\n";
+    json << "  \"file_size\": " << options.fileSize << ",\n";
+    json << "  \"commits\": " << options.commits << ",\n";
+    json << "  \"branches\": " << options.branches << ",\n";
+    json << "  \"edit_ratio\": " << options.editRatio << ",\n";
+    json << "  \"seed\": " << options.seed << ",\n";
+    json << "  \"threads\": " << workerCount() << ",\n";
+    json << "  \"hash\": \"" << getConfig("hash", "djb2") << "\",\n";
+    json << "  \"generate_ms\": " << generateMs << ",\n";
+    json << "  \"results\": [\n";
+
+    for (size_t r = 0; r < results.size(); ++r)
+    {
+        const BenchResult& result = results[r];
+        std::vector<double> sorted = result.milliseconds;
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0;
+        for (double ms : sorted) total += ms;
+        double mean = sorted.empty() ? 0 : total / sorted.size();
+
+        json << "    {\"operation\": \"" << result.operation << "\""
+             << ", \"iterations\": " << sorted.size()
+             << ", \"items\": " << result.items
+             << ", \"mean_ms\": " << mean
+             << ", \"min_ms\": " << (sorted.empty() ? 0 : sorted.front())
+             << ", \"p50_ms\": " << percentile(sorted, 50)
+             << ", \"p90_ms\": " << percentile(sorted, 90)
+             << ", \"p99_ms\": " << percentile(sorted, 99)
+             << ", \"max_ms\": " << (sorted.empty() ? 0 : sorted.back())
+             << ", \"items_per_sec\": " << (mean > 0 ? result.items * 1000.0 / mean : 0)
+             << "}" << (r + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+// Times every operation on the repository in the current directory
+std::vector<BenchResult> runBenchmarks(BenchRepo& repo)
+{
+    const BenchOptions& options = repo.options;
+    size_t half = repo.files.size() / 2;
+
+    CommitGraph graph;
+    openCommitGraph(graph);
+
+    BenchResult add("addFile", repo.edits), commit("createCommit", repo.edits), diff("diffCommits", repo.edits);
+    BenchResult log("viewlog", graph.count), checkout("checkoutBranch", 1), merge("mergeBranch", 1);
+
+    for (size_t i = 0; i < options.iterations; ++i)
+    {
+        // add + commit of a typical edit
+        std::vector<std::string> edited = repo.editSome(0, repo.files.size());
+        add.milliseconds.push_back(timeMilliseconds([&] { addFiles(edited); }));
+        commit.milliseconds.push_back(timeMilliseconds([&] { createCommit("Bench commit " + std::to_string(i)); }));
+
+        // diff of that commit against its parent
+        Commit head;
+        lookupCommit(getParentHash(), head);
+        diff.milliseconds.push_back(timeMilliseconds([&] { diffCommits(head.parent, head.id, DiffFull); }));
+
+        log.milliseconds.push_back(timeMilliseconds([&] { viewlog(); }));
+
+        // checkout to a branch and back; both directions count
+        if (options.branches > 0)
+        {
+            std::string branch = "bench-" + std::to_string(i % options.branches);
+            checkout.milliseconds.push_back(timeMilliseconds([&] { checkoutBranch(branch); }));
+            checkout.milliseconds.push_back(timeMilliseconds([&] { checkoutBranch("main"); }));
+        }
+
+        // merge of a branch whose edits touch other files than main's
+        {
+            QuietOutput quiet;
+            std::string branch = "bench-merge-" + std::to_string(i);
+            createBranch(branch);
+            checkoutBranch(branch);
+            addFiles(repo.editSome(half, repo.files.size()));
+            createCommit("Branch work " + std::to_string(i));
+            checkoutBranch("main");
+            addFiles(repo.editSome(0, std::max<size_t>(half, 1)));
+            createCommit("Main work " + std::to_string(i));
+        }
+        std::string branch = "bench-merge-" + std::to_string(i);
+        merge.milliseconds.push_back(timeMilliseconds([&] { mergeBranch(branch); }));
+    }
+
+    return {add, commit, log, checkout, merge, diff};
+}
+
+bool parseBenchOptions(const std::vector<std::string>& args, size_t first, BenchOptions& options)
+{
+    for (size_t i = first; i < args.size(); ++i)
+    {
+        const std::string& flag = args[i];
+        if (flag == "--keep")
+        {
+            options.keep = true;
+            continue;
+        }
+        if (i + 1 >= args.size())
+        {
+            return false;
+        }
+
+        const std::string& value = args[++i];
+        try
+        {
+            if (flag == "--files") options.files = std::stoull(value);
+            else if (flag == "--file-size") options.fileSize = std::stoull(value);
+            else if (flag == "--commits") options.commits = std::max<size_t>(1, std::stoull(value));
+            else if (flag == "--branches") options.branches = std::stoull(value);
+            else if (flag == "--edit-ratio") options.editRatio = std::stod(value);
+            else if (flag == "--seed") options.seed = std::stoull(value);
+            else if (flag == "--iterations") options.iterations = std::max<size_t>(1, std::stoull(value));
+            else if (flag == "--out") options.out = value;
+            else if (flag == "--scale")
+            {
+                if (value == "1k") options.files = 1000;
+                else if (value == "100k") options.files = 100000;
+                else if (value == "1M") options.files = 1000000;
+                else return false;
+                options.scale = value;
+            }
+            else return false;
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int runBench(const std::vector<std::string>& args)
+{
+    BenchOptions options;
+    bool generateOnly = args.size() >= 3 && args[1] == "generate";
+    bool run = args.size() >= 2 && args[1] == "run";
+    if ((!generateOnly && !run) || !parseBenchOptions(args, generateOnly ? 3 : 2, options))
+    {
+        std::cout << "Usage: minigit bench generate <dir> [--files N] [--file-size B] [--commits N] [--branches N] [--edit-ratio R] [--seed S]\n"
+                     "       minigit bench run [--scale 1k|100k|1M] [--iterations N] [--out file] [--keep] [generate options]\n";
+        return 1;
+    }
+
+    fs::path home = fs::current_path();
+    fs::path dir;
+    if (generateOnly)
+    {
+        dir = args[2];
+        if (fs::exists(dir / ".minigit"))
+        {
+            std::cout << "Error: '" << dir.string() << "' already holds a repository.\n";
+            return 1;
+        }
+        fs::create_directories(dir);
+    }
+    else
+    {
+        char pattern[] = "/tmp/minigit-bench-XXXXXX";
+        if (!mkdtemp(pattern))
+        {
+            std::cout << "Error: Could not create a temporary directory.\n";
+            return 1;
+        }
+        dir = pattern;
+    }
+
+    fs::current_path(dir);
+    BenchRepo repo(options);
+    double generateMs = timeMilliseconds([&] { repo.generate(); });
+
+    if (generateOnly)
+    {
+        fs::current_path(home);
+        std::cout << "Generated " << options.files << " files, " << options.commits << " commits and " << options.branches
+                  << " branches in " << dir.string() << " (" << (size_t)generateMs << " ms).\n";
+        return 0;
+    }
+
+    std::vector<BenchResult> results = runBenchmarks(repo);
+    std::string json = benchJson(options, generateMs, results);
+
+    fs::current_path(home);
+    if (!options.keep)
+    {
+        std::error_code ec;
+        fs::remove_all(dir, ec);
+    }
+
+    if (options.out.empty())
+    {
+        std::cout << json;
+    }
+    else
+    {
+        std::ofstream(options.out) << json;
+        std::cout << "Results written to " << options.out << "\n";
+    }
+    return 0;
+}
@@ -1,213 +1,798 @@
-// 6.
-void checkoutBranch(const std::string& branchName) {
-    // Load branches.txt and find the commit hash for the target branch
-    std::ifstream branches(".minigit/branches.txt");
-    std::string line;
-    std::string targetCommitHash;
-    bool foundBranch = false;
+// Writes a blob out to the working directory and records the file's stat
+// data, so the index knows it is clean. A placeholder written by a lazy
+// checkout is marked as one, so that only it is ever taken for its blob.
+bool restoreFile(const std::string& fileName, const std::string& blobHash, std::vector<IndexEntry>& restored)
+{
+    fs::path parent = fs::path(fileName).parent_path();
+    if (!parent.empty())
+    {
+        std::error_code ec;
+        fs::create_directories(parent, ec);
+    }
+
+    MaterializeMode mode = materializeMode();
+    struct stat st;
+    if (!materializeBlob(blobHash, fileName, mode) || stat(fileName.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    restored.push_back({fileName, blobHash, statRecord(st)});
+    if (mode == MaterializeMode::Lazy)
+    {
+        restored.back().stat.flags = INDEX_LAZY;
+    }
+    return true;
+}
+
+// Deletes a file from the working directory, and any directories that
+// leaves empty
+bool removeFile(const std::string& fileName)
+{
+    std::error_code ec;
+    bool removed = fs::remove(fileName, ec);
 
-    while(std::getline(branches, line))
+    fs::path dir = fs::path(fileName).parent_path();
+    while (!dir.empty() && fs::is_empty(dir, ec) && fs::remove(dir, ec))
     {
-        size_t colon = line.find(":");
-        if(colon != std::string::npos)
+        dir = dir.parent_path();
+    }
+    return removed;
+}
+
+// A path checkout or merge is about to write or delete
+struct PathChange
+{
+    std::string path;
+    std::string oldHash;   // what the current commit has there; empty if nothing
+    std::string newHash;   // empty if the path is removed
+    bool dirty = false;    // working file differs from both sides
+    bool current = false;  // working file already has the new content
+};
+
+// Checks the working copy of every changed path, so local edits are never
+// overwritten or deleted. Clean stat data saves rehashing the file, and a
+// file the monitor knows to be clean is not even looked at. Returns false,
+// listing the files, if any of them has local changes.
+bool checkWorktree(std::vector<PathChange>& changes, const StatIndex& index, const WorktreeView& view,
+                   const std::string& command)
+{
+    runParallel(changes.size(), [&](size_t i) {
+        PathChange& change = changes[i];
+        std::string hash;
+        const IndexEntry* entry = findIndexEntry(index, change.path);
+        if (entry && !view.mayHaveChanged(change.path))
+        {
+            hash = entry->hash;
+        }
+        else
         {
-            std::string name = line.substr(0, colon);
-            std::string hash = line.substr(colon + 1);
-            if(name == branchName)
+            struct stat st;
+            if (lstat(change.path.c_str(), &st) != 0)
+            {
+                return; // missing: nothing to lose
+            }
+            IndexRecord record;
+            if (entry && statMatches(index, *entry, st))
+            {
+                hash = entry->hash;
+            }
+            else
             {
-                targetCommitHash = hash;
-                foundBranch = true;
-                break;
+                hashFile(change.path, hash, record, entry);
             }
         }
+
+        change.current = !change.newHash.empty() && hash == change.newHash;
+        change.dirty = !change.current && hash != change.oldHash;
+    });
+
+    std::vector<std::string> blocked;
+    for (const auto& change : changes)
+    {
+        if (change.dirty)
+        {
+            blocked.push_back(change.path);
+        }
+    }
+    if (!blocked.empty())
+    {
+        std::cout << "Error: Your local changes to the following files would be overwritten by " << command << ":\n";
+        for (const auto& path : blocked)
+        {
+            std::cout << "    " << path << "\n";
+        }
+        std::cout << "Add and commit them first.\n";
+        return false;
     }
-    
-    branches.close();
+    return true;
+}
 
-    if(!foundBranch)
+// 6.
+// With pathspecs, the working directory is narrowed or widened to them and
+// they become the sparse spec; without, the saved spec is kept.
+bool checkoutBranch(const std::string& branchName, const std::vector<std::string>* pathspecs = nullptr) {
+    TraceSpan span("checkout");
+    TraceSpan phase("checkout: read trees");
+
+    // Find the commit hash for the target branch
+    std::string targetCommitHash;
+    if(!readRef(branchName, targetCommitHash))
     {
         std::cout << "Branch '" << branchName << "' does not exist.\n";
-        return;
+        return false;
+    }
+
+    // Both sides as root trees; the current branch may have no commits yet
+    std::string currentTree, targetTree;
+    std::string currentCommitHash = getParentHash();
+    if (!commitTree(currentCommitHash, currentTree))
+    {
+        std::cout << "Error: Commit '" << currentCommitHash << "' was not found.\n";
+        return false;
+    }
+    if (!commitTree(targetCommitHash, targetTree))
+    {
+        std::cout << "Error: Commit '" << targetCommitHash << "' was not found.\n";
+        return false;
     }
 
-    // Find the matching commit in commits.txt
-    std::ifstream commits(".minigit/commits.txt");
-    bool foundCommit = false;
-    std::vector<std::pair<std::string, std::string>> filesToRestore;
+    // Tree-to-tree delta: only paths whose blob differs are touched, and
+    // subtrees that are the same on both sides are not even read
+    phase.restart("checkout: compare trees");
+    std::vector<PathChange> changes;
+    SparseSpec oldSpec = loadSparse();
+    SparseSpec spec = oldSpec;
+    if (pathspecs && !makeSparse(*pathspecs, spec))
+    {
+        return false;
+    }
 
-    while (std::getline(commits, line))
+    bool compared;
+    if (spec.patterns == oldSpec.patterns)
     {
-        if (line.rfind("COMMIT ", 0) == 0 && line.substr(7) == targetCommitHash)
+        compared = diffTrees(currentTree, targetTree, "", [&](const std::string& path, const std::string& oldHash, const std::string& newHash) {
+            changes.push_back({path, oldHash, newHash});
+        }, spec.filter());
+    }
+    else
+    {
+        // A new spec: what is checked out now against what should be. Both
+        // sides are listed, but only below the directories their spec allows.
+        std::map<std::string, std::pair<std::string, std::string>> sides;
+        compared = diffTrees("", currentTree, "", [&](const std::string& path, const std::string&, const std::string& hash) {
+            sides[path].first = hash;
+        }, oldSpec.filter()) && diffTrees("", targetTree, "", [&](const std::string& path, const std::string&, const std::string& hash) {
+            sides[path].second = hash;
+        }, spec.filter());
+        for (const auto& [path, side] : sides)
         {
-            foundCommit = true;
-        } else if (foundCommit && line.rfind("FILE ", 0) == 0)
+            if (side.first != side.second)
+            {
+                changes.push_back({path, side.first, side.second});
+            }
+        }
+    }
+    if (!compared)
+    {
+        std::cout << "Error: A tree of branch '" << branchName << "' or of the current branch could not be read.\n";
+        return false;
+    }
+
+    // Tracked files deleted from the working directory are written again,
+    // even where both commits agree: with pathspecs every file they name,
+    // otherwise every file in the index
+    phase.restart("checkout: find missing files");
+    StatIndex index;
+    WorktreeView view = loadIndex(index) ? viewWorktree() : WorktreeView();
+    std::set<std::string> changed;
+    for (const auto& change : changes)
+    {
+        changed.insert(change.path);
+    }
+    std::vector<std::pair<std::string, std::string>> candidates; // path, blob in the target; empty if unknown
+    if (pathspecs)
+    {
+        compared = diffTrees("", targetTree, "", [&](const std::string& path, const std::string&, const std::string& hash) {
+            candidates.push_back({path, hash});
+        }, spec.filter());
+    }
+    else
+    {
+        for (const auto& entry : index.entries)
         {
-            size_t colon = line.find(":");
-            if(colon != std::string::npos ){
-                std::string file = line.substr(5, colon - 5);
-                std::string hash = line.substr(colon + 1);
-                filesToRestore.push_back({file, hash});
+            if (spec.includes(entry.path) && view.mayHaveChanged(entry.path))
+            {
+                candidates.push_back({entry.path, ""});
             }
-        } else if (foundCommit && line == "END")
+        }
+    }
+    std::vector<bool> missing(candidates.size(), false);
+    runParallel(candidates.size(), [&](size_t i) {
+        struct stat st;
+        missing[i] = !changed.count(candidates[i].first) && lstat(candidates[i].first.c_str(), &st) != 0 && errno == ENOENT;
+    });
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        std::string hash = candidates[i].second;
+        if (missing[i] && hash.empty())
         {
-            break;
+            hash = findTreeEntry(targetTree, candidates[i].first);
         }
+        if (missing[i] && !hash.empty())
+        {
+            changes.push_back({candidates[i].first, hash, hash});
+        }
+    }
+    if (!compared)
+    {
+        std::cout << "Error: A tree of branch '" << branchName << "' could not be read.\n";
+        return false;
     }
-    
-    commits.close();
 
-    if (!foundCommit)
+    // Local edits to any of those paths stop the checkout
+    phase.restart("checkout: check worktree");
+    if (!checkWorktree(changes, index, view, "checkout"))
     {
-        std::cout << "Error: Commit '" << targetCommitHash << "' was not found.\n";
-        return;
+        return false;
+    }
+
+    // Every blob to write must be there before anything is touched
+    phase.restart("checkout: write worktree");
+    std::vector<const PathChange*> toWrite;
+    size_t missingBlobs = 0;
+    for (const auto& change : changes)
+    {
+        if (change.newHash.empty() || change.current)
+        {
+            continue;
+        }
+        if (!objectExists(change.newHash))
+        {
+            std::cout << "Error: Blob for file " << change.path << " not found.\n";
+            ++missingBlobs;
+            continue;
+        }
+        toWrite.push_back(&change);
     }
-    
-    // Restores each file from its blob
-    for(const auto& [fileName, blobHash] : filesToRestore) {
-        std::ifstream blob(".minigit/objects/" + blobHash);
-        if (!blob.is_open())
+    if (missingBlobs > 0)
+    {
+        std::cout << "Nothing was changed.\n";
+        return false;
+    }
+
+    // Write added and modified files, delete removed ones
+    std::vector<IndexEntry> restored;
+    std::vector<std::string> gone, failed;
+    size_t written = 0, removed = 0;
+    for (const auto& change : changes)
+    {
+        if (!change.newHash.empty())
         {
-            std::cout << "Error: Blob for file " << fileName << " not found.\n";
             continue;
         }
-        
-        std::ofstream outFile(fileName); // This overwritess the file in working dir
-        outFile << blob.rdbuf();
-        blob.close();
-        outFile.close();
+        struct stat st;
+        if (removeFile(change.path))
+        {
+            ++removed;
+        }
+        else if (lstat(change.path.c_str(), &st) == 0)
+        {
+            failed.push_back(change.path);
+            continue;
+        }
+        gone.push_back(change.path);
+    }
+
+    // Small files are read from the object store and written out a batch at
+    // a time. Large and chunked ones, and every file in hardlink mode, go
+    // through materializeBlob, which copies in the kernel or links, and in
+    // lazy mode writes placeholders.
+    MaterializeMode mode = materializeMode();
+    bool batched = mode != MaterializeMode::Hardlink && mode != MaterializeMode::Lazy;
+    for (size_t start = 0; start < toWrite.size(); start += IO_BATCH_FILES)
+    {
+        size_t count = std::min(IO_BATCH_FILES, toWrite.size() - start);
+        std::vector<std::string> ids;
+        for (size_t i = 0; i < count; ++i)
+        {
+            ids.push_back(toWrite[start + i]->newHash);
+        }
+        std::vector<std::string> contents;
+        std::vector<bool> loaded(count, false);
+        if (batched)
+        {
+            readObjects(ids, IO_BATCH_MAX_FILE, contents, loaded);
+        }
+
+        std::vector<FileWrite> files;
+        std::vector<size_t> owners; // index in the batch of each entry of files
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!loaded[i])
+            {
+                continue;
+            }
+            fs::path parent = fs::path(toWrite[start + i]->path).parent_path();
+            if (!parent.empty())
+            {
+                std::error_code ec;
+                fs::create_directories(parent, ec);
+            }
+            FileWrite file;
+            file.path = toWrite[start + i]->path;
+            file.data.swap(contents[i]);
+            files.push_back(std::move(file));
+            owners.push_back(i);
+        }
+        writeFiles(files);
+
+        std::vector<bool> done(count, false);
+        for (size_t k = 0; k < files.size(); ++k)
+        {
+            if (files[k].ok)
+            {
+                restored.push_back({files[k].path, ids[owners[k]], statRecord(files[k].st)});
+                done[owners[k]] = true;
+                ++written;
+            }
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (done[i])
+            {
+                continue;
+            }
+            if (restoreFile(toWrite[start + i]->path, ids[i], restored))
+            {
+                ++written;
+            }
+            else
+            {
+                failed.push_back(toWrite[start + i]->path);
+            }
+        }
+    }
+
+    // A partly applied checkout keeps HEAD, the index and the sparse spec as
+    // they were, so status shows every file that differs from HEAD
+    if (!failed.empty())
+    {
+        std::cout << "Error: Could not update the following files:\n";
+        for (const auto& path : failed)
+        {
+            std::cout << "    " << path << "\n";
+        }
+        std::cout << "Still on the previous branch; " << written << " files were updated and " << removed
+                  << " removed before the failure.\n";
+        return false;
+    }
+
+    // Restored files are known to be clean
+    phase.restart("checkout: update index");
+    removeIndexEntries(index, std::move(gone));
+    setIndexEntries(index, std::move(restored));
+    if (index.changed)
+    {
+        saveIndex(index);
+    }
+    bool sparseSaved = !pathspecs || saveSparse(spec);
+    if (!sparseSaved)
+    {
+        std::cout << "Error: Could not save the sparse checkout paths.\n";
     }
 
     // Updates HEAD.txt
     std::ofstream head(".minigit/HEAD.txt");
     head << branchName;
     head.close();
+    if (!head)
+    {
+        std::cout << "Error: Could not update HEAD.txt.\n";
+        return false;
+    }
 
     std::cout << "Switched to branch '" << branchName << "'.\n";
+    if (written + removed > 0)
+    {
+        std::cout << written << " files updated, " << removed << " removed.\n";
+    }
+    return sparseSaved;
+}
+
+// Replaces the placeholders a lazy checkout wrote with the files they stand
+// for: those below the pathspecs, or all of them. Only files the index knows
+// are looked at, and only those still holding a placeholder are written.
+bool hydrateFiles(const std::vector<std::string>& pathspecs)
+{
+    TraceSpan span("hydrate");
+    SparseSpec spec;
+    if (!makeSparse(pathspecs, spec))
+    {
+        return false;
+    }
+
+    MaterializeMode mode = materializeMode();
+    if (mode == MaterializeMode::Lazy)
+    {
+        mode = MaterializeMode::Auto;
+    }
+
+    StatIndex index;
+    loadIndex(index);
+    std::vector<IndexEntry> hydrated(index.entries.size());
+    std::atomic<size_t> failed{0};
+    runParallel(index.entries.size(), [&](size_t i) {
+        const std::string& path = index.entries[i].path;
+        if (!(index.entries[i].stat.flags & INDEX_LAZY) || !spec.includes(path))
+        {
+            return;
+        }
+        int in = open(path.c_str(), O_RDONLY);
+        if (in < 0)
+        {
+            return;
+        }
+        struct stat st;
+        std::string id;
+        bool placeholder = fstat(in, &st) == 0 && readPlaceholder(in, st, id) && isPlaceholderFor(&index.entries[i], id);
+        close(in);
+        if (!placeholder)
+        {
+            return;
+        }
+
+        if (!materializeBlob(id, path, mode) || stat(path.c_str(), &st) != 0)
+        {
+            std::cout << "Error: Could not write " + path + ".\n";
+            ++failed;
+            return;
+        }
+        hydrated[i] = {path, id, statRecord(st)};
+    });
+
+    std::vector<IndexEntry> updates;
+    for (auto& entry : hydrated)
+    {
+        if (!entry.path.empty())
+        {
+            updates.push_back(std::move(entry));
+        }
+    }
+    size_t count = updates.size();
+    if (count > 0)
+    {
+        setIndexEntries(index, std::move(updates));
+        saveIndex(index);
+    }
+    std::cout << "Hydrated " << count << " files" << (failed > 0 ? ", " + std::to_string(failed) + " failed" : "") << ".\n";
+    return failed == 0;
 }
 
 // 7.
-std::map<std::string, Commit> loadAllCommits() {
-    std::ifstream commitsFile(".minigit/commits.txt");
-    std::map<std::string, Commit> commits;
-    std::string line;
-
-    Commit current;
-    while (std::getline(commitsFile, line))
-    {
-        if (line.rfind("COMMIT ", 0) == 0)
-        {
-            current = Commit(); // This lets you start fresh
-            current.id = line.substr(7);
-        } else if(line.rfind("TIME ", 0) == 0) {
-            current.time = line.substr(5);
-        } else if(line.rfind("MESSAGE ", 0) == 0) {
-            current.message = line.substr(8);
-        }  else if(line.rfind("PARENT ", 0) == 0) {
-            current.parent = line.substr(7);
-        } else if(line.rfind("FILE ", 0) == 0) {
-            size_t colon = line.find(":");
-            std::string file = line.substr(5, colon - 5);
-            std::string hash = line.substr(colon + 1);
-            current.files[file] = hash;
-        } else if (line == "END") {
-            commits[current.id] = current;
-        }
-    }
-    
-    return commits;
+const std::string MERGE_HEAD_PATH = ".minigit/MERGE_HEAD.txt";
+
+// Reads a blob; a missing hash gives no content
+std::string readBlobText(const std::string& hash)
+{
+    std::string content;
+    if (!hash.empty())
+    {
+        readObject(hash, content);
+    }
+    return content;
 }
 
-void mergeBranch(const std::string& targetBranch) {
+// Merges the target branch into the current one.
+//
+// The merge base is the lowest common ancestor of the two tips in the commit
+// graph. Against it, every file is resolved on its own: a file changed on one
+// side only takes that side, and a file changed on both sides gets a
+// line-level three-way merge. Only files the target changed since the base
+// are looked at; comparing trees skips every subtree neither side touched.
+// A file removed on one side and changed on the other keeps the change.
+// A binary file changed on both sides is a conflict; this side's version
+// stays in the working directory.
+//
+// Renames are detected on both sides and followed: a file the target renamed
+// is moved here too, with the changes from both sides, and changes the
+// target made to a file this side renamed go to the new path. If both sides
+// renamed a file differently, this side's name is kept.
+//
+// Nothing is written if a file the merge would change has local edits.
+// If every file merges cleanly the merge commit is written with both tips as
+// parents. Otherwise the conflicting files are left in the working directory
+// with conflict markers, the clean results are staged, and the next commit
+// records the merge once the conflicts are fixed and added.
+//
+// In a sparse checkout the whole tree is still merged; only the working
+// directory is limited to the spec, apart from files with conflicts.
+bool mergeBranch(const std::string& targetBranch) {
+    TraceSpan span("merge");
+    TraceSpan phase("merge: find base");
+
     // Load current branch and commits
     std::ifstream headFile(".minigit/HEAD.txt");
     std::string currentBranch;
     std::getline(headFile, currentBranch);
     headFile.close();
 
-    std::ifstream branchesFile(".minigit/branches.txt");
-    std::map<std::string, std::string> branches;
-    std::string line;
+    if (fs::exists(MERGE_HEAD_PATH)) {
+        std::cout << "A merge is already in progress. Fix the conflicts, add the files and commit first.\n";
+        return false;
+    }
+
+    std::string currentCommit, targetCommit;
+    if(!readRef(targetBranch, targetCommit)) {
+        std::cout << "Branch '" << targetBranch << "' was not found.\n";
+        return false;
+    }
+    readRef(currentBranch, currentCommit);
 
-    while(std::getline(branchesFile, line)) {
-        size_t colon = line.find(":");
-        if(colon != std::string::npos) {
-            branches[line.substr(0, colon)] = line.substr(colon + 1);
+    // Load both commits
+    Commit curr, targ;
+    if (!lookupCommit(currentCommit, curr) || !lookupCommit(targetCommit, targ))
+    {
+        std::cout << "One of the commits could not be found.\n";
+        return false;
+    }
+
+    // Find the merge base
+    Commit base;
+    {
+        CommitGraph graph;
+        if (!openCommitGraph(graph))
+        {
+            std::cout << "Error: Could not read the commit graph.\n";
+            return false;
+        }
+        int64_t baseIndex = findMergeBase(graph, findCommitIndex(graph, curr.id), findCommitIndex(graph, targ.id));
+        if (baseIndex >= 0)
+        {
+            readCommitAt(*currentCommitLog(), graph.entries[baseIndex].offset, base);
         }
     }
 
-    branchesFile.close();
+    if (base.id == targ.id) {
+        std::cout << "Already up to date.\n";
+        return true;
+    }
 
-    if(branches.find(targetBranch) == branches.end()) {
-        std::cout << "Branch '" << targetBranch << "' was not found.\n";
-        return;
+    // What each side changed since the base
+    phase.restart("merge: compare trees");
+    std::string baseTree, oursTree, theirsTree;
+    JournalTransaction txn; // the merge commit; collects the trees it needs
+    if (!commitTree(base.id, baseTree) || !commitTree(curr.id, oursTree, &txn.objects) || !commitTree(targ.id, theirsTree)) {
+        std::cout << "Error: Could not read the trees to merge.\n";
+        return false;
+    }
+    std::vector<FileChange> oursList, theirsChanges;
+    auto collect = [](std::vector<FileChange>& list) {
+        return [&list](const std::string& file, const std::string& baseHash, const std::string& hash) {
+            list.push_back({file, baseHash, hash});
+        };
+    };
+    if (!diffTrees(baseTree, oursTree, "", collect(oursList)) || !diffTrees(baseTree, theirsTree, "", collect(theirsChanges))) {
+        std::cout << "Error: Could not read the trees to merge.\n";
+        return false;
+    }
+
+    phase.restart("merge: find renames");
+    std::vector<FileOrigin> oursOrigins, theirsOrigins;
+    foldRenames(oursList, oursOrigins, false);
+    foldRenames(theirsChanges, theirsOrigins, false);
+    std::map<std::string, std::string> oursChanges;
+    std::map<std::string, std::string> oursRenames; // base path -> path on this side
+    for (size_t i = 0; i < oursList.size(); ++i) {
+        oursChanges[oursList[i][0]] = oursList[i][2];
+        if (!oursOrigins[i].path.empty()) {
+            oursRenames[oursOrigins[i].path] = oursList[i][0];
+        }
     }
 
-    std::string currentCommit = branches[currentBranch];
-    std::string targetCommit = branches[targetBranch];
+    // Resolve every file the target changed
+    phase.restart("merge: resolve files");
+    std::map<std::string, std::string> mergedFiles; // result for every changed file; empty if removed
+    std::vector<std::string> changedFiles;   // result differs from the current side
+    std::vector<std::string> conflictFiles;
+    std::map<std::string, std::string> conflictContents; // text with conflict markers
 
-    // Load all commits
-    auto allCommits = loadAllCommits();
+    for (size_t i = 0; i < theirsChanges.size(); ++i) {
+        auto& [theirPath, baseHash, targetHash] = theirsChanges[i];
 
-    if (allCommits.find(currentCommit) == allCommits.end() || allCommits.find(targetCommit) == allCommits.end())
-    {
-        std::cout << "One of the commits could not be found.\n";
-        return;
+        // Find the file on this side by where it was at the base
+        std::string basePath = theirsOrigins[i].path.empty() ? theirPath : theirsOrigins[i].path;
+        auto renamed = oursRenames.find(basePath);
+        std::string ourPath = renamed == oursRenames.end() ? basePath : renamed->second;
+        auto ours = oursChanges.find(ourPath);
+        std::string oursHash = ours == oursChanges.end() ? baseHash : ours->second;
+
+        // Our name wins; a rename only the target made moves the file here
+        std::string file = renamed == oursRenames.end() ? theirPath : ourPath;
+        bool move = file != ourPath && !oursHash.empty();
+        if (move) {
+            std::cout << "Renamed " << ourPath << " to " << file << "\n";
+            mergedFiles[ourPath] = "";
+            changedFiles.push_back(ourPath);
+        }
+
+        if (oursHash == targetHash && !move) {
+            continue; // both sides made the same change
+        }
+        if (oursHash.empty() || oursHash == baseHash || oursHash == targetHash) {
+            // Only the target side changed it
+            mergedFiles[file] = targetHash;
+            changedFiles.push_back(file);
+            continue;
+        }
+        if (targetHash.empty()) {
+            continue; // removed there but changed here: keep the change
+        }
+
+        // Changed on both sides: merge line by line, unless it is binary
+        std::string baseText = readBlobText(baseHash), oursText = readBlobText(oursHash), theirsText = readBlobText(targetHash);
+        if (baseText.find('\0') < 8000 || oursText.find('\0') < 8000 || theirsText.find('\0') < 8000) {
+            std::cout << "CONFLICT (binary): both modified " << file << "; the version on '" << currentBranch << "' was kept\n";
+            conflictFiles.push_back(file);
+            continue;
+        }
+        MergeResult result = mergeLines(splitLines(baseText), splitLines(oursText), splitLines(theirsText), currentBranch, targetBranch);
+        std::string content;
+        for (const auto& mergedLine : result.lines) {
+            content += mergedLine + "\n";
+        }
+
+        // The last line keeps its newline unless a side took it away
+        auto endsInNewline = [](const std::string& text) { return text.empty() || text.back() == '\n'; };
+        bool newline = endsInNewline(oursText) == endsInNewline(baseText) ? endsInNewline(theirsText) : endsInNewline(oursText);
+        if (!newline && !content.empty()) {
+            content.pop_back();
+        }
+
+        if (result.conflicts > 0) {
+            std::cout << "CONFLICT: both modified " << file << "\n";
+            conflictContents[file] = content;
+            conflictFiles.push_back(file);
+            continue;
+        }
+
+        std::string mergedHash = hashFunc(content);
+        if (!writeObject(mergedHash, content)) {
+            std::cout << "Error: Could not store the merged " << file << ".\n";
+            return false;
+        }
+        std::cout << "Auto-merged " << file << "\n";
+        mergedFiles[file] = mergedHash;
+        changedFiles.push_back(file);
+    }
+
+    // Every path about to be written must hold this side's version, or be
+    // missing
+    phase.restart("merge: check worktree");
+    std::vector<PathChange> writes;
+    for (const auto& file : changedFiles) {
+        writes.push_back({file, findTreeEntry(oursTree, file), mergedFiles[file]});
+    }
+    for (const auto& [file, content] : conflictContents) {
+        writes.push_back({file, findTreeEntry(oursTree, file), ""});
+    }
+    StatIndex index;
+    WorktreeView view = loadIndex(index) ? viewWorktree() : WorktreeView();
+    if (!checkWorktree(writes, index, view, "merge")) {
+        return false;
+    }
+
+    // Bring the working directory up to date with the clean results; in a
+    // sparse checkout only those inside the spec are written. Every file is
+    // written before any is removed, so a failed write (a conflict at the
+    // new path of a renamed file, say) never leaves a file with no copy.
+    phase.restart("merge: write worktree");
+    std::vector<FileWrite> conflictWrites;
+    for (const auto& [file, content] : conflictContents) {
+        fs::path parent = fs::path(file).parent_path();
+        if (!parent.empty()) {
+            std::error_code ec;
+            fs::create_directories(parent, ec);
+        }
+        FileWrite write;
+        write.path = file;
+        write.data = content;
+        conflictWrites.push_back(std::move(write));
+    }
+    writeFiles(conflictWrites);
+
+    SparseSpec spec = loadSparse();
+    std::vector<IndexEntry> restored;
+    std::vector<std::string> unwritten;
+    for (const auto& write : conflictWrites) {
+        if (!write.ok) {
+            unwritten.push_back(write.path);
+        }
+    }
+    for (const auto& file : changedFiles) {
+        if (!mergedFiles[file].empty() && spec.includes(file) && !restoreFile(file, mergedFiles[file], restored)) {
+            unwritten.push_back(file);
+        }
+    }
+    if (!unwritten.empty()) {
+        std::cout << "Error: Could not write the following files; no file was removed and nothing was staged:\n";
+        for (const auto& file : unwritten) {
+            std::cout << "    " << file << "\n";
+        }
+        return false;
+    }
+
+    std::vector<std::string> removedFiles;
+    for (const auto& file : changedFiles) {
+        if (mergedFiles[file].empty()) {
+            removeFile(file);
+            removedFiles.push_back(file);
+        }
+    }
+    setIndexEntries(index, std::move(restored));
+    removeIndexEntries(index, std::move(removedFiles));
+    saveIndex(index);
+
+    if (!conflictFiles.empty()) {
+        // Stage the clean results, removals as an empty hash; the next
+        // commit finishes the merge
+        std::ofstream staging(".minigit/staging.txt", std::ios::app);
+        for (const auto& file : changedFiles) {
+            staging << file << ":" << mergedFiles[file] << "\n";
+        }
+        staging.close();
+
+        std::ofstream mergeHead(MERGE_HEAD_PATH);
+        mergeHead << targ.id << "\n";
+        mergeHead.close();
+
+        std::cout << "Automatic merge failed; fix the conflicts, add the files and commit the result.\n";
+        return false;
     }
-    
-    Commit curr = allCommits[currentCommit];
-    Commit targ = allCommits[targetCommit];
+
+    phase.restart("merge: commit");
     Commit merged;
 
     merged.parent = curr.id;
+    merged.parent2 = targ.id;
     merged.message = "Merged branch '" + targetBranch + "'";
+    merged.author = commitAuthor();
 
     std::time_t now = std::time(nullptr);
     merged.time = std::ctime(&now);
     merged.time.pop_back(); // Removes newline for us
 
-    merged.id = hashFunc(merged.time + merged.message);
-
-    // Merge files
-    for(auto& [file, hash] : curr.files) {
-        merged.files[file] = hash;
-    }
-
-    for(auto& [file, targetHash] : targ.files) {
-        if(merged.files.count(file) == 0) {
-            //file only in target -> add
-            merged.files[file] = targetHash;
-        } else if(merged.files[file] != targetHash) {
-            // Conflict
-            std::cout << "CONFLICT: both modified " << file << "\n";
-            // keep current version but notify
-        }
+    merged.files = mergedFiles;
+    if (!buildTree(oursTree, mergedFiles, merged.tree, &txn.objects)) {
+        std::cout << "Error: Could not write the merged tree.\n";
+        return false;
     }
 
-    // Write commit
-    std::ofstream commits(".minigit/commits.txt", std::ios::app);
-    commits << "COMMIT " << merged.id << "\n";
-    commits << "TIME " << merged.time << "\n";
-    commits << "MESSAGE " << merged.message << "\n";
-    commits << "PARENT " << merged.parent << "\n";
+    // Write commit; its ID comes from everything in the record
+    std::ostringstream record;
+    record << "TIME " << merged.time << "\n";
+    record << "MESSAGE " << merged.message << "\n";
+    record << "AUTHOR " << merged.author << "\n";
+    record << "PARENT " << merged.parent << "\n";
+    record << "PARENT2 " << merged.parent2 << "\n";
+    record << "TREE " << merged.tree << "\n";
     for(const auto& [file, hash] : merged.files) {
-        commits << "FILE " << file << ":" << hash << "\n";
-    }
-    commits << "END\n\n";
-    commits.close();
-
-
-    // Update current branch pointer
-    std::ofstream branchesOut(".minigit/branches.txt");
-    for(auto& [branch, hash] : branches) {
-        if (branch == currentBranch) 
-        {
-            branchesOut << branch << ":" << merged.id << "\n";
-        } else {
-            branchesOut << branch << ":" << hash << "\n";
+        if (!hash.empty()) {
+            record << "FILE " << file << ":" << hash << "\n";
+            txn.objects.push_back(hash);
         }
     }
+    merged.id = generateCommitID(record.str());
 
-    branchesOut.close();
+    // Update current branch pointer along with it
+    txn.commitID = merged.id;
+    txn.branch = currentBranch;
+    txn.oldHash = currentCommit;
+    txn.record = "COMMIT " + merged.id + "\n" + record.str() + "END\n\n";
+    if (!journalCommit(txn)) {
+        std::cout << "Error: Could not update branch '" << currentBranch << "'; it is locked or was moved by another command.\n";
+        return false;
+    }
 
     std::cout << "Merge complete! Commit ID: " << merged.id << "\n";
+    return true;
 }
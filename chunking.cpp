@@ -0,0 +1,212 @@
+// Content-defined chunking
+//
+// Files of CHUNK_MIN_FILE_SIZE and up are split into chunks whose boundaries
+// depend on the content, not on offsets (FastCDC): a Gear rolling hash runs
+// over the bytes and a boundary is placed where its top bits are all zero.
+// An edit in the middle of a file therefore only changes the chunks around
+// it; every other chunk keeps its ID and is already in the object store.
+//
+// Chunks are between CHUNK_MIN_SIZE and CHUNK_MAX_SIZE and average about
+// CHUNK_AVG_SIZE. Normalized chunking uses a stricter mask before the average
+// size and a looser one after it, which narrows the size spread.
+//
+// The Gear table must never change: it decides where chunks are cut, and
+// with it which chunk IDs existing repositories share with new versions.
+
+const uint64_t CHUNK_MIN_FILE_SIZE = 1024 * 1024;
+const size_t CHUNK_MIN_SIZE = 16 * 1024;
+const size_t CHUNK_AVG_SIZE = 64 * 1024;
+const size_t CHUNK_MAX_SIZE = 256 * 1024;
+const uint64_t CHUNK_MASK_STRICT = ~0ULL << (64 - 18); // 18 bits, before the average
+const uint64_t CHUNK_MASK_LOOSE = ~0ULL << (64 - 14);  // 14 bits, after it
+
+struct GearTable
+{
+    uint64_t values[256];
+
+    GearTable()
+    {
+        // splitmix64 from a fixed seed
+        uint64_t state = 0x6d696e6967697463ULL;
+        for (auto& value : values)
+        {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+    }
+};
+
+const GearTable GEAR;
+
+// Length of the next chunk at the start of data. If no boundary is found the
+// whole of data (at most CHUNK_MAX_SIZE) is one chunk.
+size_t findChunkBoundary(const uint8_t* data, size_t size)
+{
+    if (size <= CHUNK_MIN_SIZE)
+    {
+        return size;
+    }
+
+    size_t limit = std::min(size, CHUNK_MAX_SIZE);
+    size_t normal = std::min(limit, CHUNK_AVG_SIZE);
+    uint64_t hash = 0;
+    size_t i = CHUNK_MIN_SIZE;
+
+    for (; i < normal; ++i)
+    {
+        hash = (hash << 1) + GEAR.values[data[i]];
+        if ((hash & CHUNK_MASK_STRICT) == 0)
+        {
+            return i + 1;
+        }
+    }
+    for (; i < limit; ++i)
+    {
+        hash = (hash << 1) + GEAR.values[data[i]];
+        if ((hash & CHUNK_MASK_LOOSE) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+// Writes a blob as chunks plus a manifest. Like ObjectWriter it takes the
+// content in pieces and only learns the blob ID at commit(). At most one
+// chunk's worth of data is held in memory.
+struct ChunkedWriter
+{
+    std::string pending;
+    std::string manifest;
+    uint64_t newBytes = 0; // bytes of chunks that were not stored yet
+
+    bool open()
+    {
+        pending.clear();
+        manifest.assign(CHUNK_MAGIC, sizeof(CHUNK_MAGIC));
+        newBytes = 0;
+        return true;
+    }
+
+    bool storeChunk(const char* data, size_t size)
+    {
+        HashState state;
+        hashUpdate(state, data, size);
+        std::string id = hashDigest(state);
+
+        if (objectExists(id))
+        {
+            freshenObject(id);
+        }
+        else
+        {
+            if (!writeObject(id, std::string(data, size)))
+            {
+                return false;
+            }
+            newBytes += size;
+        }
+        manifest += std::to_string(size) + " " + id + "\n";
+        return true;
+    }
+
+    // Cuts chunks while more than a maximum-size chunk is buffered, so every
+    // cut sees as much data as it could use
+    bool write(const char* data, size_t size)
+    {
+        pending.append(data, size);
+        size_t pos = 0;
+        while (pending.size() - pos > CHUNK_MAX_SIZE)
+        {
+            size_t length = findChunkBoundary(reinterpret_cast<const uint8_t*>(pending.data()) + pos, pending.size() - pos);
+            if (!storeChunk(pending.data() + pos, length))
+            {
+                return false;
+            }
+            pos += length;
+        }
+        pending.erase(0, pos);
+        return true;
+    }
+
+    bool commit(const std::string& id)
+    {
+        size_t pos = 0;
+        while (pos < pending.size())
+        {
+            size_t length = findChunkBoundary(reinterpret_cast<const uint8_t*>(pending.data()) + pos, pending.size() - pos);
+
+            // A blob that is its own only chunk would store the chunk under
+            // the manifest's ID. Only small content that looks like a
+            // manifest gets here, and it is cut in two.
+            if (manifest.size() == sizeof(CHUNK_MAGIC) && length == pending.size() && length > 1)
+            {
+                length /= 2;
+            }
+            if (!storeChunk(pending.data() + pos, length))
+            {
+                return false;
+            }
+            pos += length;
+        }
+        pending.clear();
+        return writeObject(id, manifest);
+    }
+
+    void abort()
+    {
+        // Chunks already stored are harmless; they are just not referenced
+        pending.clear();
+    }
+};
+
+// Stores a blob whole or chunked, depending on its size. Content that starts
+// with CHUNK_MAGIC is always chunked, so it can never be mistaken for a
+// manifest.
+struct BlobWriter
+{
+    bool chunked = false;
+    ObjectWriter whole;
+    ChunkedWriter chunks;
+    bool started = false;
+
+    bool open(uint64_t expectedSize)
+    {
+        chunked = expectedSize >= CHUNK_MIN_FILE_SIZE && getConfig("chunking", "on") != "off";
+        return chunked ? chunks.open() : whole.open();
+    }
+
+    bool write(const char* data, size_t size)
+    {
+        if (!started)
+        {
+            started = true;
+            if (!chunked && size >= sizeof(CHUNK_MAGIC) && memcmp(data, CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) == 0)
+            {
+                whole.abort();
+                chunked = true;
+                chunks.open();
+            }
+        }
+        return chunked ? chunks.write(data, size) : whole.write(data, size);
+    }
+
+    bool commit(const std::string& id)
+    {
+        return chunked ? chunks.commit(id) : whole.commit(id);
+    }
+
+    void abort()
+    {
+        if (chunked)
+        {
+            chunks.abort();
+        }
+        else
+        {
+            whole.abort();
+        }
+    }
+};
@@ -0,0 +1,776 @@
+// Commit graph
+//
+// commits.txt is an append-only text log, so finding a commit in it means
+// reading it from the start. The commit graph is a binary index over it:
+//
+//   .minigit/commit-graph         header + one fixed-size entry per commit, in
+//                                 the same order as commits.txt
+//   .minigit/commit-graph.lookup  entry positions sorted by commit ID
+//
+// Entries are only ever appended, so a parent is always stored before its
+// children and is referenced by position. New entries land in an unsorted
+// tail (scanned linearly) until it grows past LOOKUP_TAIL_LIMIT, then the
+// lookup table is rebuilt. The graph remembers how much of commits.txt it
+// covers, so updating it only parses the commits appended since.
+//
+// Each entry also stores its generation number: 1 for a root commit, else one
+// more than the highest generation of its parents. An ancestor always has a
+// lower generation than its descendants, which lets merge-base searches stop
+// early instead of walking the whole history.
+//
+// .minigit/commit-graph.bloom holds a changed-path Bloom filter per commit:
+// the paths that differ from its first parent plus every directory above
+// them. A path-limited log tests the filter and only reads the commits it
+// says may have touched the path. An entry's bloomOffset points at its
+// filter (uint32 size, then the bits); 0 means it has none. A commit that
+// changed more than BLOOM_MAX_PATHS paths gets a single all-ones byte, which
+// matches everything.
+
+const std::string COMMIT_GRAPH_PATH = ".minigit/commit-graph";
+const std::string COMMIT_LOOKUP_PATH = ".minigit/commit-graph.lookup";
+const std::string COMMIT_BLOOM_PATH = ".minigit/commit-graph.bloom";
+const uint32_t COMMIT_GRAPH_VERSION = 3;
+const uint32_t NO_PARENT = 0xFFFFFFFF;
+const size_t LOOKUP_TAIL_LIMIT = 1024;
+const size_t COMMIT_ID_SIZE = 64;
+const size_t BLOOM_BITS_PER_PATH = 10;
+const uint32_t BLOOM_HASHES = 7;
+const size_t BLOOM_MAX_PATHS = 512;
+
+struct GraphHeader
+{
+    char magic[4];          // "MGCG"
+    uint32_t version;
+    uint64_t count;         // number of entries
+    uint64_t indexedSize;   // bytes of commits.txt covered by the entries
+};
+
+struct GraphEntry
+{
+    char id[COMMIT_ID_SIZE]; // commit ID, NUL-padded
+    uint64_t offset;         // offset of the COMMIT line in commits.txt
+    int64_t timestamp;
+    uint32_t parent;         // entry index of the parent, or NO_PARENT
+    uint32_t parent2;        // second parent of a merge commit, or NO_PARENT
+    uint32_t generation;
+    uint32_t bloomOffset;    // changed-path filter in commit-graph.bloom, or 0
+};
+
+struct LookupHeader
+{
+    char magic[4];          // "MGCL"
+    uint32_t version;
+    uint64_t count;         // number of sorted positions that follow
+};
+
+struct BloomHeader
+{
+    char magic[4];          // "MGCB"
+    uint32_t version;
+};
+
+// Read-only view of the commit graph, memory-mapped
+struct CommitGraph
+{
+    const GraphEntry* entries = nullptr;
+    size_t count = 0;
+    const uint32_t* sorted = nullptr;
+    size_t sortedCount = 0;
+
+    void* graphMap = nullptr;
+    size_t graphSize = 0;
+    void* lookupMap = nullptr;
+    size_t lookupSize = 0;
+    const uint8_t* bloom = nullptr;
+    size_t bloomSize = 0;
+    void* bloomMap = nullptr;
+    std::shared_ptr<CommitGraph> shared; // cached mapping this view borrows
+
+    CommitGraph() = default;
+    CommitGraph(const CommitGraph&) = delete;
+    CommitGraph& operator=(const CommitGraph&) = delete;
+
+    ~CommitGraph()
+    {
+        if (graphMap) munmap(graphMap, graphSize);
+        if (lookupMap) munmap(lookupMap, lookupSize);
+        if (bloomMap) munmap(bloomMap, bloomSize);
+    }
+};
+
+std::string entryID(const GraphEntry& entry)
+{
+    return std::string(entry.id, strnlen(entry.id, COMMIT_ID_SIZE));
+}
+
+int compareEntryID(const GraphEntry& entry, const std::string& id)
+{
+    return strncmp(entry.id, id.c_str(), COMMIT_ID_SIZE);
+}
+
+// Maps a whole file read-only. Returns nullptr if it is missing or empty.
+void* mapFile(const std::string& path, size_t& size)
+{
+    size = 0;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    traceCount(TraceFilesOpened);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    size = st.st_size;
+    return map;
+}
+
+// True if a file was not replaced or modified between two stat calls.
+// A missing file (zeroed stat) only matches another missing file.
+bool sameFileState(const struct stat& a, const struct stat& b)
+{
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+        && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+// Converts a TIME line ("Sat Oct 17 23:17:40 2026") back to a timestamp
+int64_t parseCommitTime(const std::string& timeStr)
+{
+    std::tm tm = {};
+    if (strptime(timeStr.c_str(), "%a %b %d %H:%M:%S %Y", &tm) == nullptr)
+    {
+        return 0;
+    }
+    tm.tm_isdst = -1;
+    return std::mktime(&tm);
+}
+
+// Index of the first commit with this ID, or -1
+int64_t findCommitIndex(const CommitGraph& graph, const std::string& id)
+{
+    if (id.empty() || id.size() > COMMIT_ID_SIZE)
+    {
+        return -1;
+    }
+
+    // Binary search over the sorted part
+    const uint32_t* begin = graph.sorted;
+    const uint32_t* end = graph.sorted + graph.sortedCount;
+    const uint32_t* it = std::lower_bound(begin, end, id, [&](uint32_t pos, const std::string& key) {
+        return compareEntryID(graph.entries[pos], key) < 0;
+    });
+    if (it != end && compareEntryID(graph.entries[*it], id) == 0)
+    {
+        return *it;
+    }
+
+    // Commits added since the lookup table was last rebuilt
+    for (size_t i = graph.sortedCount; i < graph.count; ++i)
+    {
+        if (compareEntryID(graph.entries[i], id) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Changed-path filters
+
+// Two hashes of a path; bit i of its BLOOM_HASHES is h1 + i * h2
+struct BloomKey
+{
+    uint32_t h1;
+    uint32_t h2;
+};
+
+BloomKey bloomKey(std::string_view path)
+{
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (unsigned char c : path)
+    {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return {(uint32_t)hash, (uint32_t)(hash >> 32) | 1};
+}
+
+bool bloomMayContain(const uint8_t* bits, size_t size, const BloomKey& key)
+{
+    uint64_t bitCount = (uint64_t)size * 8;
+    if (bitCount == 0)
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < BLOOM_HASHES; ++i)
+    {
+        uint64_t bit = (key.h1 + (uint64_t)i * key.h2) % bitCount;
+        if (!(bits[bit / 8] & (1 << (bit % 8))))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Builds the filter for a commit's changed paths and their directories
+std::string buildBloomFilter(const std::vector<std::string>& paths)
+{
+    std::set<std::string_view> keys;
+    for (const auto& path : paths)
+    {
+        std::string_view rest(path);
+        for (size_t slash = rest.find('/'); slash != std::string::npos; slash = rest.find('/', slash + 1))
+        {
+            keys.insert(rest.substr(0, slash));
+        }
+        keys.insert(rest);
+        if (keys.size() > BLOOM_MAX_PATHS)
+        {
+            return std::string(1, '\xff');
+        }
+    }
+
+    std::string filter((keys.size() * BLOOM_BITS_PER_PATH + 7) / 8, '\0');
+    uint64_t bitCount = (uint64_t)filter.size() * 8;
+    for (const auto& path : keys)
+    {
+        BloomKey key = bloomKey(path);
+        for (uint32_t i = 0; i < BLOOM_HASHES; ++i)
+        {
+            uint64_t bit = (key.h1 + (uint64_t)i * key.h2) % bitCount;
+            filter[bit / 8] |= (char)(1 << (bit % 8));
+        }
+    }
+    return filter;
+}
+
+// Whether the commit at index may have changed one of the paths (given as
+// keys). Commits without a filter always may.
+bool commitMayChange(const CommitGraph& graph, size_t index, const std::vector<BloomKey>& keys)
+{
+    uint64_t offset = graph.entries[index].bloomOffset;
+    uint32_t size;
+    if (offset == 0 || !graph.bloom || offset + sizeof(size) > graph.bloomSize)
+    {
+        return true;
+    }
+    memcpy(&size, graph.bloom + offset, sizeof(size));
+    if (offset + sizeof(size) + size > graph.bloomSize)
+    {
+        return true;
+    }
+    for (const auto& key : keys)
+    {
+        if (bloomMayContain(graph.bloom + offset + sizeof(size), size, key))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool diffTrees(const std::string& oldId, const std::string& newId, const std::string& prefix,
+               const std::function<void(const std::string& path, const std::string& oldBlob, const std::string& newBlob)>& onChange);
+
+// Writes the lookup table for all entries of the graph file
+bool rebuildCommitLookup(int graphFd, uint64_t count)
+{
+    std::vector<GraphEntry> entries(count);
+    if (count > 0 && pread(graphFd, entries.data(), count * sizeof(GraphEntry), sizeof(GraphHeader)) != (ssize_t)(count * sizeof(GraphEntry)))
+    {
+        return false;
+    }
+
+    std::vector<uint32_t> sorted(count);
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        sorted[i] = i;
+    }
+
+    // Stable so that the first of two commits with the same ID wins
+    std::stable_sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b) {
+        return strncmp(entries[a].id, entries[b].id, COMMIT_ID_SIZE) < 0;
+    });
+
+    LookupHeader header = {{'M', 'G', 'C', 'L'}, COMMIT_GRAPH_VERSION, count};
+    std::string tmpPath = COMMIT_LOOKUP_PATH + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(sorted.data()), count * sizeof(uint32_t));
+    out.close();
+    if (!out)
+    {
+        return false;
+    }
+
+    return std::rename(tmpPath.c_str(), COMMIT_LOOKUP_PATH.c_str()) == 0;
+}
+
+// Computes the changed-path filters of new entries, appends them to
+// commit-graph.bloom and sets the entries' bloomOffset. A commit with a tree
+// is compared with its first parent's tree; one from before trees has its
+// FILE lines.
+bool writeBloomFilters(const GraphHeader& header, const CommitGraph& graph, std::vector<GraphEntry>& batch,
+                       const std::vector<std::pair<std::string, std::vector<std::string>>>& changes, bool rebuild)
+{
+    TraceSpan span("commit-graph: bloom filters");
+    int fd = open(COMMIT_BLOOM_PATH.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    traceCount(TraceFilesOpened);
+
+    BloomHeader bloomHeader = {{'M', 'G', 'C', 'B'}, COMMIT_GRAPH_VERSION};
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (rebuild || end < (off_t)sizeof(bloomHeader))
+    {
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, &bloomHeader, sizeof(bloomHeader), 0) != sizeof(bloomHeader))
+        {
+            close(fd);
+            return false;
+        }
+        end = sizeof(bloomHeader);
+    }
+
+    std::shared_ptr<CommitLog> log = currentCommitLog();
+    std::string data;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        const auto& [tree, files] = changes[i];
+        uint32_t parent = batch[i].parent;
+        std::string parentTree;
+        if (parent != NO_PARENT && parent >= header.count)
+        {
+            parentTree = changes[parent - header.count].first;
+        }
+        else if (parent != NO_PARENT)
+        {
+            CommitView c;
+            parseCommitView(*log, graph.entries[parent].offset, c);
+            parentTree = c.tree;
+        }
+
+        std::vector<std::string> paths;
+        bool known = true;
+        if (!tree.empty() && (parent == NO_PARENT || !parentTree.empty()))
+        {
+            known = diffTrees(parentTree, tree, "", [&](const std::string& path, const std::string&, const std::string&) {
+                paths.push_back(path);
+            });
+        }
+        else
+        {
+            paths = files;
+        }
+
+        uint64_t offset = end + data.size();
+        if (!known || offset > UINT32_MAX)
+        {
+            batch[i].bloomOffset = 0;
+            continue;
+        }
+        std::string filter = buildBloomFilter(paths);
+        uint32_t size = filter.size();
+        data.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        data += filter;
+        batch[i].bloomOffset = offset;
+    }
+
+    bool ok = data.empty() || pwrite(fd, data.data(), data.size(), end) == (ssize_t)data.size();
+    close(fd);
+    return ok;
+}
+
+// Reads the graph header; false if the graph is missing, from an older
+// version, or does not fit commits.txt and commit-graph.bloom any more
+bool readGraphHeader(int fd, GraphHeader& header, uint64_t commitsSize)
+{
+    bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header.magic, "MGCG", 4) == 0
+        && header.version == COMMIT_GRAPH_VERSION
+        && header.indexedSize <= commitsSize;
+
+    // The filters of existing entries must still be in commit-graph.bloom
+    GraphEntry last;
+    struct stat bloomStat;
+    if (valid && header.count > 0
+        && (pread(fd, &last, sizeof(last), sizeof(GraphHeader) + (header.count - 1) * sizeof(GraphEntry)) != sizeof(last)
+            || stat(COMMIT_BLOOM_PATH.c_str(), &bloomStat) != 0 || (uint64_t)bloomStat.st_size <= last.bloomOffset))
+    {
+        valid = false;
+    }
+    return valid;
+}
+
+// Brings the commit graph up to date with commits.txt, parsing only the
+// commits appended since the last update. Creates the graph on first use.
+bool updateCommitGraph()
+{
+    TraceSpan span("commit-graph: update");
+    int fd = open(COMMIT_GRAPH_PATH.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    traceCount(TraceFilesOpened);
+
+    // Seeing that the graph is current only takes a shared lock, so readers
+    // do not wait for each other
+    GraphHeader header;
+    uint64_t commitsSize = fs::exists(".minigit/commits.txt") ? fs::file_size(".minigit/commits.txt") : 0;
+    if (flock(fd, LOCK_SH) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    if (readGraphHeader(fd, header, commitsSize) && header.indexedSize == commitsSize)
+    {
+        close(fd);
+        return true;
+    }
+
+    // Other processes may be appending to the graph at the same time; one
+    // may have done this update while the lock was upgraded
+    if (flock(fd, LOCK_EX) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    commitsSize = fs::exists(".minigit/commits.txt") ? fs::file_size(".minigit/commits.txt") : 0;
+    bool valid = readGraphHeader(fd, header, commitsSize);
+
+    if (!valid)
+    {
+        // Missing, from an older version, or commits.txt was rewritten: start over
+        header = {{'M', 'G', 'C', 'G'}, COMMIT_GRAPH_VERSION, 0, 0};
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        {
+            close(fd);
+            return false;
+        }
+        std::remove(COMMIT_LOOKUP_PATH.c_str());
+    }
+
+    if (header.indexedSize == commitsSize)
+    {
+        close(fd);
+        return true;
+    }
+
+    // Parent IDs of new commits resolve against the existing graph or the new batch
+    CommitGraph graph;
+    size_t lookupCount = 0;
+    if (header.count > 0)
+    {
+        graph.graphMap = mapFile(COMMIT_GRAPH_PATH, graph.graphSize);
+        graph.lookupMap = mapFile(COMMIT_LOOKUP_PATH, graph.lookupSize);
+        if (graph.graphMap)
+        {
+            graph.entries = reinterpret_cast<const GraphEntry*>(static_cast<char*>(graph.graphMap) + sizeof(GraphHeader));
+            graph.count = header.count;
+        }
+        if (graph.lookupMap && graph.lookupSize >= sizeof(LookupHeader))
+        {
+            auto lookupHeader = static_cast<const LookupHeader*>(graph.lookupMap);
+            graph.sorted = reinterpret_cast<const uint32_t*>(lookupHeader + 1);
+            graph.sortedCount = std::min<uint64_t>(lookupHeader->count, header.count);
+            lookupCount = graph.sortedCount;
+        }
+    }
+
+    std::unordered_map<std::string, uint32_t> batchIDs;
+    std::vector<GraphEntry> batch;
+    std::vector<std::pair<std::string, std::string>> batchParents;
+    std::vector<std::pair<std::string, std::vector<std::string>>> batchChanges; // tree, FILE paths
+
+    std::shared_ptr<CommitLog> log = currentCommitLog();
+    std::string_view text = log->text();
+    uint64_t pos = header.indexedSize;
+    uint64_t indexedSize = header.indexedSize;
+    CommitView view;
+    while (pos < text.size())
+    {
+        if (text.compare(pos, 7, "COMMIT ") != 0 || !parseCommitView(*log, pos, view))
+        {
+            // Not the start of a whole record: a torn one, or one still
+            // being written
+            size_t newline = text.find('\n', pos);
+            pos = newline == std::string_view::npos ? text.size() : newline + 1;
+            continue;
+        }
+
+        GraphEntry current = {};
+        memcpy(current.id, view.id.data(), std::min(view.id.size(), COMMIT_ID_SIZE));
+        current.offset = pos;
+        current.timestamp = parseCommitTime(std::string(view.time));
+        std::vector<std::string> files;
+        forEachCommitFile(view, [&](std::string_view file, std::string_view) { files.emplace_back(file); });
+
+        batchIDs.emplace(entryID(current), header.count + batch.size());
+        batch.push_back(current);
+        batchParents.push_back({std::string(view.parent), std::string(view.parent2)});
+        batchChanges.push_back({std::string(view.tree), std::move(files)});
+
+        // Blank separators after a record belong to it
+        pos = view.end;
+        while (pos < text.size() && text[pos] == '\n')
+        {
+            ++pos;
+        }
+        indexedSize = pos;
+    }
+
+    // Resolves a parent ID to an entry index; parents always come first
+    auto resolveParent = [&](const std::string& id, size_t i) -> uint32_t {
+        if (id.empty())
+        {
+            return NO_PARENT;
+        }
+        int64_t parentIndex = findCommitIndex(graph, id);
+        if (parentIndex < 0)
+        {
+            auto it = batchIDs.find(id);
+            if (it != batchIDs.end() && it->second < header.count + i)
+            {
+                parentIndex = it->second;
+            }
+        }
+        return parentIndex >= 0 ? (uint32_t)parentIndex : NO_PARENT;
+    };
+    auto generationOf = [&](uint32_t index) -> uint32_t {
+        if (index == NO_PARENT)
+        {
+            return 0;
+        }
+        return index < header.count ? graph.entries[index].generation : batch[index - header.count].generation;
+    };
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        batch[i].parent = resolveParent(batchParents[i].first, i);
+        batch[i].parent2 = resolveParent(batchParents[i].second, i);
+        batch[i].generation = std::max(generationOf(batch[i].parent), generationOf(batch[i].parent2)) + 1;
+    }
+
+    if (!writeBloomFilters(header, graph, batch, batchChanges, !valid))
+    {
+        close(fd);
+        return false;
+    }
+
+    // Append the entries, then publish them by updating the header
+    off_t entriesEnd = sizeof(GraphHeader) + header.count * sizeof(GraphEntry);
+    size_t batchBytes = batch.size() * sizeof(GraphEntry);
+    if (batchBytes > 0 && pwrite(fd, batch.data(), batchBytes, entriesEnd) != (ssize_t)batchBytes)
+    {
+        close(fd);
+        return false;
+    }
+
+    header.count += batch.size();
+    header.indexedSize = indexedSize;
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        close(fd);
+        return false;
+    }
+
+    bool ok = true;
+    if (header.count - lookupCount > LOOKUP_TAIL_LIMIT || (lookupCount == 0 && header.count > 0 && !graph.lookupMap))
+    {
+        ok = rebuildCommitLookup(fd, header.count);
+    }
+
+    close(fd);
+    return ok;
+}
+
+// Maps the graph files into a new CommitGraph
+bool mapCommitGraph(CommitGraph& graph)
+{
+    graph.graphMap = mapFile(COMMIT_GRAPH_PATH, graph.graphSize);
+    if (!graph.graphMap || graph.graphSize < sizeof(GraphHeader))
+    {
+        return false;
+    }
+
+    auto header = static_cast<const GraphHeader*>(graph.graphMap);
+    graph.entries = reinterpret_cast<const GraphEntry*>(header + 1);
+    graph.count = std::min<uint64_t>(header->count, (graph.graphSize - sizeof(GraphHeader)) / sizeof(GraphEntry));
+
+    graph.lookupMap = mapFile(COMMIT_LOOKUP_PATH, graph.lookupSize);
+    if (graph.lookupMap && graph.lookupSize >= sizeof(LookupHeader))
+    {
+        auto lookupHeader = static_cast<const LookupHeader*>(graph.lookupMap);
+        size_t stored = (graph.lookupSize - sizeof(LookupHeader)) / sizeof(uint32_t);
+        graph.sorted = reinterpret_cast<const uint32_t*>(lookupHeader + 1);
+        graph.sortedCount = std::min<uint64_t>({lookupHeader->count, stored, graph.count});
+    }
+
+    graph.bloomMap = mapFile(COMMIT_BLOOM_PATH, graph.bloomSize);
+    graph.bloom = static_cast<const uint8_t*>(graph.bloomMap);
+
+    return true;
+}
+
+// Updates the commit graph and gives a view of it. The mapping is shared and
+// kept until the graph files change, so a long-running process (batch mode)
+// maps it once instead of on every lookup.
+bool openCommitGraph(CommitGraph& graph)
+{
+    if (!updateCommitGraph())
+    {
+        return false;
+    }
+
+    static std::mutex cacheLock;
+    static std::shared_ptr<CommitGraph> cached;
+    static struct stat cachedGraphStat, cachedLookupStat;
+
+    struct stat graphStat = {}, lookupStat = {};
+    stat(COMMIT_GRAPH_PATH.c_str(), &graphStat);
+    stat(COMMIT_LOOKUP_PATH.c_str(), &lookupStat);
+
+    std::lock_guard<std::mutex> guard(cacheLock);
+    if (!cached || !sameFileState(graphStat, cachedGraphStat) || !sameFileState(lookupStat, cachedLookupStat))
+    {
+        auto fresh = std::make_shared<CommitGraph>();
+        if (!mapCommitGraph(*fresh))
+        {
+            return false;
+        }
+        cached = fresh;
+        cachedGraphStat = graphStat;
+        cachedLookupStat = lookupStat;
+    }
+
+    graph.entries = cached->entries;
+    graph.count = cached->count;
+    graph.sorted = cached->sorted;
+    graph.sortedCount = cached->sortedCount;
+    graph.bloom = cached->bloom;
+    graph.bloomSize = cached->bloomSize;
+    graph.shared = cached;
+    return true;
+}
+
+// Copies the commit record starting at offset out of the mapped log. FILE
+// lines are skipped unless withFiles is set, which keeps history walks cheap.
+bool readCommitAt(const CommitLog& log, uint64_t offset, Commit& commit, bool withFiles = true)
+{
+    CommitView view;
+    if (!parseCommitView(log, offset, view))
+    {
+        return false;
+    }
+
+    commit = Commit();
+    commit.id = view.id;
+    commit.time = view.time;
+    commit.message = view.message;
+    commit.author = view.author;
+    commit.parent = view.parent;
+    commit.parent2 = view.parent2;
+    commit.tree = view.tree;
+    if (withFiles)
+    {
+        forEachCommitFile(view, [&](std::string_view file, std::string_view hash) {
+            commit.files[std::string(file)] = hash;
+        });
+    }
+    return true;
+}
+
+// Looks a commit up by ID through the commit graph
+bool lookupCommit(const std::string& id, Commit& commit)
+{
+    CommitGraph graph;
+    if (!openCommitGraph(graph))
+    {
+        return false;
+    }
+
+    int64_t index = findCommitIndex(graph, id);
+    if (index < 0)
+    {
+        return false;
+    }
+
+    return readCommitAt(*currentCommitLog(), graph.entries[index].offset, commit);
+}
+
+// Finds the best common ancestor of two commits (entry indices), or -1.
+// Commits are visited highest generation first, so every descendant of a
+// commit has been visited before it; the first commit reached from both
+// sides is therefore a lowest common ancestor, and nothing below its
+// generation is ever read.
+int64_t findMergeBase(const CommitGraph& graph, int64_t a, int64_t b)
+{
+    if (a < 0 || b < 0)
+    {
+        return -1;
+    }
+    if (a == b)
+    {
+        return a;
+    }
+
+    const uint8_t FROM_A = 1, FROM_B = 2;
+    std::unordered_map<uint32_t, uint8_t> reached;
+    auto byGeneration = [&](uint32_t x, uint32_t y) {
+        return graph.entries[x].generation < graph.entries[y].generation;
+    };
+    std::priority_queue<uint32_t, std::vector<uint32_t>, decltype(byGeneration)> queue(byGeneration);
+
+    reached[a] = FROM_A;
+    reached[b] = FROM_B;
+    queue.push(a);
+    queue.push(b);
+
+    while (!queue.empty())
+    {
+        uint32_t index = queue.top();
+        queue.pop();
+
+        uint8_t flags = reached[index];
+        if (flags == (FROM_A | FROM_B))
+        {
+            return index;
+        }
+
+        for (uint32_t parent : {graph.entries[index].parent, graph.entries[index].parent2})
+        {
+            if (parent == NO_PARENT || parent >= graph.count)
+            {
+                continue;
+            }
+            uint8_t& parentFlags = reached[parent];
+            if ((parentFlags | flags) != parentFlags)
+            {
+                // Already queued entries just pick up the extra flag
+                bool queued = parentFlags != 0;
+                parentFlags |= flags;
+                if (!queued)
+                {
+                    queue.push(parent);
+                }
+            }
+        }
+    }
+
+    return -1;
+}
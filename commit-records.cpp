@@ -0,0 +1,329 @@
+// Commit records
+//
+// commits.txt is read through a read-only mapping of the whole file, shared
+// by everything in the process. A CommitView is one record parsed in place:
+// its fields are string_views into the mapping, so reading a commit neither
+// copies nor allocates. The views stay valid while the CommitLog they came
+// from is held; a new mapping is made once the file has changed.
+//
+// loadAllCommits parses the whole history into a CommitArena:
+//
+//   commits  one fixed-size entry per record, in file order
+//   paths    every path named on a FILE line, interned: each distinct path
+//   blobs    and blob ID is kept once, as a view, and referred to by number
+//   files    the FILE lines of all commits as (path, blob) number pairs; each
+//            commit owns a slice, sorted by path number
+//
+// so loading a history of any length makes a handful of allocations rather
+// than a few for every line.
+
+const std::string COMMITS_PATH = ".minigit/commits.txt";
+
+void* mapFile(const std::string& path, size_t& size);
+bool sameFileState(const struct stat& a, const struct stat& b);
+
+// commits.txt as mapped at one point in time
+struct CommitLog
+{
+    void* map = nullptr;
+    size_t size = 0;
+
+    std::string_view text() const
+    {
+        return map ? std::string_view(static_cast<const char*>(map), size) : std::string_view();
+    }
+
+    ~CommitLog()
+    {
+        if (map) munmap(map, size);
+    }
+};
+
+// The current mapping of commits.txt, remapped after the file changed
+std::shared_ptr<CommitLog> currentCommitLog()
+{
+    static std::mutex cacheLock;
+    static std::shared_ptr<CommitLog> cached;
+    static struct stat cachedStat;
+
+    struct stat st = {};
+    stat(COMMITS_PATH.c_str(), &st);
+
+    std::lock_guard<std::mutex> guard(cacheLock);
+    if (!cached || !sameFileState(st, cachedStat))
+    {
+        cached = std::make_shared<CommitLog>();
+        cached->map = mapFile(COMMITS_PATH, cached->size);
+        cachedStat = st;
+    }
+    return cached;
+}
+
+// One record of commits.txt, pointing into the mapping
+struct CommitView
+{
+    std::string_view id;
+    std::string_view time;
+    std::string_view message;
+    std::string_view author;
+    std::string_view parent;
+    std::string_view parent2;
+    std::string_view tree;
+    std::string_view files; // from the first FILE line to the end of the last
+    uint64_t end = 0;       // just past the END line
+};
+
+// If line is "<key><value>", points value at the value
+inline bool recordField(std::string_view line, std::string_view key, std::string_view& value)
+{
+    if (line.size() < key.size() || line.compare(0, key.size(), key) != 0)
+    {
+        return false;
+    }
+    value = line.substr(key.size());
+    return true;
+}
+
+// Parses the record whose COMMIT line starts at offset. Fails if there is no
+// record there or it has no END line before the next record begins.
+bool parseCommitView(const CommitLog& log, uint64_t offset, CommitView& view)
+{
+    std::string_view text = log.text();
+    view = CommitView();
+    size_t pos = offset;
+    bool first = true;
+    while (pos < text.size())
+    {
+        size_t newline = text.find('\n', pos);
+        if (newline == std::string_view::npos)
+        {
+            return false; // torn last record
+        }
+        std::string_view line = text.substr(pos, newline - pos);
+        size_t lineStart = pos;
+        pos = newline + 1;
+
+        std::string_view value;
+        if (recordField(line, "COMMIT ", value))
+        {
+            if (!first)
+            {
+                return false;
+            }
+            view.id = value;
+        }
+        else if (first)
+        {
+            return false;
+        }
+        else if (line == "END")
+        {
+            view.end = pos;
+            return true;
+        }
+        else if (recordField(line, "FILE ", value))
+        {
+            size_t filesStart = view.files.empty() ? lineStart : view.files.data() - text.data();
+            view.files = text.substr(filesStart, pos - filesStart);
+        }
+        else if (recordField(line, "TIME ", value))
+        {
+            view.time = value;
+        }
+        else if (recordField(line, "MESSAGE ", value))
+        {
+            view.message = value;
+        }
+        else if (recordField(line, "AUTHOR ", value))
+        {
+            view.author = value;
+        }
+        else if (recordField(line, "PARENT ", value))
+        {
+            view.parent = value;
+        }
+        else if (recordField(line, "PARENT2 ", value))
+        {
+            view.parent2 = value;
+        }
+        else if (recordField(line, "TREE ", value))
+        {
+            view.tree = value;
+        }
+        first = false;
+    }
+    return false;
+}
+
+// Calls visit(path, blob) for every FILE line of a record, in file order
+void forEachCommitFile(const CommitView& view, const std::function<void(std::string_view, std::string_view)>& visit)
+{
+    std::string_view files = view.files;
+    while (!files.empty())
+    {
+        size_t newline = files.find('\n');
+        std::string_view line = files.substr(0, newline);
+        files.remove_prefix(newline == std::string_view::npos ? files.size() : newline + 1);
+
+        std::string_view value;
+        size_t colon = line.find(':');
+        if (recordField(line, "FILE ", value) && colon != std::string_view::npos)
+        {
+            visit(value.substr(0, colon - 5), line.substr(colon + 1));
+        }
+    }
+}
+
+// Strings kept once each and numbered in the order they were first seen.
+// The table is open addressing over string numbers, so a string costs a
+// view and two slots rather than a node of its own.
+struct InternTable
+{
+    std::vector<std::string_view> strings;
+    std::vector<uint32_t> slots; // string number + 1; 0 is free
+
+    uint32_t intern(std::string_view s)
+    {
+        if ((strings.size() + 1) * 2 > slots.size())
+        {
+            grow();
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t i = std::hash<std::string_view>()(s) & mask;; i = (i + 1) & mask)
+        {
+            if (slots[i] == 0)
+            {
+                strings.push_back(s);
+                slots[i] = strings.size();
+                return strings.size() - 1;
+            }
+            if (strings[slots[i] - 1] == s)
+            {
+                return slots[i] - 1;
+            }
+        }
+    }
+
+    // Makes room for count strings without growing
+    void reserve(size_t count)
+    {
+        strings.reserve(count);
+        size_t size = 1024;
+        while (size < count * 2)
+        {
+            size *= 2;
+        }
+        if (size > slots.size())
+        {
+            slots.resize(size / 2);
+            grow();
+        }
+    }
+
+    void grow()
+    {
+        slots.assign(std::max<size_t>(1024, slots.size() * 2), 0);
+        size_t mask = slots.size() - 1;
+        for (uint32_t n = 0; n < strings.size(); ++n)
+        {
+            size_t i = std::hash<std::string_view>()(strings[n]) & mask;
+            while (slots[i] != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            slots[i] = n + 1;
+        }
+    }
+};
+
+struct CommitFileRef
+{
+    uint32_t path;
+    uint32_t blob;
+};
+
+struct ArenaCommit
+{
+    uint64_t offset; // of the COMMIT line
+    std::string_view id;
+    std::string_view time;
+    std::string_view message;
+    std::string_view author;
+    std::string_view parent;
+    std::string_view parent2;
+    std::string_view tree;
+    uint32_t filesBegin; // slice of CommitArena::files
+    uint32_t filesEnd;
+};
+
+struct CommitArena
+{
+    std::shared_ptr<CommitLog> log; // everything below points into it
+    std::vector<ArenaCommit> commits;
+    std::vector<CommitFileRef> files;
+    InternTable paths;
+    InternTable blobs;
+
+    // The commit whose record starts at offset, or nullptr
+    const ArenaCommit* atOffset(uint64_t offset) const
+    {
+        auto it = std::lower_bound(commits.begin(), commits.end(), offset,
+                                   [](const ArenaCommit& c, uint64_t value) { return c.offset < value; });
+        return it != commits.end() && it->offset == offset ? &*it : nullptr;
+    }
+};
+
+// Parses every complete record of commits.txt. A path listed twice in one
+// record keeps its last blob, as it always has.
+bool loadAllCommits(CommitArena& arena)
+{
+    TraceSpan span("commits: load");
+    arena = CommitArena();
+    arena.log = currentCommitLog();
+    std::string_view text = arena.log->text();
+
+    // Rough first guesses, from the size of a record and of a FILE line
+    arena.commits.reserve(text.size() / 300 + 1);
+    arena.paths.reserve(text.size() / 256);
+    arena.blobs.reserve(text.size() / 256);
+
+    size_t pos = 0;
+    CommitView view;
+    while (pos < text.size())
+    {
+        if (text.compare(pos, 7, "COMMIT ") == 0 && parseCommitView(*arena.log, pos, view))
+        {
+            ArenaCommit c = {pos, view.id, view.time, view.message, view.author, view.parent, view.parent2, view.tree,
+                             (uint32_t)arena.files.size(), 0};
+            forEachCommitFile(view, [&](std::string_view path, std::string_view blob) {
+                arena.files.push_back({arena.paths.intern(path), arena.blobs.intern(blob)});
+            });
+
+            // Sorted by path number; of a path listed twice the last line stays
+            auto begin = arena.files.begin() + c.filesBegin;
+            auto byPath = [](const CommitFileRef& a, const CommitFileRef& b) { return a.path < b.path; };
+            if (!std::is_sorted(begin, arena.files.end(), byPath))
+            {
+                std::stable_sort(begin, arena.files.end(), byPath);
+            }
+            auto out = begin;
+            for (auto it = begin; it != arena.files.end(); ++it)
+            {
+                if (it + 1 == arena.files.end() || (it + 1)->path != it->path)
+                {
+                    *out++ = *it;
+                }
+            }
+            arena.files.erase(out, arena.files.end());
+            c.filesEnd = arena.files.size();
+
+            arena.commits.push_back(c);
+            pos = view.end;
+            continue;
+        }
+
+        size_t newline = text.find('\n', pos);
+        pos = newline == std::string_view::npos ? text.size() : newline + 1;
+    }
+    return true;
+}
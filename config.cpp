@@ -0,0 +1,61 @@
+// Repository settings
+//
+// .minigit/config.txt holds one "key:value" per line, in the same style as
+// staging.txt and packed-refs. Values are read once per process and cached.
+
+const std::string CONFIG_PATH = ".minigit/config.txt";
+
+std::mutex configLock;
+std::map<std::string, std::string> configValues;
+bool configLoaded = false;
+
+void loadConfigLocked()
+{
+    configValues.clear();
+
+    std::ifstream in(CONFIG_PATH);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        size_t colon = line.find(":");
+        if (colon != std::string::npos)
+        {
+            configValues[line.substr(0, colon)] = line.substr(colon + 1);
+        }
+    }
+
+    configLoaded = true;
+}
+
+// Drops the cached values, e.g. after init created the file
+void reloadConfig()
+{
+    std::lock_guard<std::mutex> guard(configLock);
+    configLoaded = false;
+}
+
+std::string getConfig(const std::string& key, const std::string& fallback = "")
+{
+    std::lock_guard<std::mutex> guard(configLock);
+    if (!configLoaded)
+    {
+        loadConfigLocked();
+    }
+
+    auto it = configValues.find(key);
+    return it == configValues.end() ? fallback : it->second;
+}
+
+void setConfig(const std::string& key, const std::string& value)
+{
+    std::lock_guard<std::mutex> guard(configLock);
+    loadConfigLocked();
+    configValues[key] = value;
+
+    std::ofstream out(CONFIG_PATH);
+    for (const auto& [name, setting] : configValues)
+    {
+        out << name << ":" << setting << "\n";
+    }
+    out.close();
+}
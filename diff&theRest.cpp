@@ -7,6 +7,46 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <exception>
+#include <cerrno>
+#include <memory>
+#include <csignal>
+#include <cctype>
+#include <limits>
+#include <string_view>
+#include <array>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <iomanip>
+#include <cmath>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fnmatch.h>
 
 namespace fs = std::filesystem;
 
@@ -15,44 +55,26 @@ struct Commit
     std::string id;
     std::string time;
     std::string message;
+    std::string author;  // empty for commits from before authors were recorded
     std::string parent;
+    std::string parent2; // merged branch, for merge commits
+    std::string tree;    // root tree; empty for commits from before trees
     std::map<std::string, std::string> files;
 };
 
 // 8.
 Commit loadCommitByID(const std::string& id) {
-    std::ifstream file(".minigit/commits.txt");
-    std::string line;
     Commit commit;
-    bool found = false;
-
-    while (std::getline(file, line)) {
-        if (line.rfind("COMMIT ", 0) == 0) {
-            if (line.substr(7) == id) {
-                commit.id = id;
-                found = true;
-            }
-        } else if (found && line.rfind("TIME ", 0) == 0) {
-            commit.time = line.substr(5);
-        } else if (found && line.rfind("MESSAGE ", 0) == 0) {
-            commit.message = line.substr(8);
-        } else if (found && line.rfind("PARENT ", 0) == 0) {
-            commit.parent = line.substr(7);
-        } else if (found && line.rfind("FILE ", 0) == 0) {
-            size_t colon = line.find(':');
-            std::string file = line.substr(5, colon - 5);
-            std::string hash = line.substr(colon + 1);
-            commit.files[file] = hash;
-        } else if (found && line == "END") {
-            break;
-        }
+    if (!lookupCommit(id, commit)) {
+        return Commit();
     }
-
     return commit;
 }
 
 std::vector<std::string> getBlobLines(const std::string& hash) {
-    std::ifstream file(".minigit/objects/" + hash);
+    std::string content;
+    readObject(hash, content);
+    std::istringstream file(content);
     std::vector<std::string> lines;
     std::string line;
     while (std::getline(file, line)) {
@@ -61,85 +83,542 @@ std::vector<std::string> getBlobLines(const std::string& hash) {
     return lines;
 }
 
-void diffCommits(const std::string& id1, const std::string& id2) {
+// Like git, a NUL byte near the start marks a file as binary. Only the first
+// few KB are read, even for large chunked blobs.
+bool isBinaryBlob(const std::string& hash) {
+    std::string head;
+    streamObject(hash, [&](const char* data, size_t size) {
+        head.append(data, std::min<size_t>(size, 8000 - head.size()));
+        return head.size() < 8000; // stop reading once we have enough
+    });
+    return head.find('\0') != std::string::npos;
+}
+
+// Number of lines in a blob; a last line without a newline counts too
+size_t countBlobLines(const std::string& hash) {
+    size_t lines = 0;
+    char last = '\n';
+    streamObject(hash, [&](const char* data, size_t size) {
+        lines += std::count(data, data + size, '\n');
+        if (size > 0) last = data[size - 1];
+        return true;
+    });
+    return lines + (last != '\n');
+}
+
+// Files diffed at a time: enough to keep every worker busy and the disk
+// queue full. The output of a batch is printed before the next one starts,
+// so it appears while diff runs and only one batch is held in memory.
+const size_t DIFF_FILES_PER_WORKER = 16;
+
+// One file's part of the output
+struct FileDiff {
+    std::string text;
+    bool binary = false;
+    size_t added = 0;
+    size_t removed = 0;
+};
+
+// Diffs one changed file; oldHash is empty for an added file and newHash for
+// a removed one. A renamed or copied file has its origin set and the old
+// blob is its source's. The blobs' content is passed in where it was read
+// ahead, and read here otherwise. Runs on a worker, so it only writes to its
+// own result.
+FileDiff diffChangedFile(const std::string& file, const FileOrigin& origin, const std::string& oldHash, const std::string& newHash,
+                         const std::string* oldContent, const std::string* newContent,
+                         const std::string& id2, DiffFormat format) {
+    FileDiff result;
+    if (format == DiffFull) {
+        result.text = "\n File: " + file + "\n";
+        if (!origin.path.empty()) {
+            result.text += (origin.copy ? "Copied from " : "Renamed from ") + origin.path + " ("
+                + std::to_string(origin.similarity) + "% similar)\n";
+        }
+        if (oldHash.empty()) {
+            result.text += "+ Added in commit " + id2 + "\n";
+            return result;
+        }
+        if (newHash.empty()) {
+            result.text += "- Removed in commit " + id2 + "\n";
+            return result;
+        }
+    }
+
+    if (oldHash == newHash) {
+        return result; // moved or copied as it was
+    }
+
+    auto isBinary = [](const std::string& hash, const std::string* content) {
+        if (hash.empty()) return false;
+        return content ? content->find('\0') < 8000 : isBinaryBlob(hash);
+    };
+    if (isBinary(oldHash, oldContent) || isBinary(newHash, newContent)) {
+        result.binary = true;
+        if (format == DiffFull) result.text += "Binary files differ.\n";
+        return result;
+    }
+
+    // Whole files added or removed only need their lines counted
+    if (oldHash.empty() || newHash.empty()) {
+        const std::string* content = oldHash.empty() ? newContent : oldContent;
+        size_t lines = content ? splitLines(*content).size() : countBlobLines(oldHash.empty() ? newHash : oldHash);
+        (oldHash.empty() ? result.added : result.removed) = lines;
+        return result;
+    }
+
+    // Hashes differ → Show line-by-line diff
+    auto lines1 = oldContent ? splitLines(*oldContent) : getBlobLines(oldHash);
+    auto lines2 = newContent ? splitLines(*newContent) : getBlobLines(newHash);
+    LineDiff diff = diffLines(lines1, lines2);
+    if (format == DiffFull) {
+        result.text += "Changes:\n" + unifiedDiff(lines1, lines2, diff);
+    } else {
+        result.removed = std::count(diff.removed.begin(), diff.removed.end(), true);
+        result.added = std::count(diff.added.begin(), diff.added.end(), true);
+    }
+    return result;
+}
+
+// Prints the --stat table: one " path | count +++--" line per file, with the
+// bars scaled down to fit when a file has many changes, then the totals
+void printDiffStat(const std::vector<std::string>& files, const std::vector<FileDiff>& diffs) {
+    const size_t barWidth = 50;
+    size_t nameWidth = 0, most = 0, added = 0, removed = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        nameWidth = std::max(nameWidth, files[i].size());
+        most = std::max(most, diffs[i].added + diffs[i].removed);
+        added += diffs[i].added;
+        removed += diffs[i].removed;
+    }
+    size_t countWidth = std::max<size_t>(3, std::to_string(most).size());
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        const FileDiff& d = diffs[i];
+        std::cout << " " << std::left << std::setw(nameWidth) << files[i] << " | " << std::right << std::setw(countWidth);
+        if (d.binary) {
+            std::cout << "Bin" << "\n";
+            continue;
+        }
+        size_t plus = d.added, minus = d.removed;
+        if (most > barWidth) {
+            // Scaled, but a file with any change keeps at least one mark
+            plus = d.added == 0 ? 0 : std::max<size_t>(1, d.added * barWidth / most);
+            minus = d.removed == 0 ? 0 : std::max<size_t>(1, d.removed * barWidth / most);
+        }
+        std::cout << d.added + d.removed << " " << std::string(plus, '+') << std::string(minus, '-') << "\n";
+    }
+    std::cout << " " << files.size() << (files.size() == 1 ? " file changed, " : " files changed, ") << added
+              << (added == 1 ? " insertion(+), " : " insertions(+), ") << removed
+              << (removed == 1 ? " deletion(-)\n" : " deletions(-)\n");
+}
+
+// diff [--stat | --name-only] <commit> <commit>
+bool diffCommits(const std::string& id1, const std::string& id2, DiffFormat format = DiffFull) {
+    TraceSpan span("diff");
     Commit c1 = loadCommitByID(id1);
     Commit c2 = loadCommitByID(id2);
 
     if (c1.id.empty() || c2.id.empty()) {
         std::cout << "One or both commits were not found.\n";
-        return;
+        return false;
     }
 
-    std::cout << "Comparing " << id1 << " and " << id2 << "\n";
+    // Files that differ between the two trees, in path order; shared
+    // subtrees are skipped
+    std::string tree1, tree2;
+    std::vector<FileChange> changes;
+    if (!commitTree(c1.id, tree1) || !commitTree(c2.id, tree2)
+        || !diffTrees(tree1, tree2, "", [&](const std::string& path, const std::string& oldHash, const std::string& newHash) {
+               changes.push_back({path, oldHash, newHash});
+           })) {
+        std::cout << "Error: Could not read the trees of the two commits.\n";
+        return false;
+    }
 
-    // Union of file names
-    std::set<std::string> allFiles;
-    for (auto& [f, _] : c1.files) allFiles.insert(f);
-    for (auto& [f, _] : c2.files) allFiles.insert(f);
+    // A renamed file is shown once, under its new path
+    std::vector<FileOrigin> origins;
+    foldRenames(changes, origins, true);
 
-    for (const auto& file : allFiles) {
-        bool inC1 = c1.files.count(file);
-        bool inC2 = c2.files.count(file);
+    if (format == DiffNameOnly) {
+        for (const auto& change : changes) {
+            std::cout << change[0] << "\n";
+        }
+        return true;
+    }
+    if (format == DiffFull) {
+        std::cout << "Comparing " << id1 << " and " << id2 << "\n";
+        if (changes.empty()) {
+            std::cout << "No changes.\n";
+        }
+    }
 
-        std::cout << "\n File: " << file << "\n";
+    // Files are diffed in parallel into their own buffers, which are then
+    // printed in path order, so the output is the same on any number of cores
+    span.restart("diff: files");
+    std::vector<std::string> files;
+    std::vector<FileDiff> stats;
+    size_t batchSize = std::max(workerCount() * DIFF_FILES_PER_WORKER, IO_BATCH_FILES / 2);
+    for (size_t start = 0; start < changes.size(); start += batchSize) {
+        size_t count = std::min(batchSize, changes.size() - start);
 
-        if (!inC1) {
-            std::cout << "+ Added in commit " << id2 << "\n";
-            continue;
+        // Both sides of every file in the batch are read in one go; a full
+        // diff skips the content of added and removed files
+        std::vector<std::string> ids;
+        std::vector<std::array<long, 2>> slots(count, {{-1, -1}});
+        for (size_t i = 0; i < count; ++i) {
+            const auto& [file, hash1, hash2] = changes[start + i];
+            if ((format == DiffFull && (hash1.empty() || hash2.empty())) || hash1 == hash2) continue;
+            if (!hash1.empty()) {
+                slots[i][0] = ids.size();
+                ids.push_back(hash1);
+            }
+            if (!hash2.empty()) {
+                slots[i][1] = ids.size();
+                ids.push_back(hash2);
+            }
         }
+        std::vector<std::string> contents;
+        std::vector<bool> loaded;
+        readObjects(ids, IO_BATCH_MAX_FILE, contents, loaded);
+        auto content = [&](long slot) { return slot >= 0 && loaded[slot] ? &contents[slot] : nullptr; };
 
-        if (!inC2) {
-            std::cout << "- Removed in commit " << id2 << "\n";
-            continue;
+        std::vector<FileDiff> diffs(count);
+        runParallel(count, [&](size_t i) {
+            const auto& [file, hash1, hash2] = changes[start + i];
+            diffs[i] = diffChangedFile(file, origins[start + i], hash1, hash2, content(slots[i][0]), content(slots[i][1]), id2, format);
+        });
+
+        for (size_t i = 0; i < count; ++i) {
+            if (format == DiffFull) {
+                std::cout << diffs[i].text;
+            } else {
+                const FileOrigin& origin = origins[start + i];
+                files.push_back(origin.path.empty() ? changes[start + i][0] : origin.path + " => " + changes[start + i][0]);
+                stats.push_back(std::move(diffs[i]));
+            }
         }
+        std::cout.flush();
+    }
 
-        if (c1.files[file] == c2.files[file]) {
-            std::cout << "No changes.\n";
-            continue;
+    if (format == DiffStat) {
+        printDiffStat(files, stats);
+    }
+    return true;
+}
+
+// 9.
+bool showStatus() {
+    TraceSpan span("status");
+    if (!fs::is_directory(".minigit")) {
+        std::cout << "Error: Not a minigit repository; run 'minigit init' first.\n";
+        return false;
+    }
+
+    std::ifstream headFile(".minigit/HEAD.txt");
+    std::string currentBranch;
+    std::getline(headFile, currentBranch);
+    headFile.close();
+
+    std::cout << "On branch " << currentBranch << "\n";
+
+    std::map<std::string, std::string> headFiles;
+    std::string headCommit = getParentHash();
+    if (!headCommit.empty()) commitSnapshot(headCommit, headFiles);
+    auto staged = getStagedFiles();
+
+    // Asked before anything is looked at, so whatever changes meanwhile is
+    // reported next time
+    WorktreeView view = viewWorktree();
+
+    // Without an index every known file gets hashed once to build it; in a
+    // sparse checkout only those inside the spec are in the working directory
+    StatIndex index;
+    if (!loadIndex(index)) {
+        view.monitored = false;
+        SparseSpec spec = loadSparse();
+        std::vector<IndexEntry> known;
+        for (const auto& [file, hash] : headFiles) if (spec.includes(file)) known.push_back({file, hash, {}});
+        for (const auto& [file, hash] : staged) if (!hash.empty()) known.push_back({file, hash, {}});
+        setIndexEntries(index, std::move(known));
+    }
+
+    // One stat per tracked file, or with a monitor per file it reports; only
+    // files whose stat data changed are read
+    enum FileState { Clean, Modified, Deleted };
+    std::vector<FileState> states(index.entries.size(), Clean);
+    std::vector<IndexEntry> refreshed(index.entries.size());
+    std::vector<size_t> toCheck = entriesToCheck(index, view);
+
+    runParallel(toCheck.size(), [&](size_t k) {
+        size_t i = toCheck[k];
+        const IndexEntry& entry = index.entries[i];
+        struct stat st;
+        if (lstat(entry.path.c_str(), &st) != 0) {
+            states[i] = Deleted;
+            return;
+        }
+        if (statMatches(index, entry, st)) {
+            return;
+        }
+
+        std::string hash;
+        IndexRecord record;
+        if (!hashFile(entry.path, hash, record, &entry) || hash != entry.hash) {
+            states[i] = Modified;
+            return;
+        }
+
+        // Same content, new stat data: remember it so the next run skips it
+        refreshed[i] = {entry.path, hash, record};
+    });
+
+    std::vector<IndexEntry> updates;
+    for (auto& entry : refreshed) {
+        if (!entry.path.empty()) updates.push_back(std::move(entry));
+    }
+    if (!updates.empty() || index.changed) {
+        setIndexEntries(index, std::move(updates));
+        saveIndex(index);
+    }
+
+    std::map<std::string, std::string> stagedFiles(staged.begin(), staged.end());
+    if (!stagedFiles.empty()) {
+        std::cout << "\nChanges to be committed:\n";
+        for (const auto& [file, hash] : stagedFiles) {
+            std::cout << (hash.empty() ? "    deleted:  " : headFiles.count(file) ? "    modified: " : "    new file: ") << file << "\n";
         }
+    }
 
-        // Hashes differ → Show line-by-line diff
-        auto lines1 = getBlobLines(c1.files[file]);
-        auto lines2 = getBlobLines(c2.files[file]);
+    bool headerShown = false;
+    for (size_t i = 0; i < index.entries.size(); ++i) {
+        if (states[i] == Clean) continue;
+        if (!headerShown) {
+            std::cout << "\nChanges not staged for commit:\n";
+            headerShown = true;
+        }
+        std::cout << (states[i] == Deleted ? "    deleted:  " : "    modified: ") << index.entries[i].path << "\n";
+    }
 
-        std::cout << "Changes:\n";
+    // Anything in the working tree minigit has never seen. With a monitor
+    // only the paths it reported, and what was untracked before, are looked at.
+    std::vector<std::string> untracked;
+    auto consider = [&](const std::string& path) {
+        if (!findIndexEntry(index, path) && !stagedFiles.count(path)) {
+            untracked.push_back(path);
+        }
+    };
+    auto scan = [&](const std::string& dir) {
+        auto it = fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied);
+        for (auto end = fs::end(it); it != end; ++it) {
+            if (it->path().filename() == ".minigit") {
+                it.disable_recursion_pending();
+                continue;
+            }
+            if (it->is_regular_file()) consider(it->path().lexically_normal().generic_string());
+        }
+    };
+    if (!view.monitored) {
+        scan(".");
+    }
+    for (const auto& path : view.monitored ? view.check : std::set<std::string>()) {
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            scan(path);
+        } else if (S_ISREG(st.st_mode)) {
+            consider(path);
+        }
+    }
+    std::sort(untracked.begin(), untracked.end());
+    untracked.erase(std::unique(untracked.begin(), untracked.end()), untracked.end());
 
-        size_t i = 0, j = 0;
-        while (i < lines1.size() || j < lines2.size()) {
-            if (i < lines1.size() && j < lines2.size()) {
-                if (lines1[i] == lines2[j]) {
-                    ++i; ++j;
-                } else {
-                    std::cout << "- " << lines1[i++] << "\n";
-                    std::cout << "+ " << lines2[j++] << "\n";
-                }
-            } else if (i < lines1.size()) {
-                std::cout << "- " << lines1[i++] << "\n";
+    if (!untracked.empty()) {
+        std::cout << "\nUntracked files:\n";
+        for (const auto& path : untracked) {
+            std::cout << "    " << path << "\n";
+        }
+    }
+
+    // What the next status needs to look at again, besides what the monitor reports
+    if (!view.token.empty()) {
+        MonitorState state;
+        state.token = view.token;
+        for (size_t i = 0; i < index.entries.size(); ++i) {
+            if (states[i] != Clean) state.dirty.push_back(index.entries[i].path);
+        }
+        state.untracked = std::move(untracked);
+        saveMonitorState(state);
+    }
+    return true;
+}
+
+// 10.
+void printUsage() {
+    std::cout << "Usage: minigit [--trace[=<file>]] <command> [arguments]\n"
+                 "    init\n"
+                 "    add <file or directory>...\n"
+                 "    commit -m \"message\"\n"
+                 "    log [-n <count>] [--since=<date>] [--author=<name>] [-- <path>...]\n"
+                 "    status\n"
+                 "    branch <name>\n"
+                 "    checkout <branch> [-- <pathspec>...]\n"
+                 "    hydrate [<pathspec>...]\n"
+                 "    merge <branch>\n"
+                 "    diff [--stat | --name-only] <commit> <commit>\n"
+                 "    monitor start | stop | status\n"
+                 "    pack\n"
+                 "    pack-refs\n"
+                 "    gc [--prune=now]\n"
+                 "    batch [--socket <path>]\n"
+                 "    bench generate <dir> | bench run [--scale 1k|100k|1M]\n"
+                 "Without a command, minigit asks for one interactively.\n"
+                 "--trace prints where the command spent its time; --trace=<file> writes a\n"
+                 "Chrome trace instead. MINIGIT_TRACE=1 or MINIGIT_TRACE=<file> traces every command.\n";
+}
+
+// Runs one command given as separate arguments, e.g. {"commit", "-m", "msg"}.
+// Used for the process's own arguments and for every line of batch mode.
+int runCommand(const std::vector<std::string>& args) {
+    if (!args.empty() && args[0].rfind("--trace", 0) == 0) {
+        // --trace or --trace=<file>, in front of the command
+        if (args[0] != "--trace" && args[0].rfind("--trace=", 0) != 0) {
+            std::cout << "Unknown option '" << args[0] << "'.\n";
+            return 1;
+        }
+        TraceSession session(args[0] == "--trace" ? "summary" : args[0].c_str() + 8);
+        return runCommand(std::vector<std::string>(args.begin() + 1, args.end()));
+    }
+    if (args.empty()) {
+        printUsage();
+        return 1;
+    }
+
+    const std::string& command = args[0];
+    auto usage = [](const std::string& text) {
+        std::cout << "Usage: minigit " << text << "\n";
+        return 1;
+    };
+
+    bool ok = true;
+    if (command == "init") {
+        ok = initMiniGit();
+    } else if (command == "add") {
+        if (args.size() < 2) return usage("add <file or directory>...");
+        ok = addFiles(std::vector<std::string>(args.begin() + 1, args.end()));
+    } else if (command == "commit") {
+        // commit -m "message", or -m"message"
+        std::string message;
+        bool found = false;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "-m" && i + 1 < args.size()) {
+                message = args[++i];
+                found = true;
+            } else if (args[i].rfind("-m", 0) == 0 && args[i].size() > 2) {
+                message = args[i].substr(2);
+                found = true;
             } else {
-                std::cout << "+ " << lines2[j++] << "\n";
+                found = false;
+                break;
             }
         }
+        if (!found) return usage("commit -m \"your message\"");
+        ok = createCommit(message);
+    } else if (command == "log") {
+        LogOptions options;
+        if (!parseLogOptions(args, options)) return usage("log [-n <count>] [--since=<date>] [--author=<name>] [-- <path>...]");
+        ok = viewlog(options);
+    } else if (command == "status") {
+        ok = showStatus();
+    } else if (command == "branch") {
+        if (args.size() != 2) return usage("branch <name>");
+        ok = createBranch(args[1]);
+    } else if (command == "checkout") {
+        // checkout <branch> [-- <pathspec>...]
+        if (args.size() == 2) {
+            ok = checkoutBranch(args[1]);
+        } else if (args.size() > 3 && args[2] == "--") {
+            std::vector<std::string> pathspecs(args.begin() + 3, args.end());
+            ok = checkoutBranch(args[1], &pathspecs);
+        } else {
+            return usage("checkout <branch> [-- <pathspec>...]");
+        }
+    } else if (command == "hydrate") {
+        ok = hydrateFiles(std::vector<std::string>(args.begin() + 1, args.end()));
+    } else if (command == "merge") {
+        if (args.size() != 2) return usage("merge <branch>");
+        ok = mergeBranch(args[1]);
+    } else if (command == "diff") {
+        // diff [--stat | --name-only] <commit> <commit>
+        DiffFormat format = DiffFull;
+        size_t first = 1;
+        if (args.size() == 4 && args[1] == "--stat") {
+            format = DiffStat;
+            first = 2;
+        } else if (args.size() == 4 && args[1] == "--name-only") {
+            format = DiffNameOnly;
+            first = 2;
+        }
+        if (args.size() != first + 2) return usage("diff [--stat | --name-only] <commit> <commit>");
+        ok = diffCommits(args[first], args[first + 1], format);
+    } else if (command == "pack") {
+        ok = packObjects();
+    } else if (command == "pack-refs") {
+        ok = packRefs();
+    } else if (command == "gc") {
+        if (args.size() > 2 || (args.size() == 2 && args[1] != "--prune=now")) return usage("gc [--prune=now]");
+        ok = collectGarbage(args.size() == 2);
+    } else if (command == "batch") {
+        return runBatch(args);
+    } else if (command == "monitor") {
+        return runMonitorCommand(args);
+    } else if (command == "bench") {
+        return runBench(args);
+    } else if (command == "help" || command == "--help" || command == "-h") {
+        printUsage();
+    } else {
+        std::cout << "Unknown command '" << command << "'.\n";
+        printUsage();
+        return 1;
     }
+
+    return ok ? 0 : 1;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    TraceSession session(std::getenv("MINIGIT_TRACE"));
+
+    // Finishes commits a crash cut short before anything reads the repository
+    recoverJournal();
+
+    if (argc > 1)
+    {
+        return runCommand(std::vector<std::string>(argv + 1, argv + argc));
+    }
+
 
     std::string command;
  
     std::cout << "Enter command: ";
     std::cin >> command;
 
+    bool ok = true;
     if (command == "init")
     {
-        initMiniGit();
+        ok = initMiniGit();
     }
     else if (command == "add") {
-        std::string fileName;
-        std::cout << "Enter the file name: ";
-        std::cin >> fileName;
+        std::string line, path;
+        std::cout << "Enter the file or directory names: ";
+        std::getline(std::cin >> std::ws, line);
+
+        std::istringstream names(line);
+        std::vector<std::string> paths;
+        while (names >> path) {
+            paths.push_back(path);
+        }
 
-        addFile(fileName);
+        ok = addFiles(paths);
     } else if (command == "commit") {
         std::string flag, message;
         std::cout << "Enter '-m': ";
@@ -162,39 +641,48 @@ int main()
             message = message.substr(1);
         }
 
-        createCommit(message);        
+        ok = createCommit(message);        
     } else if (command == "log")
     {
-        viewlog();
+        ok = viewlog();
     } else if (command == "branch")
     {
         std::string newBranch;
         std::cout << "Enter new branch name: ";
         std::cin >> newBranch;
-        createBranch(newBranch);
+        ok = createBranch(newBranch);
     } else if (command == "checkout")
     {
         std::string targetBranch;
         std::cout << "Enter branch to checkout: ";
         std::cin >> targetBranch;
-        checkoutBranch(targetBranch);
+        ok = checkoutBranch(targetBranch);
     } else if (command == "merge")
     {
         std::string target;
         std::cout <<  "Enter branch to merge into the current one: ";
         std::cin >> target;
-        mergeBranch(target);
+        ok = mergeBranch(target);
+    } else if (command == "status") {
+        ok = showStatus();
+    } else if (command == "pack") {
+        ok = packObjects();
+    } else if (command == "pack-refs") {
+        ok = packRefs();
+    } else if (command == "gc") {
+        ok = collectGarbage(false);
     } else if (command == "diff") {
         std::string id1, id2;
         std::cout << "Enter first commit ID: ";
         std::cin >> id1;
         std::cout << "Enter second commit ID: ";
         std::cin >> id2;
-        diffCommits(id1, id2);
+        ok = diffCommits(id1, id2);
     } else
     {
         std::cout << "Unknown command.\n";
+        ok = false;
     }
 
-    return 0;
+    return ok ? 0 : 1;
 }
\ No newline at end of file
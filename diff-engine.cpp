@@ -0,0 +1,508 @@
+// Diff engine
+//
+// Computes a minimal line diff between two versions of a file. Lines are
+// first interned to integer IDs so every comparison is a single integer
+// compare. The search then works in two stages:
+//
+//   1. Patience, for large ranges only: lines that occur exactly once on both
+//      sides are matched up (longest increasing subsequence), and the gaps
+//      between those anchors are diffed on their own. This splits big inputs
+//      into small problems at the cost of exact minimality.
+//   2. Myers' O(ND) algorithm, in its linear-space "middle snake" form. If
+//      the edit distance of a range gets very large, the search stops at the
+//      furthest point reached so far and splits there, which bounds the cost
+//      of diffing unrelated files.
+//
+// The result marks which lines were removed from the old side and which were
+// added on the new side; unifiedDiff turns that into @@ hunks with context.
+
+struct LineDiff
+{
+    std::vector<bool> removed; // per line of the old version
+    std::vector<bool> added;   // per line of the new version
+};
+
+const int PATIENCE_MAX_DEPTH = 32;
+const size_t PATIENCE_MIN_LINES = 2000; // smaller ranges get an exact diff
+const long MYERS_MAX_COST = 2048;       // edit distance searched before splitting
+
+struct DiffContext
+{
+    std::vector<uint32_t> a;
+    std::vector<uint32_t> b;
+    LineDiff* result;
+};
+
+void diffMyers(DiffContext& ctx, size_t aLo, size_t aHi, size_t bLo, size_t bHi);
+
+// Strips the common prefix and suffix, then handles the trivial cases.
+// Returns false if nothing is left to diff.
+bool trimRange(DiffContext& ctx, size_t& aLo, size_t& aHi, size_t& bLo, size_t& bHi)
+{
+    while (aLo < aHi && bLo < bHi && ctx.a[aLo] == ctx.b[bLo])
+    {
+        ++aLo;
+        ++bLo;
+    }
+    while (aLo < aHi && bLo < bHi && ctx.a[aHi - 1] == ctx.b[bHi - 1])
+    {
+        --aHi;
+        --bHi;
+    }
+
+    if (aLo == aHi || bLo == bHi)
+    {
+        for (size_t i = aLo; i < aHi; ++i) ctx.result->removed[i] = true;
+        for (size_t j = bLo; j < bHi; ++j) ctx.result->added[j] = true;
+        return false;
+    }
+    return true;
+}
+
+// Finds the middle snake of the range and recurses on both halves
+void diffMyers(DiffContext& ctx, size_t aLo, size_t aHi, size_t bLo, size_t bHi)
+{
+    if (!trimRange(ctx, aLo, aHi, bLo, bHi))
+    {
+        return;
+    }
+
+    const uint32_t* a = ctx.a.data() + aLo;
+    const uint32_t* b = ctx.b.data() + bLo;
+    long n = aHi - aLo;
+    long m = bHi - bLo;
+    long maxD = (n + m + 1) / 2;
+    long offset = maxD;
+    long length = 2 * maxD + 2;
+    std::vector<long> forward(length, -1), reverse(length, -1);
+    forward[offset + 1] = 0;
+    reverse[offset + 1] = 0;
+
+    long delta = n - m;
+    bool checkFront = delta % 2 != 0;
+    long kStart1 = 0, kEnd1 = 0, kStart2 = 0, kEnd2 = 0;
+
+    for (long d = 0; d < maxD; ++d)
+    {
+        if (d == MYERS_MAX_COST)
+        {
+            // Too expensive: split at the forward point furthest along
+            long bestX = 0, bestY = 0;
+            for (long k = -d + 1 + kStart1; k <= d - 1 - kEnd1; k += 2)
+            {
+                long x = std::min(forward[offset + k], n);
+                long y = x - k;
+                if (y >= 0 && y <= m && x + y > bestX + bestY)
+                {
+                    bestX = x;
+                    bestY = y;
+                }
+            }
+            if (bestX + bestY > 0 && bestX + bestY < n + m)
+            {
+                diffMyers(ctx, aLo, aLo + bestX, bLo, bLo + bestY);
+                diffMyers(ctx, aLo + bestX, aHi, bLo + bestY, bHi);
+                return;
+            }
+        }
+
+        // Forward path
+        for (long k = -d + kStart1; k <= d - kEnd1; k += 2)
+        {
+            long index = offset + k;
+            long x = (k == -d || (k != d && forward[index - 1] < forward[index + 1])) ? forward[index + 1] : forward[index - 1] + 1;
+            long y = x - k;
+            while (x < n && y < m && a[x] == b[y])
+            {
+                ++x;
+                ++y;
+            }
+            forward[index] = x;
+
+            if (x > n)
+            {
+                kEnd1 += 2;
+            }
+            else if (y > m)
+            {
+                kStart1 += 2;
+            }
+            else if (checkFront)
+            {
+                long reverseIndex = offset + delta - k;
+                if (reverseIndex >= 0 && reverseIndex < length && reverse[reverseIndex] != -1 && x >= n - reverse[reverseIndex])
+                {
+                    diffMyers(ctx, aLo, aLo + x, bLo, bLo + y);
+                    diffMyers(ctx, aLo + x, aHi, bLo + y, bHi);
+                    return;
+                }
+            }
+        }
+
+        // Reverse path, walking from the ends
+        for (long k = -d + kStart2; k <= d - kEnd2; k += 2)
+        {
+            long index = offset + k;
+            long x = (k == -d || (k != d && reverse[index - 1] < reverse[index + 1])) ? reverse[index + 1] : reverse[index - 1] + 1;
+            long y = x - k;
+            while (x < n && y < m && a[n - x - 1] == b[m - y - 1])
+            {
+                ++x;
+                ++y;
+            }
+            reverse[index] = x;
+
+            if (x > n)
+            {
+                kEnd2 += 2;
+            }
+            else if (y > m)
+            {
+                kStart2 += 2;
+            }
+            else if (!checkFront)
+            {
+                long forwardIndex = offset + delta - k;
+                if (forwardIndex >= 0 && forwardIndex < length && forward[forwardIndex] != -1)
+                {
+                    long x1 = forward[forwardIndex];
+                    long y1 = offset + x1 - forwardIndex;
+                    if (x1 >= n - x)
+                    {
+                        diffMyers(ctx, aLo, aLo + x1, bLo, bLo + y1);
+                        diffMyers(ctx, aLo + x1, aHi, bLo + y1, bHi);
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    // No common subsequence at all
+    for (size_t i = aLo; i < aHi; ++i) ctx.result->removed[i] = true;
+    for (size_t j = bLo; j < bHi; ++j) ctx.result->added[j] = true;
+}
+
+// Anchors the range on lines that are unique on both sides, then diffs the
+// gaps between the anchors
+void diffPatience(DiffContext& ctx, size_t aLo, size_t aHi, size_t bLo, size_t bHi, int depth)
+{
+    if (!trimRange(ctx, aLo, aHi, bLo, bHi))
+    {
+        return;
+    }
+    if (depth >= PATIENCE_MAX_DEPTH || (aHi - aLo) + (bHi - bLo) < PATIENCE_MIN_LINES)
+    {
+        diffMyers(ctx, aLo, aHi, bLo, bHi);
+        return;
+    }
+
+    struct Occurrence
+    {
+        uint32_t countA = 0, countB = 0;
+        size_t posA = 0, posB = 0;
+    };
+    std::unordered_map<uint32_t, Occurrence> occurrences;
+    occurrences.reserve((aHi - aLo) + (bHi - bLo));
+    for (size_t i = aLo; i < aHi; ++i)
+    {
+        Occurrence& o = occurrences[ctx.a[i]];
+        ++o.countA;
+        o.posA = i;
+    }
+    for (size_t j = bLo; j < bHi; ++j)
+    {
+        auto it = occurrences.find(ctx.b[j]);
+        if (it != occurrences.end())
+        {
+            ++it->second.countB;
+            it->second.posB = j;
+        }
+    }
+
+    // Unique lines in old-side order
+    std::vector<std::pair<size_t, size_t>> unique;
+    for (size_t i = aLo; i < aHi; ++i)
+    {
+        const Occurrence& o = occurrences[ctx.a[i]];
+        if (o.countA == 1 && o.countB == 1)
+        {
+            unique.push_back({i, o.posB});
+        }
+    }
+
+    if (unique.empty())
+    {
+        diffMyers(ctx, aLo, aHi, bLo, bHi);
+        return;
+    }
+
+    // Longest increasing subsequence of new-side positions (patience sorting)
+    std::vector<size_t> tails;              // index into unique of the smallest tail per length
+    std::vector<long> previous(unique.size(), -1);
+    for (size_t u = 0; u < unique.size(); ++u)
+    {
+        auto it = std::lower_bound(tails.begin(), tails.end(), unique[u].second, [&](size_t t, size_t value) {
+            return unique[t].second < value;
+        });
+        if (it != tails.begin())
+        {
+            previous[u] = *(it - 1);
+        }
+        if (it == tails.end())
+        {
+            tails.push_back(u);
+        }
+        else
+        {
+            *it = u;
+        }
+    }
+
+    std::vector<std::pair<size_t, size_t>> anchors;
+    for (long u = tails.back(); u >= 0; u = previous[u])
+    {
+        anchors.push_back(unique[u]);
+    }
+    std::reverse(anchors.begin(), anchors.end());
+
+    size_t prevA = aLo, prevB = bLo;
+    for (const auto& [i, j] : anchors)
+    {
+        diffPatience(ctx, prevA, i, prevB, j, depth + 1);
+        prevA = i + 1;
+        prevB = j + 1;
+    }
+    diffPatience(ctx, prevA, aHi, prevB, bHi, depth + 1);
+}
+
+LineDiff diffLines(const std::vector<std::string>& oldLines, const std::vector<std::string>& newLines)
+{
+    LineDiff result;
+    result.removed.assign(oldLines.size(), false);
+    result.added.assign(newLines.size(), false);
+
+    // Intern every distinct line once
+    DiffContext ctx;
+    ctx.result = &result;
+    std::unordered_map<std::string_view, uint32_t> ids;
+    ids.reserve(oldLines.size() + newLines.size());
+    auto intern = [&](const std::string& line) {
+        return ids.emplace(line, ids.size()).first->second;
+    };
+    ctx.a.reserve(oldLines.size());
+    ctx.b.reserve(newLines.size());
+    for (const auto& line : oldLines) ctx.a.push_back(intern(line));
+    for (const auto& line : newLines) ctx.b.push_back(intern(line));
+
+    diffPatience(ctx, 0, ctx.a.size(), 0, ctx.b.size(), 0);
+    return result;
+}
+
+// Formats a diff as unified hunks ("@@ -start,count +start,count @@") with
+// the given number of context lines around each change
+std::string unifiedDiff(const std::vector<std::string>& oldLines, const std::vector<std::string>& newLines, const LineDiff& diff, size_t context = 3)
+{
+    // Walk both sides in step to get the edit script
+    struct Edit
+    {
+        char op; // ' ', '-' or '+'
+        size_t oldLine, newLine;
+    };
+    std::vector<Edit> edits;
+    size_t i = 0, j = 0;
+    while (i < oldLines.size() || j < newLines.size())
+    {
+        if (i < oldLines.size() && diff.removed[i])
+        {
+            edits.push_back({'-', i++, j});
+        }
+        else if (j < newLines.size() && diff.added[j])
+        {
+            edits.push_back({'+', i, j++});
+        }
+        else
+        {
+            edits.push_back({' ', i++, j++});
+        }
+    }
+
+    std::ostringstream out;
+    size_t e = 0;
+    while (e < edits.size())
+    {
+        // Find the next change and extend the hunk while changes stay close
+        while (e < edits.size() && edits[e].op == ' ')
+        {
+            ++e;
+        }
+        if (e == edits.size())
+        {
+            break;
+        }
+
+        size_t start = e > context ? e - context : 0;
+        size_t end = e;
+        while (end < edits.size())
+        {
+            size_t next = end;
+            while (next < edits.size() && edits[next].op == ' ')
+            {
+                ++next;
+            }
+            if (next == edits.size() || next - end > 2 * context)
+            {
+                end = std::min(edits.size(), end + context);
+                break;
+            }
+            end = next + 1;
+            while (end < edits.size() && edits[end].op != ' ')
+            {
+                ++end;
+            }
+        }
+
+        size_t oldCount = 0, newCount = 0;
+        for (size_t k = start; k < end; ++k)
+        {
+            if (edits[k].op != '+') ++oldCount;
+            if (edits[k].op != '-') ++newCount;
+        }
+
+        // Line numbers are 1-based; an empty side reports the line before it
+        size_t oldStart = edits[start].oldLine + (oldCount > 0 ? 1 : 0);
+        size_t newStart = edits[start].newLine + (newCount > 0 ? 1 : 0);
+        out << "@@ -" << oldStart << "," << oldCount << " +" << newStart << "," << newCount << " @@\n";
+
+        for (size_t k = start; k < end; ++k)
+        {
+            const Edit& edit = edits[k];
+            out << edit.op << (edit.op == '+' ? newLines[edit.newLine] : oldLines[edit.oldLine]) << "\n";
+        }
+
+        e = end;
+    }
+
+    return out.str();
+}
+
+// What `diff` prints for each changed file: full hunks, a --stat line with
+// the number of lines added and removed, or only the path (--name-only)
+enum DiffFormat
+{
+    DiffFull,
+    DiffStat,
+    DiffNameOnly
+};
+
+// Splits file content into lines, without the line endings
+std::vector<std::string> splitLines(const std::string& content)
+{
+    std::vector<std::string> lines;
+    size_t start = 0;
+    while (start < content.size())
+    {
+        size_t end = content.find('\n', start);
+        if (end == std::string::npos)
+        {
+            end = content.size();
+        }
+        lines.push_back(content.substr(start, end - start));
+        start = end + 1;
+    }
+    return lines;
+}
+
+// For each base line, the line it is matched to on the other side, or -1
+std::vector<long> matchedLines(const LineDiff& diff)
+{
+    std::vector<long> match(diff.removed.size(), -1);
+    size_t j = 0;
+    for (size_t i = 0; i < diff.removed.size(); ++i)
+    {
+        if (diff.removed[i])
+        {
+            continue;
+        }
+        while (diff.added[j])
+        {
+            ++j;
+        }
+        match[i] = j++;
+    }
+    return match;
+}
+
+struct MergeResult
+{
+    std::vector<std::string> lines;
+    size_t conflicts = 0;
+};
+
+// Three-way line merge (diff3). Base lines kept by both sides split the
+// files into chunks; a chunk changed on one side only takes that side, a
+// chunk changed the same way on both sides is taken once, and anything else
+// becomes a conflict wrapped in <<<<<<< / ======= / >>>>>>> markers.
+MergeResult mergeLines(const std::vector<std::string>& base, const std::vector<std::string>& ours, const std::vector<std::string>& theirs,
+                       const std::string& oursLabel, const std::string& theirsLabel)
+{
+    std::vector<long> oursMatch = matchedLines(diffLines(base, ours));
+    std::vector<long> theirsMatch = matchedLines(diffLines(base, theirs));
+
+    MergeResult result;
+    auto sameLines = [](const std::vector<std::string>& x, size_t xLo, size_t xHi, const std::vector<std::string>& y, size_t yLo, size_t yHi) {
+        return xHi - xLo == yHi - yLo && std::equal(x.begin() + xLo, x.begin() + xHi, y.begin() + yLo);
+    };
+    auto append = [&](const std::vector<std::string>& from, size_t lo, size_t hi) {
+        result.lines.insert(result.lines.end(), from.begin() + lo, from.begin() + hi);
+    };
+
+    size_t i = 0, o = 0, t = 0;
+    while (i < base.size() || o < ours.size() || t < theirs.size())
+    {
+        // Next base line both sides kept
+        size_t k = i;
+        while (k < base.size() && (oursMatch[k] < 0 || theirsMatch[k] < 0))
+        {
+            ++k;
+        }
+        size_t oEnd = k < base.size() ? oursMatch[k] : ours.size();
+        size_t tEnd = k < base.size() ? theirsMatch[k] : theirs.size();
+
+        if (k == i && oEnd == o && tEnd == t)
+        {
+            // Unchanged on both sides
+            result.lines.push_back(base[i]);
+            ++i;
+            ++o;
+            ++t;
+            continue;
+        }
+
+        bool oursChanged = !sameLines(base, i, k, ours, o, oEnd);
+        bool theirsChanged = !sameLines(base, i, k, theirs, t, tEnd);
+        if (!theirsChanged || sameLines(ours, o, oEnd, theirs, t, tEnd))
+        {
+            append(ours, o, oEnd);
+        }
+        else if (!oursChanged)
+        {
+            append(theirs, t, tEnd);
+        }
+        else
+        {
+            result.lines.push_back("<<<<<<< " + oursLabel);
+            append(ours, o, oEnd);
+            result.lines.push_back("=======");
+            append(theirs, t, tEnd);
+            result.lines.push_back(">>>>>>> " + theirsLabel);
+            ++result.conflicts;
+        }
+
+        i = k;
+        o = oEnd;
+        t = tEnd;
+    }
+
+    return result;
+}
@@ -0,0 +1,646 @@
+// Filesystem monitor
+//
+// Finding out what changed in the working tree normally takes an lstat of
+// every tracked file and a walk of every directory. `minigit monitor start`
+// runs a process in the background that watches the tree with inotify
+// instead and keeps a journal of the paths that changed, each with the
+// sequence number of its latest change. It answers on .minigit/monitor.sock,
+// one request per connection:
+//
+//   query <token>   the current token, then "changed" and every path changed
+//                   since the token was handed out, or "full" if it cannot
+//                   tell; an empty line ends the answer
+//   status          one line about the monitor, then an empty line
+//   shutdown        stops it
+//
+// A token is "<instance>:<sequence>". A monitor that was restarted, lost
+// events because the kernel queue overflowed, or grew its journal past
+// MONITOR_MAX_PATHS answers "full" to tokens from before that. Before it
+// answers, the monitor creates a cookie file in .minigit and waits for the
+// event, so every change made before the query is in the answer. A changed
+// directory stands for everything below it.
+//
+// status keeps the token it got before looking at the tree in
+// .minigit/monitor-state, along with the paths it found modified, deleted
+// or untracked. The next status only looks at those paths and at what the
+// monitor reports since; add and checkout use the same view to skip files
+// known to be clean. Without a monitor, or when it answers "full", every
+// file is looked at as before.
+
+const std::string MONITOR_SOCKET_PATH = ".minigit/monitor.sock";
+const std::string MONITOR_STATE_PATH = ".minigit/monitor-state";
+const std::string MONITOR_COOKIE_PREFIX = "monitor-cookie-";
+const size_t MONITOR_MAX_PATHS = 1000000;
+const int MONITOR_TIMEOUT_MS = 2000;
+const uint32_t MONITOR_EVENTS = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO
+                              | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// The monitor process
+struct Monitor
+{
+    int inotifyFd = -1;
+    int cookieWatch = -1;                      // .minigit, only for cookie files
+    std::unordered_map<int, std::string> dirs; // watch -> directory, "" for the root, else ending in '/'
+    std::string instance;
+    uint64_t sequence = 0;
+    uint64_t validFrom = 0;                    // older tokens get "full"
+    bool broken = false;                       // a directory could not be watched
+    bool running = true;
+    std::map<uint64_t, std::string> journal;   // sequence of the latest change -> path
+    std::unordered_map<std::string, uint64_t> latest;
+    std::set<std::string> cookies;             // cookie files seen
+};
+
+// Starts the journal over; tokens handed out so far get "full" from now on
+void forgetChanges(Monitor& monitor)
+{
+    monitor.journal.clear();
+    monitor.latest.clear();
+    monitor.validFrom = ++monitor.sequence;
+}
+
+void markChanged(Monitor& monitor, const std::string& path)
+{
+    uint64_t sequence = ++monitor.sequence;
+    auto [it, added] = monitor.latest.insert({path, sequence});
+    if (!added)
+    {
+        monitor.journal.erase(it->second);
+        it->second = sequence;
+    }
+    monitor.journal[sequence] = path;
+    if (monitor.latest.size() > MONITOR_MAX_PATHS)
+    {
+        forgetChanges(monitor);
+    }
+}
+
+// Watches a directory and everything below it. A directory that cannot be
+// watched (other than one removed meanwhile) leaves the monitor broken: it
+// would miss changes there, so it only answers "full" from then on.
+void watchTree(Monitor& monitor, const std::string& prefix)
+{
+    int wd = inotify_add_watch(monitor.inotifyFd, prefix.empty() ? "." : prefix.c_str(), MONITOR_EVENTS);
+    if (wd < 0)
+    {
+        monitor.broken = monitor.broken || (errno != ENOENT && errno != ENOTDIR);
+        return;
+    }
+    monitor.dirs[wd] = prefix;
+
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(prefix.empty() ? "." : prefix, ec); !ec && it != fs::directory_iterator(); it.increment(ec))
+    {
+        std::string name = it->path().filename().string();
+        if ((prefix.empty() && name == ".minigit") || it->is_symlink(ec) || !it->is_directory(ec))
+        {
+            continue;
+        }
+        watchTree(monitor, prefix + name + "/");
+    }
+}
+
+// Stops watching a directory that was removed or moved away, and everything
+// below it
+void dropWatches(Monitor& monitor, const std::string& prefix)
+{
+    for (auto it = monitor.dirs.begin(); it != monitor.dirs.end();)
+    {
+        if (it->second.compare(0, prefix.size(), prefix) == 0)
+        {
+            inotify_rm_watch(monitor.inotifyFd, it->first);
+            it = monitor.dirs.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void handleEvent(Monitor& monitor, const inotify_event& event)
+{
+    if (event.mask & IN_Q_OVERFLOW)
+    {
+        forgetChanges(monitor);
+        return;
+    }
+    if (event.wd == monitor.cookieWatch)
+    {
+        if (event.len > 0 && strncmp(event.name, MONITOR_COOKIE_PREFIX.c_str(), MONITOR_COOKIE_PREFIX.size()) == 0)
+        {
+            monitor.cookies.insert(event.name);
+        }
+        return;
+    }
+
+    auto it = monitor.dirs.find(event.wd);
+    if (it == monitor.dirs.end())
+    {
+        return;
+    }
+    std::string prefix = it->second;
+    if (event.mask & IN_IGNORED)
+    {
+        monitor.dirs.erase(it);
+        return;
+    }
+    if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        // Reported by the parent, unless it is the root itself
+        monitor.running = monitor.running && !prefix.empty();
+        return;
+    }
+    if (event.len == 0 || (prefix.empty() && strcmp(event.name, ".minigit") == 0))
+    {
+        return;
+    }
+
+    std::string path = prefix + event.name;
+    markChanged(monitor, path);
+    if (event.mask & IN_ISDIR)
+    {
+        if (event.mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            dropWatches(monitor, path + "/");
+        }
+        if (event.mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            watchTree(monitor, path + "/");
+        }
+    }
+}
+
+// Handles every event that is waiting
+void readEvents(Monitor& monitor)
+{
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (true)
+    {
+        ssize_t got = read(monitor.inotifyFd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return;
+        }
+        for (char* p = buffer; p < buffer + got;)
+        {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+            handleEvent(monitor, *event);
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+}
+
+// Creates a cookie file and waits for its event. inotify keeps events in
+// order, so once it is seen every earlier change has been read too.
+bool syncEvents(Monitor& monitor)
+{
+    static uint64_t cookieCount = 0;
+    std::string name = MONITOR_COOKIE_PREFIX + std::to_string(++cookieCount);
+    std::string path = ".minigit/" + name;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        return false;
+    }
+    close(fd);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(MONITOR_TIMEOUT_MS);
+    bool seen = false;
+    while (!seen && monitor.running)
+    {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        pollfd events = {monitor.inotifyFd, POLLIN, 0};
+        if (left <= 0 || poll(&events, 1, left) <= 0)
+        {
+            break;
+        }
+        readEvents(monitor);
+        seen = monitor.cookies.erase(name) > 0;
+    }
+    unlink(path.c_str());
+    return seen;
+}
+
+std::string monitorToken(const Monitor& monitor)
+{
+    return monitor.instance + ":" + std::to_string(monitor.sequence);
+}
+
+std::string answerMonitorRequest(Monitor& monitor, const std::string& request)
+{
+    if (request == "status")
+    {
+        return "token " + monitorToken(monitor) + ", " + std::to_string(monitor.dirs.size()) + " directories watched, "
+            + std::to_string(monitor.latest.size()) + " paths changed" + (monitor.broken ? ", incomplete" : "") + "\n\n";
+    }
+    if (request.rfind("query ", 0) != 0)
+    {
+        return "unknown request\n\n";
+    }
+
+    bool synced = syncEvents(monitor);
+    std::string since = request.substr(6);
+    size_t colon = since.rfind(':');
+    uint64_t from = 0;
+    bool known = synced && !monitor.broken && colon != std::string::npos && since.compare(0, colon, monitor.instance) == 0
+        && colon + 1 < since.size() && since.find_first_not_of("0123456789", colon + 1) == std::string::npos;
+    if (known)
+    {
+        from = std::strtoull(since.c_str() + colon + 1, nullptr, 10);
+        known = from >= monitor.validFrom && from <= monitor.sequence;
+    }
+
+    std::string reply = monitorToken(monitor) + "\n";
+    if (!known)
+    {
+        return reply + "full\n\n";
+    }
+    reply += "changed\n";
+    for (auto it = monitor.journal.upper_bound(from); it != monitor.journal.end(); ++it)
+    {
+        reply += it->second + "\n";
+    }
+    return reply + "\n";
+}
+
+bool sendAll(int fd, const std::string& text)
+{
+    size_t sent = 0;
+    while (sent < text.size())
+    {
+        ssize_t got = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return false;
+        }
+        sent += got;
+    }
+    return true;
+}
+
+int connectMonitor()
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, MONITOR_SOCKET_PATH.c_str(), MONITOR_SOCKET_PATH.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    timeval timeout = {2 * MONITOR_TIMEOUT_MS / 1000, 0}; // the monitor may wait that long to sync
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0
+        || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends one request to the monitor and reads its answer, without the empty
+// line that ends it. Fails if no monitor is running or it does not answer in
+// time.
+bool monitorRequest(const std::string& request, std::string& reply)
+{
+    reply.clear();
+    int fd = connectMonitor();
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool ok = sendAll(fd, request + "\n");
+    char buffer[64 * 1024];
+    while (ok && !(reply.size() >= 2 && reply.compare(reply.size() - 2, 2, "\n\n") == 0) && reply != "\n")
+    {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        ok = got > 0;
+        if (ok)
+        {
+            reply.append(buffer, got);
+        }
+    }
+    close(fd);
+    if (ok)
+    {
+        reply.pop_back();
+    }
+    return ok;
+}
+
+// The monitor process itself. Reports "ok" or what went wrong on ready once
+// everything is watched and it is listening.
+int runMonitor(int ready)
+{
+    auto report = [&](const std::string& text) {
+        writeAll(ready, text.data(), text.size());
+        close(ready);
+    };
+
+    Monitor monitor;
+    monitor.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (monitor.inotifyFd < 0)
+    {
+        report(std::string("inotify is not available: ") + strerror(errno));
+        return 1;
+    }
+    monitor.instance = std::to_string(getpid()) + "-" + std::to_string(std::time(nullptr));
+    monitor.cookieWatch = inotify_add_watch(monitor.inotifyFd, ".minigit", IN_CREATE | IN_ONLYDIR);
+    watchTree(monitor, "");
+    if (monitor.cookieWatch < 0 || monitor.broken)
+    {
+        report("Could not watch every directory; the inotify watch limit may be too low.");
+        return 1;
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, MONITOR_SOCKET_PATH.c_str(), MONITOR_SOCKET_PATH.size() + 1);
+    unlink(MONITOR_SOCKET_PATH.c_str());
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(server, 16) != 0)
+    {
+        report(std::string("Could not listen on ") + MONITOR_SOCKET_PATH + ": " + strerror(errno));
+        return 1;
+    }
+    chmod(MONITOR_SOCKET_PATH.c_str(), 0600);
+    report("ok");
+
+    while (monitor.running)
+    {
+        pollfd events[2] = {{monitor.inotifyFd, POLLIN, 0}, {server, POLLIN, 0}};
+        if (poll(events, 2, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (events[0].revents & POLLIN)
+        {
+            readEvents(monitor);
+        }
+        if (!(events[1].revents & POLLIN))
+        {
+            continue;
+        }
+
+        int client = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+        {
+            continue;
+        }
+        timeval timeout = {MONITOR_TIMEOUT_MS / 1000, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        std::string request;
+        char c;
+        while (request.size() < 4096 && read(client, &c, 1) == 1 && c != '\n')
+        {
+            request += c;
+        }
+        if (request == "shutdown")
+        {
+            sendAll(client, "stopping\n\n");
+            monitor.running = false;
+        }
+        else
+        {
+            sendAll(client, answerMonitorRequest(monitor, request));
+        }
+        close(client);
+    }
+
+    close(server);
+    unlink(MONITOR_SOCKET_PATH.c_str());
+    return 0;
+}
+
+// monitor start: runs the monitor as a daemon and waits until it is ready
+int startMonitor()
+{
+    std::string reply;
+    if (monitorRequest("status", reply))
+    {
+        std::cout << "The monitor is already running.\n";
+        return 0;
+    }
+
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) != 0)
+    {
+        std::cout << "Error: Could not start the monitor.\n";
+        return 1;
+    }
+    std::cout.flush();
+    pid_t child = fork();
+    if (child == 0)
+    {
+        // Detached from the terminal and from this process
+        close(ready[0]);
+        setsid();
+        if (fork() != 0)
+        {
+            _exit(0);
+        }
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, 0);
+        dup2(null, 1);
+        dup2(null, 2);
+        signal(SIGHUP, SIG_IGN);
+        _exit(runMonitor(ready[1]));
+    }
+    close(ready[1]);
+    if (child > 0)
+    {
+        waitpid(child, nullptr, 0);
+    }
+
+    std::string status;
+    char buffer[512];
+    ssize_t got;
+    while ((got = read(ready[0], buffer, sizeof(buffer))) > 0 || (got < 0 && errno == EINTR))
+    {
+        status.append(buffer, std::max<ssize_t>(got, 0));
+    }
+    close(ready[0]);
+
+    if (status != "ok")
+    {
+        std::cout << "Error: " << (status.empty() ? "Could not start the monitor." : status) << "\n";
+        return 1;
+    }
+    std::cout << "Monitor started; status, add and checkout now only look at files it reports as changed.\n";
+    return 0;
+}
+
+// monitor start | stop | status
+int runMonitorCommand(const std::vector<std::string>& args)
+{
+    std::string reply;
+    if (args.size() == 2 && args[1] == "start")
+    {
+        return startMonitor();
+    }
+    if (args.size() == 2 && args[1] == "stop")
+    {
+        std::cout << (monitorRequest("shutdown", reply) ? "Monitor stopped.\n" : "No monitor is running.\n");
+        return 0;
+    }
+    if (args.size() == 2 && args[1] == "status")
+    {
+        std::cout << (monitorRequest("status", reply) ? "Monitor running: " + reply : "No monitor is running.\n");
+        return 0;
+    }
+    std::cout << "Usage: minigit monitor start | stop | status\n";
+    return 1;
+}
+
+// What status last found, as of the monitor token it was given before it looked
+struct MonitorState
+{
+    std::string token;
+    std::vector<std::string> dirty;     // modified or deleted tracked files
+    std::vector<std::string> untracked;
+};
+
+bool loadMonitorState(MonitorState& state)
+{
+    std::ifstream file(MONITOR_STATE_PATH);
+    std::string line;
+    if (!std::getline(file, state.token) || state.token.empty())
+    {
+        return false;
+    }
+    while (std::getline(file, line))
+    {
+        if (line.size() > 2 && line[0] == 'M')
+        {
+            state.dirty.push_back(line.substr(2));
+        }
+        else if (line.size() > 2 && line[0] == 'U')
+        {
+            state.untracked.push_back(line.substr(2));
+        }
+    }
+    return true;
+}
+
+void saveMonitorState(const MonitorState& state)
+{
+    std::string out = state.token + "\n";
+    for (const auto& path : state.dirty)
+    {
+        out += "M " + path + "\n";
+    }
+    for (const auto& path : state.untracked)
+    {
+        out += "U " + path + "\n";
+    }
+
+    std::string tmpPath = MONITOR_STATE_PATH + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file.write(out.data(), out.size());
+    file.close();
+    if (!file || std::rename(tmpPath.c_str(), MONITOR_STATE_PATH.c_str()) != 0)
+    {
+        unlink(tmpPath.c_str());
+    }
+}
+
+// What the monitor knows about the working tree
+struct WorktreeView
+{
+    bool monitored = false;       // false: nothing is known, look at every file
+    std::string token;            // for status to keep once it has looked; empty without a monitor
+    std::set<std::string> check;  // paths that may differ from the index; a directory covers all below it
+
+    bool mayHaveChanged(const std::string& path) const
+    {
+        if (!monitored || check.count(path))
+        {
+            return true;
+        }
+        for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1))
+        {
+            if (check.count(path.substr(0, slash)))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Asks the monitor what changed since status last looked. Files outside
+// view.check were clean then and have not been touched since.
+WorktreeView viewWorktree()
+{
+    TraceSpan span("monitor: query");
+    WorktreeView view;
+    MonitorState state;
+    bool known = loadMonitorState(state);
+    std::string reply;
+    if (!monitorRequest("query " + (known ? state.token : std::string("none")), reply))
+    {
+        return view;
+    }
+
+    std::istringstream lines(reply);
+    std::string kind, path;
+    std::getline(lines, view.token);
+    std::getline(lines, kind);
+    if (!known || kind != "changed")
+    {
+        return view;
+    }
+    view.monitored = true;
+    view.check.insert(state.dirty.begin(), state.dirty.end());
+    view.check.insert(state.untracked.begin(), state.untracked.end());
+    while (std::getline(lines, path))
+    {
+        view.check.insert(path);
+    }
+    return view;
+}
+
+// Positions of the index entries the view says to look at, in order
+std::vector<size_t> entriesToCheck(const StatIndex& index, const WorktreeView& view)
+{
+    std::vector<size_t> found;
+    if (!view.monitored)
+    {
+        for (size_t i = 0; i < index.entries.size(); ++i)
+        {
+            found.push_back(i);
+        }
+        return found;
+    }
+
+    auto byPath = [](const IndexEntry& entry, const std::string& key) { return entry.path < key; };
+    for (const auto& path : view.check)
+    {
+        auto it = std::lower_bound(index.entries.begin(), index.entries.end(), path, byPath);
+        if (it != index.entries.end() && it->path == path)
+        {
+            found.push_back(it - index.entries.begin());
+        }
+        std::string below = path + "/";
+        for (it = std::lower_bound(it, index.entries.end(), below, byPath);
+             it != index.entries.end() && it->path.compare(0, below.size(), below) == 0; ++it)
+        {
+            found.push_back(it - index.entries.begin());
+        }
+    }
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    return found;
+}
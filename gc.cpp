@@ -0,0 +1,311 @@
+// Garbage collection
+//
+// `minigit gc` deletes the loose objects nothing refers to any more, such as
+// the blobs of a file that was added again before it was committed. An
+// object is kept if it can be reached from a branch or a merge in progress
+// (through commits, their trees and FILE lines, and the chunks of chunked
+// blobs), or from staging.txt or the index.
+//
+// Objects written in the last GC_GRACE_SECONDS are kept too: another minigit
+// may have just stored one it has not staged yet. `gc --prune=now` drops the
+// grace period, for when nothing else is running.
+//
+// Marking reads a whole level of trees at a time, split among the workers,
+// which share one set of marked IDs; the set is sharded so they rarely wait
+// on each other. Sweeping gives each worker whole fan-out directories.
+//
+// Packs are left to the pack command, which uses the same marking: it only
+// packs reachable objects and writes the unreachable ones of old packs back
+// out as loose objects, which a later gc removes. Temporary files of a pack
+// that never finished are swept here.
+
+const time_t GC_GRACE_SECONDS = 60 * 60;
+
+// Object IDs seen so far, safe to use from several threads
+struct MarkSet
+{
+    static const size_t SHARDS = 64;
+
+    struct Shard
+    {
+        std::mutex lock;
+        std::unordered_set<std::string> ids;
+    };
+    std::array<Shard, SHARDS> shards;
+
+    Shard& shardOf(const std::string& id)
+    {
+        return shards[std::hash<std::string>()(id) % SHARDS];
+    }
+
+    // True the first time an ID is marked
+    bool mark(const std::string& id)
+    {
+        Shard& shard = shardOf(id);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return shard.ids.insert(id).second;
+    }
+
+    bool marked(const std::string& id)
+    {
+        Shard& shard = shardOf(id);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return shard.ids.count(id) > 0;
+    }
+
+    size_t size()
+    {
+        size_t total = 0;
+        for (auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            total += shard.ids.size();
+        }
+        return total;
+    }
+};
+
+// Marks everything below the given trees, which are already marked, and the
+// chunks of every newly marked blob. Returns false if a tree could not be
+// read, since what it refers to is then unknown.
+bool markTrees(MarkSet& marks, std::vector<std::string> trees, std::vector<std::string>& blobs)
+{
+    TraceSpan span("gc: mark trees");
+    std::mutex failedLock;
+    std::string failed;
+    while (!trees.empty())
+    {
+        std::vector<std::vector<std::string>> subtrees(trees.size()), found(trees.size());
+        runParallel(trees.size(), [&](size_t i) {
+            std::vector<TreeEntry> entries;
+            if (!readTree(trees[i], entries))
+            {
+                std::lock_guard<std::mutex> guard(failedLock);
+                failed = trees[i];
+                return;
+            }
+            for (const auto& entry : entries)
+            {
+                if (marks.mark(entry.id))
+                {
+                    (entry.isTree ? subtrees[i] : found[i]).push_back(entry.id);
+                }
+            }
+        });
+
+        trees.clear();
+        for (size_t i = 0; i < subtrees.size(); ++i)
+        {
+            trees.insert(trees.end(), subtrees[i].begin(), subtrees[i].end());
+            blobs.insert(blobs.end(), found[i].begin(), found[i].end());
+        }
+    }
+
+    if (!failed.empty())
+    {
+        std::cout << "Error: Could not read tree " << failed << ".\n";
+        return false;
+    }
+
+    span.restart("gc: mark chunks");
+    runParallel(blobs.size(), [&](size_t i) {
+        for (const auto& chunk : blobChunks(blobs[i]))
+        {
+            marks.mark(chunk.id);
+        }
+    });
+    return true;
+}
+
+// Marks every commit reachable from the branches and MERGE_HEAD.txt, and
+// hands back their trees and FILE blobs
+bool markCommits(MarkSet& marks, std::vector<std::string>& trees, std::vector<std::string>& blobs)
+{
+    TraceSpan span("gc: mark commits");
+    std::vector<std::string> heads;
+    for (const auto& [name, hash] : listRefs())
+    {
+        heads.push_back(hash);
+    }
+    std::ifstream mergeHead(".minigit/MERGE_HEAD.txt");
+    std::string mergeParent;
+    if (std::getline(mergeHead, mergeParent))
+    {
+        heads.push_back(mergeParent);
+    }
+
+    CommitGraph graph;
+    if (!openCommitGraph(graph))
+    {
+        std::cout << "Error: Could not read the commit graph.\n";
+        return false;
+    }
+
+    std::vector<bool> seen(graph.count);
+    std::vector<uint32_t> pending, reachable;
+    for (const auto& head : heads)
+    {
+        if (head.empty())
+        {
+            continue;
+        }
+        int64_t index = findCommitIndex(graph, head);
+        if (index < 0)
+        {
+            std::cout << "Error: Commit " << head << " was not found.\n";
+            return false;
+        }
+        pending.push_back(index);
+    }
+    while (!pending.empty())
+    {
+        uint32_t index = pending.back();
+        pending.pop_back();
+        if (index == NO_PARENT || seen[index])
+        {
+            continue;
+        }
+        seen[index] = true;
+        reachable.push_back(index);
+        pending.push_back(graph.entries[index].parent);
+        pending.push_back(graph.entries[index].parent2);
+    }
+
+    // Blob IDs are interned by the arena, so one that many old commits
+    // list is only marked once
+    CommitArena arena;
+    loadAllCommits(arena);
+    std::vector<bool> blobSeen(arena.blobs.strings.size());
+    for (uint32_t index : reachable)
+    {
+        const ArenaCommit* c = arena.atOffset(graph.entries[index].offset);
+        if (!c)
+        {
+            std::cout << "Error: Could not read commit " << entryID(graph.entries[index]) << ".\n";
+            return false;
+        }
+        if (!c->tree.empty() && marks.mark(std::string(c->tree)))
+        {
+            trees.emplace_back(c->tree);
+        }
+        // Commits from before trees only have their FILE lines
+        for (uint32_t f = c->filesBegin; f < c->filesEnd; ++f)
+        {
+            uint32_t blob = arena.files[f].blob;
+            if (!blobSeen[blob])
+            {
+                blobSeen[blob] = true;
+                std::string hash(arena.blobs.strings[blob]);
+                if (marks.mark(hash))
+                {
+                    blobs.push_back(hash);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Marks every object that can be reached from the branches, a merge in
+// progress, staging.txt or the index
+bool markReachable(MarkSet& marks)
+{
+    std::vector<std::string> trees, blobs;
+    if (!markCommits(marks, trees, blobs))
+    {
+        return false;
+    }
+
+    // Staged files and everything the index remembers
+    std::vector<std::string> staged;
+    for (const auto& [file, hash] : getStagedFiles())
+    {
+        staged.push_back(hash);
+    }
+    StatIndex index;
+    loadIndex(index);
+    for (const auto& entry : index.entries)
+    {
+        staged.push_back(entry.hash);
+    }
+    for (const auto& hash : staged)
+    {
+        if (!hash.empty() && marks.mark(hash))
+        {
+            blobs.push_back(hash);
+        }
+    }
+
+    return markTrees(marks, std::move(trees), blobs);
+}
+
+// The IDs markReachable finds, for the pack command
+bool reachableObjects(std::unordered_set<std::string>& ids)
+{
+    MarkSet marks;
+    if (!markReachable(marks))
+    {
+        return false;
+    }
+    ids.clear();
+    for (auto& shard : marks.shards)
+    {
+        ids.merge(shard.ids);
+    }
+    return true;
+}
+
+// gc [--prune=now]
+bool collectGarbage(bool pruneNow)
+{
+    TraceSpan span("gc");
+    MarkSet marks;
+    if (!markReachable(marks))
+    {
+        std::cout << "Nothing was removed.\n";
+        return false;
+    }
+
+    span.restart("gc: sweep");
+    time_t cutoff = pruneNow ? std::numeric_limits<time_t>::max() : std::time(nullptr) - GC_GRACE_SECONDS;
+    std::vector<std::string> dirs = fanOutDirectories();
+    std::atomic<size_t> removed{0};
+    std::atomic<uint64_t> freed{0};
+    runParallel(dirs.size(), [&](size_t i) {
+        for (const auto& [id, file] : looseObjectsIn(dirs[i]))
+        {
+            struct stat st;
+            if (marks.marked(id) || stat(file.c_str(), &st) != 0 || st.st_mtime >= cutoff)
+            {
+                continue;
+            }
+            if (unlink(file.c_str()) == 0)
+            {
+                ++removed;
+                freed += st.st_size;
+            }
+        }
+        rmdir(dirs[i].c_str()); // only goes if it is empty now
+    });
+
+    // Temporary files of writers and packs that never finished
+    for (const auto& dir : {OBJECTS_DIR, PACK_DIR})
+    {
+        std::error_code ec;
+        for (auto it = fs::directory_iterator(dir, ec); !ec && it != fs::directory_iterator(); it.increment(ec))
+        {
+            struct stat st;
+            std::string file = it->path().string();
+            if (it->path().filename().string().rfind("tmp_", 0) == 0 && stat(file.c_str(), &st) == 0
+                && st.st_mtime < cutoff && unlink(file.c_str()) == 0)
+            {
+                ++removed;
+                freed += st.st_size;
+            }
+        }
+    }
+
+    std::cout << "Removed " << removed << " unreachable objects (" << freed << " bytes); " << marks.size()
+              << " objects are reachable.\n";
+    return true;
+}
@@ -0,0 +1,275 @@
+// Hash engine
+//
+// Object and commit IDs come from the repository's hash algorithm:
+//
+//   sha256  256-bit digest, printed as 64 lowercase hex digits. Used by every
+//           repository created by init.
+//   djb2    the original 64-bit hash, printed in decimal. Repositories without
+//           a "hash" setting in config.txt keep using it, so their existing
+//           IDs stay valid.
+//
+// SHA-256 runs through a block function that is picked once at startup: the
+// x86 SHA extensions when the CPU has them, otherwise portable C++.
+// MINIGIT_HASH_KERNEL=generic forces the portable one.
+
+enum class HashAlgorithm
+{
+    Djb2,
+    Sha256
+};
+
+HashAlgorithm repoHashAlgorithm()
+{
+    return getConfig("hash", "djb2") == "sha256" ? HashAlgorithm::Sha256 : HashAlgorithm::Djb2;
+}
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+inline uint32_t rotr32(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+void sha256BlocksGeneric(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+    for (; blocks > 0; --blocks, data += 64)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+        {
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; ++i)
+        {
+            uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; ++i)
+        {
+            uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+            uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+
+// SHA-NI kernel: four rounds per pair of sha256rnds2 instructions, with the
+// message schedule computed by sha256msg1/sha256msg2
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha256BlocksShaNi(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // Rearrange a..h into the ABEF / CDGH layout the instructions expect
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; blocks > 0; --blocks, data += 64)
+    {
+        __m128i abefSave = state0;
+        __m128i cdghSave = state1;
+        __m128i w[4];
+
+        for (int i = 0; i < 16; ++i)
+        {
+            __m128i& current = w[i % 4];
+            if (i < 4)
+            {
+                current = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16)), byteSwap);
+            }
+            else
+            {
+                // w[i] = msg2(msg1(w[i-4], w[i-3]) + (w[i-2]:w[i-1] >> 4 bytes), w[i-1])
+                __m128i previous = w[(i - 1) % 4];
+                __m128i sum = _mm_add_epi32(_mm_sha256msg1_epu32(current, w[(i - 3) % 4]), _mm_alignr_epi8(previous, w[(i - 2) % 4], 4));
+                current = _mm_sha256msg2_epu32(sum, previous);
+            }
+
+            __m128i message = _mm_add_epi32(current, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&SHA256_K[i * 4])));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+            message = _mm_shuffle_epi32(message, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+        }
+
+        state0 = _mm_add_epi32(state0, abefSave);
+        state1 = _mm_add_epi32(state1, cdghSave);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+bool cpuHasShaExtensions()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        return false;
+    }
+    bool ssse3 = ecx & (1u << 9);
+    bool sse41 = ecx & (1u << 19);
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+        return false;
+    }
+    bool sha = ebx & (1u << 29);
+
+    return ssse3 && sse41 && sha;
+}
+#endif
+
+using Sha256BlockFunction = void (*)(uint32_t*, const uint8_t*, size_t);
+
+Sha256BlockFunction selectSha256Kernel()
+{
+    const char* forced = std::getenv("MINIGIT_HASH_KERNEL");
+    if (forced && std::string(forced) == "generic")
+    {
+        return sha256BlocksGeneric;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpuHasShaExtensions())
+    {
+        return sha256BlocksShaNi;
+    }
+#endif
+    return sha256BlocksGeneric;
+}
+
+const Sha256BlockFunction sha256Blocks = selectSha256Kernel();
+
+struct Sha256State
+{
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint64_t length = 0;
+    uint8_t buffer[64];
+    size_t buffered = 0;
+};
+
+void sha256Update(Sha256State& state, const uint8_t* data, size_t size)
+{
+    state.length += size;
+
+    if (state.buffered > 0)
+    {
+        size_t take = std::min(size, 64 - state.buffered);
+        memcpy(state.buffer + state.buffered, data, take);
+        state.buffered += take;
+        data += take;
+        size -= take;
+        if (state.buffered < 64)
+        {
+            return;
+        }
+        sha256Blocks(state.h, state.buffer, 1);
+        state.buffered = 0;
+    }
+
+    // Whole blocks straight from the caller's buffer
+    size_t blocks = size / 64;
+    if (blocks > 0)
+    {
+        sha256Blocks(state.h, data, blocks);
+        data += blocks * 64;
+        size -= blocks * 64;
+    }
+
+    memcpy(state.buffer, data, size);
+    state.buffered = size;
+}
+
+std::string sha256Digest(Sha256State state)
+{
+    uint64_t bits = state.length * 8;
+    uint8_t padding[72] = {0x80};
+    size_t padSize = (state.buffered < 56 ? 56 : 120) - state.buffered;
+    for (int i = 0; i < 8; ++i)
+    {
+        padding[padSize + i] = bits >> (56 - i * 8);
+    }
+    sha256Update(state, padding, padSize + 8);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string digest(64, '0');
+    for (int i = 0; i < 8; ++i)
+    {
+        for (int j = 0; j < 8; ++j)
+        {
+            digest[i * 8 + j] = hex[(state.h[i] >> (28 - j * 4)) & 0xF];
+        }
+    }
+    return digest;
+}
+
+// Running hash state, so content can be hashed piece by piece. Uses the
+// repository's algorithm unless one is given.
+struct HashState
+{
+    HashAlgorithm algorithm;
+    unsigned long hash = 5381; // djb2
+    Sha256State sha256;
+
+    HashState() : algorithm(repoHashAlgorithm()) {}
+    explicit HashState(HashAlgorithm algorithm) : algorithm(algorithm) {}
+};
+
+void hashUpdate(HashState &state, const char *data, size_t size)
+{
+    if (state.algorithm == HashAlgorithm::Sha256)
+    {
+        sha256Update(state.sha256, reinterpret_cast<const uint8_t *>(data), size);
+        return;
+    }
+
+    unsigned long hash = state.hash;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = ((hash << 5) + hash) + data[i]; // hash * 33 + c
+    }
+    state.hash = hash;
+}
+
+std::string hashDigest(const HashState &state)
+{
+    traceCount(TraceObjectsHashed);
+    if (state.algorithm == HashAlgorithm::Sha256)
+    {
+        return sha256Digest(state.sha256);
+    }
+    return std::to_string(state.hash);
+}
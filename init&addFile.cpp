@@ -1,12 +1,12 @@
 // 1.
-void initMiniGit()
+bool initMiniGit()
 {
     std::string repoPath = ".minigit";
 
     if (fs::exists(repoPath))
     {
         std::cout << "Repository already initialized. \n";
-        return;
+        return false;
     }
 
     // Create .minigit folder
@@ -18,75 +18,445 @@ void initMiniGit()
     // Create commits file
     std::ofstream commitsFile(repoPath + "/commits.txt");
 
-    // Create branches file with default "main" branch
-    std::ofstream branchesFile(repoPath + "/branches.txt");
-    branchesFile << "main:\n"; // start with an empty main branch
-    branchesFile.close();
+    // Create the ref store with a default "main" branch
+    createRef("main", ""); // start with an empty main branch
 
     // Create HEAD file pointing to main
     std::ofstream headFile(repoPath + "/HEAD.txt");
     headFile << "main"; // HEAD is now pointing to the main branch
     headFile.close();
 
+    // New repositories use SHA-256 IDs and fan-out object directories
+    std::ofstream configFile(repoPath + "/config.txt");
+    configFile << "hash:sha256\n";
+    configFile << "objects:fan-out\n";
+    configFile.close();
+    reloadConfig();
+
     std::cout << "MiniGit repository initilized successfully!\n";
+    return true;
 }
 
 // 2.
 std::string hashFunc(const std::string &content)
 {
-    unsigned long hash = 5381;
-    for (char c : content)
+    HashState state;
+    hashUpdate(state, content.data(), content.size());
+    return hashDigest(state);
+}
+
+// Expands directories into the files below them (skipping .minigit) and
+// returns the normalized, de-duplicated list of paths to stage
+std::vector<std::string> expandAddPaths(const std::vector<std::string> &paths)
+{
+    std::vector<std::string> files;
+
+    for (const auto &path : paths)
     {
-        hash = ((hash << 5) + hash) + c; // hash * 33 + 1;
+        if (!fs::is_directory(path))
+        {
+            files.push_back(fs::path(path).lexically_normal().generic_string());
+            continue;
+        }
+
+        auto it = fs::recursive_directory_iterator(path, fs::directory_options::skip_permission_denied);
+        for (auto end = fs::end(it); it != end; ++it)
+        {
+            if (it->path().filename() == ".minigit")
+            {
+                it.disable_recursion_pending();
+                continue;
+            }
+            if (it->is_regular_file())
+            {
+                files.push_back(it->path().lexically_normal().generic_string());
+            }
+        }
     }
 
-    return std::to_string(hash);
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+    return files;
 }
 
-std::string readFileContent(const std::string &fileName)
+enum class AddStatus
 {
-    std::ifstream file(fileName);
-    if (!file.is_open())
+    Added,
+    Missing,
+    Empty,
+    Failed
+};
+
+const size_t STREAM_CHUNK_SIZE = 128 * 1024;
+
+// Reads an open file to the end in fixed-size chunks, hashing each chunk and,
+// if a writer is given, passing it on to the object store
+bool hashStream(int in, HashState &state, BlobWriter *blob, size_t &total)
+{
+    std::vector<char> buffer(STREAM_CHUNK_SIZE);
+    total = 0;
+
+    while (true)
     {
-        return "";
+        ssize_t got = read(in, buffer.data(), buffer.size());
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return got == 0;
+        }
+        traceCount(TraceBytesRead, got);
+
+        hashUpdate(state, buffer.data(), got);
+        if (blob && !blob->write(buffer.data(), got))
+        {
+            return false;
+        }
+        total += got;
     }
+}
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    return buffer.str();
+// Whether a file whose index entry is known holds the placeholder a lazy
+// checkout left for it. Any other file that merely looks like a placeholder
+// is taken for its own content.
+bool isPlaceholderFor(const IndexEntry *known, const std::string &placeholder)
+{
+    return known && (known->stat.flags & INDEX_LAZY) && placeholder == known->hash && objectExists(placeholder);
 }
 
-void addFile(const std::string &fileName)
+// Hashes a file without storing it, recording its stat data. The placeholder
+// a lazy checkout left for known hashes as the blob it stands for.
+bool hashFile(const std::string &fileName, std::string &hash, IndexRecord &record, const IndexEntry *known)
 {
+    int in = open(fileName.c_str(), O_RDONLY);
+    if (in < 0)
+    {
+        return false;
+    }
+    traceCount(TraceFilesOpened);
+
+    struct stat st;
+    if (fstat(in, &st) != 0)
+    {
+        close(in);
+        return false;
+    }
+    std::string placeholder;
+    if (known && readPlaceholder(in, st, placeholder) && isPlaceholderFor(known, placeholder))
+    {
+        close(in);
+        hash = placeholder;
+        record = statRecord(st);
+        record.flags = INDEX_LAZY;
+        return true;
+    }
 
+    HashState state;
+    size_t total;
+    bool ok = hashStream(in, state, nullptr, total);
+    close(in);
+
+    if (ok)
+    {
+        hash = hashDigest(state);
+        record = statRecord(st);
+    }
+    return ok;
+}
+
+// Hashes one file and saves its blob. Safe to call from several threads.
+// The file is streamed through a BlobWriter, which stores it whole or, for
+// large files, as content-defined chunks; either way the blob is only named
+// once the hash is known, so memory use does not depend on the file size.
+// Files whose stat data still matches the index are not read at all.
+AddStatus storeBlob(const std::string &fileName, const StatIndex &index, IndexEntry &result)
+{
     // Checks if the file exists
-    if (!fs::exists(fileName))
+    int in = open(fileName.c_str(), O_RDONLY);
+    if (in < 0)
+    {
+        return errno == ENOENT ? AddStatus::Missing : AddStatus::Failed;
+    }
+    traceCount(TraceFilesOpened);
+
+    struct stat st;
+    if (fstat(in, &st) != 0)
+    {
+        close(in);
+        return AddStatus::Failed;
+    }
+
+    const IndexEntry *known = findIndexEntry(index, fileName);
+    if (known && statMatches(index, *known, st) && objectExists(known->hash))
+    {
+        close(in);
+        result = *known;
+        return AddStatus::Added;
+    }
+
+    // A lazy checkout's placeholder adds the blob it stands for, which is
+    // already stored
+    std::string placeholder;
+    if (known && readPlaceholder(in, st, placeholder) && isPlaceholderFor(known, placeholder))
+    {
+        close(in);
+        result = {fileName, placeholder, statRecord(st)};
+        result.stat.flags = INDEX_LAZY;
+        return AddStatus::Added;
+    }
+
+    if (st.st_size == 0)
+    {
+        close(in);
+        return AddStatus::Empty;
+    }
+
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    BlobWriter blob;
+    if (!blob.open(st.st_size))
+    {
+        close(in);
+        return AddStatus::Failed;
+    }
+
+    HashState state;
+    size_t total;
+    bool ok = hashStream(in, state, &blob, total);
+    close(in);
+
+    if (!ok || total == 0)
+    {
+        blob.abort();
+        return ok ? AddStatus::Empty : AddStatus::Failed;
+    }
+
+    // Saves blob as .minigit/object/hash, unless an identical one is there
+    result.path = fileName;
+    result.hash = hashDigest(state);
+    result.stat = statRecord(st);
+    if (!blob.commit(result.hash))
+    {
+        return AddStatus::Failed;
+    }
+
+    return AddStatus::Added;
+}
+
+// storeBlob for a file that readFiles has already opened: its stat data is
+// at hand and, unless the file is large, so is its content
+AddStatus storeReadBlob(const FileRead &file, const StatIndex &index, IndexEntry &result)
+{
+    if (file.error)
+    {
+        return file.error == ENOENT ? AddStatus::Missing : AddStatus::Failed;
+    }
+
+    const IndexEntry *known = findIndexEntry(index, file.path);
+    if (known && statMatches(index, *known, file.st) && objectExists(known->hash))
+    {
+        result = *known;
+        return AddStatus::Added;
+    }
+    if (!file.read)
+    {
+        return storeBlob(file.path, index, result);
+    }
+    if (file.data.empty())
+    {
+        return AddStatus::Empty;
+    }
+    std::string placeholder;
+    if (known && parsePlaceholder(file.data, placeholder) && isPlaceholderFor(known, placeholder))
+    {
+        result = {file.path, placeholder, statRecord(file.st)};
+        result.stat.flags = INDEX_LAZY;
+        return AddStatus::Added;
+    }
+
+    BlobWriter blob;
+    if (!blob.open(file.data.size()))
+    {
+        return AddStatus::Failed;
+    }
+    HashState state;
+    hashUpdate(state, file.data.data(), file.data.size());
+    if (!blob.write(file.data.data(), file.data.size()))
+    {
+        blob.abort();
+        return AddStatus::Failed;
+    }
+
+    result.path = file.path;
+    result.hash = hashDigest(state);
+    result.stat = statRecord(file.st);
+    return blob.commit(result.hash) ? AddStatus::Added : AddStatus::Failed;
+}
+
+std::string getParentHash();
+
+// Whether a path is in the index or in the current commit
+bool isTracked(const StatIndex &index, const std::string &path)
+{
+    std::string tree;
+    return findIndexEntry(index, path) || (commitTree(getParentHash(), tree) && !findTreeEntry(tree, path).empty());
+}
+
+// Stages any number of files and directories. Files are read a batch at a
+// time (see async-io.cpp), skipping those the index says are unchanged, and
+// hashed and stored on all cores; staging.txt is then appended to in one
+// write, in path order.
+//
+// A tracked file that was deleted, named itself or below a directory being
+// added, is staged as a removal: the path with an empty hash.
+bool addFiles(const std::vector<std::string> &paths)
+{
+    TraceSpan span("add");
+    TraceSpan phase("add: expand paths");
+    std::vector<std::string> files = expandAddPaths(paths);
+
+    phase.restart("add: read index");
+    StatIndex index;
+    WorktreeView view = loadIndex(index) ? viewWorktree() : WorktreeView();
+
+    // Tracked files that are gone from the directories being added
+    size_t listed = files.size();
+    for (const auto &path : paths)
+    {
+        if (!fs::is_directory(path))
+        {
+            continue;
+        }
+        std::string prefix = fs::path(path).lexically_normal().generic_string();
+        prefix = prefix == "." ? "" : prefix.back() == '/' ? prefix : prefix + "/";
+        for (const auto &entry : index.entries)
+        {
+            struct stat st;
+            if (entry.path.compare(0, prefix.size(), prefix) == 0 && lstat(entry.path.c_str(), &st) != 0)
+            {
+                files.push_back(entry.path);
+            }
+        }
+    }
+    if (files.size() != listed)
+    {
+        std::sort(files.begin(), files.end());
+        files.erase(std::unique(files.begin(), files.end()), files.end());
+    }
+    if (files.empty())
     {
-        std::cout << "The file '" << fileName << "' does not exist.\n";
-        return;
+        std::cout << "Nothing to add.\n";
+        return false;
     }
 
-    // Reads the content of the file
-    std::string content = readFileContent(fileName);
-    if (content.empty())
+    // Files the monitor knows to be clean keep their entry without being opened
+    phase.restart("add: store blobs");
+    std::vector<IndexEntry> entries(files.size());
+    std::vector<AddStatus> results(files.size());
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < files.size(); ++i)
     {
-        std::cout << "The file is empty.";
-        return;
+        const IndexEntry *known = findIndexEntry(index, files[i]);
+        if (known && !view.mayHaveChanged(files[i]) && objectExists(known->hash))
+        {
+            entries[i] = *known;
+            results[i] = AddStatus::Added;
+        }
+        else
+        {
+            pending.push_back(i);
+        }
     }
 
-    // Generates a hash of the content
-    std::string hashedContent = hashFunc(content);
+    for (size_t start = 0; start < pending.size(); start += IO_BATCH_FILES)
+    {
+        size_t count = std::min(IO_BATCH_FILES, pending.size() - start);
+        std::vector<FileRead> batch(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            batch[i].path = files[pending[start + i]];
+        }
+        readFiles(batch, [&](const FileRead &file) {
+            const IndexEntry *known = findIndexEntry(index, file.path);
+            return (uint64_t)file.st.st_size <= IO_BATCH_MAX_FILE && !(known && statMatches(index, *known, file.st));
+        });
+
+        runParallel(count, [&](size_t i) {
+            size_t file = pending[start + i];
+            results[file] = storeReadBlob(batch[i], index, entries[file]);
+        });
+    }
+
+    std::ostringstream batch;
+    size_t added = 0;
+    std::vector<std::string> removed;
+
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (results[i] == AddStatus::Missing && isTracked(index, files[i]))
+        {
+            std::cout << "'" << files[i] << "' was deleted; its removal has been staged.\n";
+            batch << files[i] << ":\n";
+            removed.push_back(files[i]);
+            ++added;
+        }
+        else if (results[i] == AddStatus::Missing)
+        {
+            std::cout << "The file '" << files[i] << "' does not exist.\n";
+        }
+        else if (results[i] == AddStatus::Empty)
+        {
+            std::cout << "The file '" << files[i] << "' is empty.\n";
+        }
+        else if (results[i] == AddStatus::Failed)
+        {
+            std::cout << "Error: Could not add '" << files[i] << "'.\n";
+        }
+        else
+        {
+            batch << files[i] << ":" << entries[i].hash << "\n";
+            ++added;
+        }
+    }
 
-    // Saves blob as .minigit/object/hash
-    std::string blobPath = ".minigit/objects/" + hashedContent;
-    std::ofstream blobFile(blobPath);
-    blobFile << content;
-    blobFile.close();
+    if (added == 0)
+    {
+        return false;
+    }
 
     // Add to .minigit/staging.txt
+    phase.restart("add: stage");
     std::ofstream staging(".minigit/staging.txt", std::ios::app); // append new content at the end
-    staging << fileName << ":" << hashedContent << "\n";
+    staging << batch.str();
     staging.close();
 
-    std::cout << fileName << " has been seccussfully added!";
+    // Remember the stat data so unchanged files are skipped next time
+    std::vector<IndexEntry> updates;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (results[i] == AddStatus::Added)
+        {
+            updates.push_back(std::move(entries[i]));
+        }
+    }
+    setIndexEntries(index, std::move(updates));
+    removeIndexEntries(index, std::move(removed));
+    saveIndex(index);
+
+    if (files.size() == 1 && results[0] == AddStatus::Added)
+    {
+        std::cout << files[0] << " has been seccussfully added!\n";
+    }
+    else
+    {
+        std::cout << added << " files have been successfully added!\n";
+    }
+    return added == files.size();
+}
+
+bool addFile(const std::string &fileName)
+{
+    return addFiles({fileName});
 }
@@ -0,0 +1,424 @@
+// Journal
+//
+// A commit used to be three separate writes: its record appended to
+// commits.txt, the branch moved, staging.txt cleared, none of them synced.
+// A crash in between could leave a commit no branch points to, or a branch
+// pointing at a record that never reached the disk. Now a commit is first
+// written to .minigit/journal as one transaction:
+//
+//   BEGIN <commit id> <boot id>
+//   OBJECT <id>                  every object the commit's tree needs
+//   REF <branch> <old> <new>
+//   RECORD <size>
+//   <the record for commits.txt>
+//   END <checksum>
+//
+// appended with a single write. Once the journal is synced, commits.txt and
+// the branch are updated without syncs of their own and "APPLIED <id>" is
+// appended. If the machine goes down before those updates reach the disk,
+// recovery replays the transaction from the journal.
+//
+// Group commit: the journal offset known to be on disk is kept in
+// journal.lock. A committer takes an flock on that file and only syncs the
+// journal if its own transaction lies past that offset. Committers that
+// appended while someone else was syncing find their transaction covered
+// when they get the lock, so a burst of commits shares one fdatasync.
+//
+// Objects are not synced one by one either. Before appending, a committer
+// waits for the kernel to write back its objects' data (sync_file_range);
+// the journal's fdatasync then flushes the disk cache for all of it, as git
+// does in its batch fsync mode. Recovery checks that the objects of a
+// transaction exist before replaying it.
+//
+// A committer holds a shared flock on the journal from its append until
+// APPLIED is written. Recovery and checkpoints take it exclusively, so they
+// never see a transaction in flight. Once the journal grows past
+// JOURNAL_CHECKPOINT_SIZE, a checkpoint syncs the filesystem and empties it.
+
+const std::string JOURNAL_PATH = ".minigit/journal";
+const std::string JOURNAL_LOCK_PATH = ".minigit/journal.lock";
+const off_t JOURNAL_CHECKPOINT_SIZE = 64 * 1024; // every command start reads it through
+
+struct JournalTransaction
+{
+    std::string commitID;
+    std::string branch;
+    std::string oldHash;              // branch value the commit was made on
+    std::string record;               // the commit's record for commits.txt
+    std::vector<std::string> objects; // blobs and trees the commit needs
+    std::string bootID;               // set when read back from the journal
+};
+
+// Changes with every boot, so recovery can tell whether a transaction's
+// updates may have been lost with the page cache
+std::string currentBootID()
+{
+    static std::string bootID = [] {
+        std::ifstream in("/proc/sys/kernel/random/boot_id");
+        std::string id;
+        std::getline(in, id);
+        return id.empty() ? std::string("-") : id;
+    }();
+    return bootID;
+}
+
+// FNV-1a; it only has to catch a transaction torn by a crash
+uint64_t journalChecksum(const char* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string formatTransaction(const JournalTransaction& txn)
+{
+    std::string text = "BEGIN " + txn.commitID + " " + currentBootID() + "\n";
+    for (const auto& id : txn.objects)
+    {
+        text += "OBJECT " + id + "\n";
+    }
+    text += "REF " + txn.branch + " " + (txn.oldHash.empty() ? "-" : txn.oldHash) + " " + txn.commitID + "\n";
+    text += "RECORD " + std::to_string(txn.record.size()) + "\n" + txn.record;
+
+    char checksum[17];
+    snprintf(checksum, sizeof(checksum), "%016llx", (unsigned long long)journalChecksum(text.data(), text.size()));
+    return text + "END " + checksum + "\n";
+}
+
+// Reads back every complete transaction. Torn or aborted ones are left out;
+// applied lists the commits whose updates were made.
+void parseJournal(const std::string& text, std::vector<JournalTransaction>& transactions, std::set<std::string>& applied)
+{
+    size_t pos = 0;
+    std::set<std::string> aborted;
+    while (pos < text.size())
+    {
+        size_t lineEnd = text.find('\n', pos);
+        if (lineEnd == std::string::npos)
+        {
+            break;
+        }
+        std::string line = text.substr(pos, lineEnd - pos);
+        size_t start = pos;
+        pos = lineEnd + 1;
+
+        if (line.rfind("APPLIED ", 0) == 0)
+        {
+            applied.insert(line.substr(8));
+            continue;
+        }
+        if (line.rfind("ABORTED ", 0) == 0)
+        {
+            aborted.insert(line.substr(8));
+            continue;
+        }
+        if (line.rfind("BEGIN ", 0) != 0)
+        {
+            continue;
+        }
+
+        JournalTransaction txn;
+        std::istringstream begin(line.substr(6));
+        begin >> txn.commitID >> txn.bootID;
+
+        bool complete = false;
+        std::string newHash;
+        while (!complete && (lineEnd = text.find('\n', pos)) != std::string::npos)
+        {
+            line = text.substr(pos, lineEnd - pos);
+            if (line.rfind("OBJECT ", 0) == 0)
+            {
+                txn.objects.push_back(line.substr(7));
+            }
+            else if (line.rfind("REF ", 0) == 0)
+            {
+                std::istringstream ref(line.substr(4));
+                ref >> txn.branch >> txn.oldHash >> newHash;
+                if (txn.oldHash == "-")
+                {
+                    txn.oldHash.clear();
+                }
+            }
+            else if (line.rfind("RECORD ", 0) == 0)
+            {
+                size_t size = std::strtoull(line.c_str() + 7, nullptr, 10);
+                if (size > text.size() - lineEnd - 1)
+                {
+                    break;
+                }
+                txn.record = text.substr(lineEnd + 1, size);
+                lineEnd += size;
+            }
+            else if (line.rfind("END ", 0) == 0)
+            {
+                uint64_t expected = std::strtoull(line.c_str() + 4, nullptr, 16);
+                complete = newHash == txn.commitID && journalChecksum(text.data() + start, pos - start) == expected;
+            }
+            else
+            {
+                break; // torn; whatever follows is read from this line on
+            }
+            pos = lineEnd + 1;
+        }
+        if (complete)
+        {
+            transactions.push_back(std::move(txn));
+        }
+    }
+
+    transactions.erase(std::remove_if(transactions.begin(), transactions.end(),
+                                      [&](const JournalTransaction& txn) { return aborted.count(txn.commitID) > 0; }),
+                       transactions.end());
+}
+
+// Appends a record to commits.txt with one write, after finishing a line a
+// crash may have torn
+bool appendCommitRecord(const std::string& record)
+{
+    int fd = open(".minigit/commits.txt", O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    traceCount(TraceFilesOpened);
+
+    std::string text = record;
+    struct stat st;
+    char last = '\n';
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && pread(fd, &last, 1, st.st_size - 1) == 1 && last != '\n')
+    {
+        text.insert(0, "\n");
+    }
+    bool ok = writeAll(fd, text.data(), text.size());
+    return close(fd) == 0 && ok;
+}
+
+// Starts writeback of an object's data and waits for it. The journal's
+// fdatasync makes it durable.
+void flushObject(const std::string& id)
+{
+    int fd = open(objectPath(id).c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return; // packed, and packs are synced when written
+    }
+    traceCount(TraceFilesOpened);
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    close(fd);
+}
+
+void flushObjects(const std::vector<std::string>& objects)
+{
+    TraceSpan span("journal: flush objects");
+    for (const auto& id : objects)
+    {
+        flushObject(id);
+        for (const auto& chunk : blobChunks(id)) // a chunked blob needs its chunks too
+        {
+            flushObject(chunk.id);
+        }
+    }
+}
+
+// Makes the journal durable up to at least end, unless another committer
+// already did. Returns false if the sync failed.
+bool syncJournal(int journalFd, uint64_t end)
+{
+    TraceSpan span("journal: group sync");
+    int lockFd = open(JOURNAL_LOCK_PATH.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lockFd < 0 || flock(lockFd, LOCK_EX) != 0)
+    {
+        if (lockFd >= 0) close(lockFd);
+        return false;
+    }
+
+    uint64_t synced = 0;
+    bool ok = true;
+    if (pread(lockFd, &synced, sizeof(synced), 0) != sizeof(synced) || synced < end)
+    {
+        // Everything appended so far goes along, whoever appended it
+        struct stat st;
+        ok = fstat(journalFd, &st) == 0;
+        traceCount(TraceFsyncs);
+        ok = ok && fdatasync(journalFd) == 0;
+        uint64_t size = ok ? st.st_size : 0;
+        ok = ok && pwrite(lockFd, &size, sizeof(size), 0) == sizeof(size);
+    }
+
+    flock(lockFd, LOCK_UN);
+    close(lockFd);
+    return ok;
+}
+
+// Syncs everything the journal protects and empties it. The caller holds the
+// journal exclusively.
+bool checkpointJournal(int journalFd)
+{
+    TraceSpan span("journal: checkpoint");
+    traceCount(TraceFsyncs);
+    if (syncfs(journalFd) != 0 || ftruncate(journalFd, 0) != 0)
+    {
+        return false;
+    }
+
+    int lockFd = open(JOURNAL_LOCK_PATH.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lockFd >= 0)
+    {
+        uint64_t synced = 0;
+        if (pwrite(lockFd, &synced, sizeof(synced), 0) != sizeof(synced))
+        {
+            std::remove(JOURNAL_LOCK_PATH.c_str());
+        }
+        close(lockFd);
+    }
+    return true;
+}
+
+// Redoes the updates of a durable transaction. Each step checks whether it
+// already happened, so replaying twice is harmless.
+void replayTransaction(const JournalTransaction& txn)
+{
+    for (const auto& id : txn.objects)
+    {
+        if (!objectExists(id))
+        {
+            std::cout << "Warning: Dropped commit " << txn.commitID << " from the journal; object " << id << " is missing.\n";
+            return;
+        }
+    }
+
+    Commit existing;
+    if (!lookupCommit(txn.commitID, existing))
+    {
+        if (!appendCommitRecord(txn.record) || !updateCommitGraph())
+        {
+            std::cout << "Warning: Could not restore commit " << txn.commitID << " from the journal.\n";
+            return;
+        }
+    }
+
+    // Only if nothing moved the branch since
+    std::string current;
+    bool exists = readRef(txn.branch, current);
+    if (exists ? current == txn.oldHash : txn.oldHash.empty())
+    {
+        updateRef(txn.branch, txn.commitID);
+    }
+}
+
+// Replays what a crash may have lost, once per process. Transactions without
+// APPLIED were cut short; those from an earlier boot were applied, but
+// maybe only in a page cache that is gone.
+void recoverJournal()
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        int fd = open(JOURNAL_PATH.c_str(), O_RDWR);
+        struct stat st;
+        if (fd < 0)
+        {
+            return;
+        }
+        if (fstat(fd, &st) != 0 || st.st_size == 0 || flock(fd, LOCK_EX) != 0)
+        {
+            close(fd);
+            return;
+        }
+
+        TraceSpan span("journal: recover");
+        std::string text;
+        fstat(fd, &st);
+        text.resize(st.st_size);
+        text.resize(std::max<ssize_t>(pread(fd, text.data(), text.size(), 0), 0));
+
+        std::vector<JournalTransaction> transactions;
+        std::set<std::string> applied;
+        parseJournal(text, transactions, applied);
+
+        bool replayed = false;
+        for (const auto& txn : transactions)
+        {
+            if (applied.count(txn.commitID) == 0 || txn.bootID != currentBootID())
+            {
+                replayTransaction(txn);
+                replayed = true;
+            }
+        }
+        // A transaction torn mid-line would swallow the BEGIN of the next one
+        if (replayed || (!text.empty() && text.back() != '\n'))
+        {
+            checkpointJournal(fd);
+        }
+
+        flock(fd, LOCK_UN);
+        close(fd);
+    });
+}
+
+// Commits txn: logs it, makes it durable together with any concurrent
+// commits, then updates commits.txt and the branch. Returns false, with
+// nothing changed, if the branch is locked, no longer holds txn.oldHash, or
+// the journal cannot be written.
+bool journalCommit(const JournalTransaction& txn)
+{
+    TraceSpan span("journal: commit");
+    recoverJournal();
+
+    // Holding the branch's lock from here on means the update cannot fail
+    LockFile ref;
+    if (!validRefName(txn.branch) || !ref.acquire(REFS_DIR + txn.branch))
+    {
+        return false;
+    }
+    std::string current;
+    if (readRef(txn.branch, current) && current != txn.oldHash)
+    {
+        return false;
+    }
+
+    flushObjects(txn.objects);
+
+    int fd = open(JOURNAL_PATH.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_SH) != 0)
+    {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    traceCount(TraceFilesOpened);
+
+    std::string text = formatTransaction(txn);
+    bool ok = writeAll(fd, text.data(), text.size());
+    off_t end = lseek(fd, 0, SEEK_CUR);
+    ok = ok && end > 0 && syncJournal(fd, end);
+    if (!ok)
+    {
+        // Never replay what the caller was told failed
+        std::string abort = "ABORTED " + txn.commitID + "\n";
+        writeAll(fd, abort.data(), abort.size());
+        flock(fd, LOCK_UN);
+        close(fd);
+        return false;
+    }
+
+    // Durable from here on; a crash below is repaired by recoverJournal
+    TraceSpan apply("journal: apply");
+    appendCommitRecord(txn.record);
+    updateCommitGraph();
+    ref.commit(txn.commitID + "\n", false);
+    std::string done = "APPLIED " + txn.commitID + "\n";
+    writeAll(fd, done.data(), done.size());
+    apply.end();
+
+    flock(fd, LOCK_UN);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > JOURNAL_CHECKPOINT_SIZE && flock(fd, LOCK_EX | LOCK_NB) == 0)
+    {
+        checkpointJournal(fd);
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+    return true;
+}
@@ -0,0 +1,271 @@
+// Materialization
+//
+// Writes blobs out to the working directory. A plain loose object already
+// holds the file's exact bytes, so it is copied by the kernel instead of
+// through user-space buffers, trying in order:
+//
+//   1. FICLONE       reflink; shares the data blocks on btrfs, XFS and others
+//   2. copy_file_range
+//   3. sendfile
+//
+// A chunked blob is assembled the same way, one chunk at a time. Compressed
+// and packed objects have to be decoded, so they (and anything the kernel
+// refuses to copy) go through a buffered write.
+//
+// The "materialize" setting in config.txt picks the mode:
+//
+//   auto      the above (default)
+//   hardlink  link the working file to the object itself. No data is written
+//             at all, but the file and the object share one inode, so both
+//             are made read-only. Meant for trees that are never edited in
+//             place, such as build artifacts.
+//   buffered  always copy through user space
+//   lazy      write a placeholder naming the blob instead of the file, for
+//             trees of which only a few files are ever read. `minigit
+//             hydrate` replaces placeholders with their files. The index
+//             marks the paths that were checked out this way; commands that
+//             hash working files take such a placeholder for its blob, so it
+//             never shows up as a change. Elsewhere a file that looks like a
+//             placeholder is just a file.
+
+enum class MaterializeMode
+{
+    Auto,
+    Hardlink,
+    Buffered,
+    Lazy
+};
+
+MaterializeMode materializeMode()
+{
+    std::string mode = getConfig("materialize", "auto");
+    if (mode == "hardlink")
+    {
+        return MaterializeMode::Hardlink;
+    }
+    if (mode == "buffered")
+    {
+        return MaterializeMode::Buffered;
+    }
+    if (mode == "lazy")
+    {
+        return MaterializeMode::Lazy;
+    }
+    return MaterializeMode::Auto;
+}
+
+bool writeAll(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        traceCount(TraceBytesWritten, written);
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// A placeholder is PLACEHOLDER_MAGIC, the blob ID and a newline
+const char PLACEHOLDER_MAGIC[8] = {'\x89', 'M', 'G', 'P', '\r', '\n', '\x1a', '\n'};
+const size_t PLACEHOLDER_MAX_SIZE = sizeof(PLACEHOLDER_MAGIC) + 129;
+
+// The blob ID in the content of a placeholder; false if it is not one
+bool parsePlaceholder(std::string_view data, std::string& id)
+{
+    if (data.size() < sizeof(PLACEHOLDER_MAGIC) + 2 || data.size() > PLACEHOLDER_MAX_SIZE
+        || memcmp(data.data(), PLACEHOLDER_MAGIC, sizeof(PLACEHOLDER_MAGIC)) != 0 || data.back() != '\n')
+    {
+        return false;
+    }
+    std::string_view name = data.substr(sizeof(PLACEHOLDER_MAGIC), data.size() - sizeof(PLACEHOLDER_MAGIC) - 1);
+    if (!std::all_of(name.begin(), name.end(), [](char c) { return std::isalnum((unsigned char)c); }))
+    {
+        return false;
+    }
+    id = name;
+    return true;
+}
+
+// The blob ID if the open file with stat data st is a placeholder. Larger
+// files are not read at all.
+bool readPlaceholder(int fd, const struct stat& st, std::string& id)
+{
+    if (!S_ISREG(st.st_mode) || st.st_size > (off_t)PLACEHOLDER_MAX_SIZE)
+    {
+        return false;
+    }
+    char data[PLACEHOLDER_MAX_SIZE];
+    ssize_t got = pread(fd, data, st.st_size, 0);
+    return got == st.st_size && parsePlaceholder(std::string_view(data, got), id);
+}
+
+// Copies size bytes from in to the current position of out inside the
+// kernel. A reflink is only tried when out is empty and takes all of in. On
+// false, failed tells whether some bytes were already written; if not, the
+// caller can still fall back to a buffered copy.
+bool kernelCopy(int in, int out, uint64_t size, bool clone, bool& failed)
+{
+    failed = false;
+    if (size == 0)
+    {
+        return true;
+    }
+
+    if (clone && ioctl(out, FICLONE, in) == 0)
+    {
+        traceCount(TraceBytesWritten, size);
+        return true;
+    }
+
+    uint64_t copied = 0;
+    while (copied < size)
+    {
+        ssize_t n = copy_file_range(in, nullptr, out, nullptr, size - copied, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        traceCount(TraceBytesRead, n);
+        traceCount(TraceBytesWritten, n);
+        copied += n;
+    }
+    if (copied == size)
+    {
+        return true;
+    }
+
+    off_t offset = copied;
+    while ((uint64_t)offset < size)
+    {
+        ssize_t n = sendfile(out, in, &offset, size - offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        traceCount(TraceBytesRead, n);
+        traceCount(TraceBytesWritten, n);
+    }
+    if ((uint64_t)offset == size)
+    {
+        return true;
+    }
+
+    // Partly written files cannot be resumed by the buffered path
+    failed = offset > 0;
+    return false;
+}
+
+// Writes the blob to path, replacing whatever is there
+bool materializeBlob(const std::string& id, const std::string& path, MaterializeMode mode = materializeMode())
+{
+    TraceSpan span("materialize");
+
+    // The old file is unlinked rather than truncated: it may be a hard link
+    // to an object
+    if (unlink(path.c_str()) != 0 && errno != ENOENT)
+    {
+        return false;
+    }
+
+    if (mode == MaterializeMode::Lazy)
+    {
+        std::string placeholder = std::string(PLACEHOLDER_MAGIC, sizeof(PLACEHOLDER_MAGIC)) + id + "\n";
+        int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0)
+        {
+            return false;
+        }
+        traceCount(TraceFilesOpened);
+        bool ok = writeAll(out, placeholder.data(), placeholder.size());
+        return close(out) == 0 && ok;
+    }
+
+    int in = open(objectPath(id).c_str(), O_RDONLY);
+    bool plain = false;
+    struct stat objectStat;
+    if (in >= 0 && fstat(in, &objectStat) == 0)
+    {
+        char header[sizeof(OBJECT_MAGIC)];
+        ssize_t got = pread(in, header, sizeof(header), 0);
+        plain = got < (ssize_t)sizeof(header)
+            || (memcmp(header, OBJECT_MAGIC, sizeof(header)) != 0 && memcmp(header, CHUNK_MAGIC, sizeof(header)) != 0);
+    }
+
+    if (plain && mode == MaterializeMode::Hardlink)
+    {
+        fchmod(in, 0444);
+        if (link(objectPath(id).c_str(), path.c_str()) == 0)
+        {
+            close(in);
+            return true;
+        }
+        // Different filesystem or no link support: copy instead
+    }
+
+    int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        if (in >= 0) close(in);
+        return false;
+    }
+    traceCount(TraceFilesOpened, in >= 0 ? 2 : 1);
+
+    bool ok = false;
+    bool failed = false;
+    if (plain && mode != MaterializeMode::Buffered)
+    {
+        ok = kernelCopy(in, out, objectStat.st_size, true, failed);
+    }
+    if (in >= 0)
+    {
+        close(in);
+    }
+
+    // Chunks of a chunked blob are copied one by one, in the kernel if they
+    // are stored plain
+    std::function<bool(const ChunkRef&)> copyChunk = [&](const ChunkRef& chunk) {
+        int chunkIn = mode == MaterializeMode::Buffered ? -1 : open(objectPath(chunk.id).c_str(), O_RDONLY);
+        if (chunkIn >= 0)
+        {
+            char header[sizeof(OBJECT_MAGIC)];
+            ssize_t got = pread(chunkIn, header, sizeof(header), 0);
+            bool chunkPlain = got < (ssize_t)sizeof(header) || memcmp(header, OBJECT_MAGIC, sizeof(header)) != 0;
+            bool chunkFailed = false;
+            bool copied = chunkPlain && kernelCopy(chunkIn, out, chunk.size, false, chunkFailed);
+            close(chunkIn);
+            if (copied || chunkFailed)
+            {
+                return copied;
+            }
+        }
+        return streamStoredObject(chunk.id, [&](const char* data, size_t size) {
+            return writeAll(out, data, size);
+        });
+    };
+
+    if (!ok && !failed)
+    {
+        ok = streamObject(id, [&](const char* data, size_t size) {
+            return writeAll(out, data, size);
+        }, &copyChunk);
+    }
+
+    return close(out) == 0 && ok;
+}
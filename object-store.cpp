@@ -0,0 +1,1561 @@
+// Object store
+//
+// Every object is addressed by the hash of its content and can live in one
+// of two places:
+//
+//   loose   .minigit/objects/<first two characters of id>/<rest of id>.
+//           Either the plain content (the original format, still used when
+//           compression does not pay off) or, if the file starts with
+//           OBJECT_MAGIC, a compressed object:
+//             magic | uint64 size | blocks
+//           where each block is uint32 raw size | uint32 stored size | bytes,
+//           and a block whose stored size equals its raw size is not
+//           compressed.
+//
+//   packed  .minigit/objects/pack/pack-<hash>.pack with a .idx next to it,
+//           written by the pack command. Each entry is either a full object
+//           or a delta against another entry of the same pack, both stored as
+//           compressed blocks. The .idx is a table of (id, offset) sorted by
+//           id.
+//
+// Large files are stored chunked (see chunking.cpp): the object under the
+// file's ID is then a manifest, CHUNK_MAGIC followed by one "<size> <id>"
+// line per chunk, and every chunk is an object of its own.
+//
+// The two-character fan-out keeps every directory small; one flat directory
+// of millions of files makes lookups and readdir slow. Repositories from
+// before the fan-out keep their loose objects in objects/ itself and are
+// moved over on first use.
+//
+// readObject / streamObject hide all of this and return the file content;
+// callers never open object files themselves. readStoredObject and
+// streamStoredObject return an object exactly as stored, manifests included.
+
+const std::string OBJECTS_DIR = ".minigit/objects/";
+const std::string PACK_DIR = ".minigit/objects/pack/";
+const char OBJECT_MAGIC[8] = {'\x89', 'M', 'G', 'Z', '\r', '\n', '\x1a', '\n'};
+const char CHUNK_MAGIC[8] = {'\x89', 'M', 'G', 'C', '\r', '\n', '\x1a', '\n'};
+const size_t OBJECT_BLOCK_SIZE = 128 * 1024;
+
+std::string fanOutPath(const std::string& id)
+{
+    return id.size() > 2 ? OBJECTS_DIR + id.substr(0, 2) + "/" + id.substr(2) : OBJECTS_DIR + id;
+}
+
+bool isObjectName(const std::string& name)
+{
+    return !name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return std::isxdigit((unsigned char)c); });
+}
+
+// Moves the loose objects of an older repository into the fan-out
+// directories, once per process. config.txt records that the repository
+// uses the fan-out.
+void ensureObjectStore()
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        if (!fs::exists(".minigit") || getConfig("objects") == "fan-out")
+        {
+            return;
+        }
+
+        std::error_code ec;
+        for (auto it = fs::directory_iterator(OBJECTS_DIR, ec); !ec && it != fs::directory_iterator(); it.increment(ec))
+        {
+            std::string name = it->path().filename().string();
+            if (name.size() <= 2 || !isObjectName(name) || !it->is_regular_file())
+            {
+                continue;
+            }
+            std::string target = fanOutPath(name);
+            fs::create_directory(fs::path(target).parent_path(), ec);
+            std::rename(it->path().c_str(), target.c_str());
+        }
+        if (!ec)
+        {
+            setConfig("objects", "fan-out");
+        }
+    });
+}
+
+std::string objectPath(const std::string& id)
+{
+    ensureObjectStore();
+    return fanOutPath(id);
+}
+
+// The fan-out directories that exist
+std::vector<std::string> fanOutDirectories()
+{
+    std::vector<std::string> dirs;
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(OBJECTS_DIR, ec); !ec && it != fs::directory_iterator(); it.increment(ec))
+    {
+        std::string name = it->path().filename().string();
+        if (name.size() == 2 && isObjectName(name) && it->is_directory())
+        {
+            dirs.push_back(it->path().string());
+        }
+    }
+    std::sort(dirs.begin(), dirs.end());
+    return dirs;
+}
+
+// The loose objects in one fan-out directory, as ID and path
+std::vector<std::pair<std::string, std::string>> looseObjectsIn(const std::string& dir)
+{
+    std::vector<std::pair<std::string, std::string>> objects;
+    std::string prefix = fs::path(dir).filename().string();
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(dir, ec); !ec && it != fs::directory_iterator(); it.increment(ec))
+    {
+        std::string name = it->path().filename().string();
+        if (isObjectName(name))
+        {
+            objects.push_back({prefix + name, it->path().string()});
+        }
+    }
+    return objects;
+}
+
+// Block compression
+//
+// A small LZ77 codec in the style of LZ4: a sequence is a token byte (literal
+// count in the high nibble, match length - 4 in the low nibble, 15 meaning
+// "more bytes follow"), the literals, and a 16-bit match offset. The last
+// sequence has literals only. Matches are found through hash chains.
+
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_WINDOW = 65535;
+const int LZ_HASH_BITS = 15;
+const int LZ_CHAIN_DEPTH = 16;
+
+inline uint32_t lzHash(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+void lzPutLength(std::string& out, size_t extra)
+{
+    while (extra >= 255)
+    {
+        out.push_back((char)255);
+        extra -= 255;
+    }
+    out.push_back((char)extra);
+}
+
+void lzCompress(const char* data, size_t size, std::string& out)
+{
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(data);
+    thread_local std::vector<int32_t> head;
+    thread_local std::vector<int32_t> chain;
+    head.assign(1 << LZ_HASH_BITS, -1);
+    chain.resize(size);
+
+    auto insert = [&](size_t pos) {
+        uint32_t h = lzHash(in + pos);
+        chain[pos] = head[h];
+        head[h] = pos;
+    };
+
+    auto emit = [&](size_t literalStart, size_t literalCount, size_t offset, size_t matchLength) {
+        size_t matchCode = matchLength >= LZ_MIN_MATCH ? matchLength - LZ_MIN_MATCH : 0;
+        out.push_back((char)((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(matchCode, 15)));
+        if (literalCount >= 15)
+        {
+            lzPutLength(out, literalCount - 15);
+        }
+        out.append(data + literalStart, literalCount);
+        if (matchLength == 0)
+        {
+            return;
+        }
+        out.push_back((char)(offset & 0xFF));
+        out.push_back((char)(offset >> 8));
+        if (matchCode >= 15)
+        {
+            lzPutLength(out, matchCode - 15);
+        }
+    };
+
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + LZ_MIN_MATCH <= size)
+    {
+        size_t bestLength = 0;
+        size_t bestPos = 0;
+        int32_t candidate = head[lzHash(in + i)];
+
+        for (int depth = 0; candidate >= 0 && depth < LZ_CHAIN_DEPTH && i - candidate <= LZ_WINDOW; ++depth)
+        {
+            size_t length = 0;
+            while (i + length < size && in[candidate + length] == in[i + length])
+            {
+                ++length;
+            }
+            if (length > bestLength)
+            {
+                bestLength = length;
+                bestPos = candidate;
+            }
+            candidate = chain[candidate];
+        }
+
+        if (bestLength < LZ_MIN_MATCH)
+        {
+            insert(i);
+            ++i;
+            continue;
+        }
+
+        emit(anchor, i - anchor, i - bestPos, bestLength);
+        for (size_t k = i; k < i + bestLength && k + LZ_MIN_MATCH <= size; ++k)
+        {
+            insert(k);
+        }
+        i += bestLength;
+        anchor = i;
+    }
+
+    emit(anchor, size - anchor, 0, 0);
+}
+
+bool lzDecompress(const char* src, size_t srcSize, char* dst, size_t dstSize)
+{
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    const uint8_t* inEnd = in + srcSize;
+    size_t pos = 0;
+
+    auto readLength = [&](size_t& length) {
+        if (length != 15)
+        {
+            return true;
+        }
+        while (in < inEnd)
+        {
+            uint8_t extra = *in++;
+            length += extra;
+            if (extra != 255)
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    while (in < inEnd)
+    {
+        uint8_t token = *in++;
+        size_t literalCount = token >> 4;
+        if (!readLength(literalCount) || literalCount > (size_t)(inEnd - in) || literalCount > dstSize - pos)
+        {
+            return false;
+        }
+        memcpy(dst + pos, in, literalCount);
+        in += literalCount;
+        pos += literalCount;
+
+        if (in == inEnd)
+        {
+            break;
+        }
+
+        if (inEnd - in < 2)
+        {
+            return false;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t matchLength = token & 0x0F;
+        if (!readLength(matchLength))
+        {
+            return false;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > pos || matchLength > dstSize - pos)
+        {
+            return false;
+        }
+
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t k = 0; k < matchLength; ++k, ++pos)
+        {
+            dst[pos] = dst[pos - offset];
+        }
+    }
+
+    return pos == dstSize;
+}
+
+void putUint32(std::string& out, uint32_t value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Appends one block: compressed if that makes it smaller, raw otherwise
+void compressBlock(const char* data, size_t size, std::string& out)
+{
+    thread_local std::string packed;
+    packed.clear();
+    lzCompress(data, size, packed);
+
+    putUint32(out, size);
+    if (packed.size() < size)
+    {
+        putUint32(out, packed.size());
+        out += packed;
+    }
+    else
+    {
+        putUint32(out, size);
+        out.append(data, size);
+    }
+}
+
+std::string compressBlocks(const std::string& content)
+{
+    std::string out;
+    for (size_t pos = 0; pos < content.size(); pos += OBJECT_BLOCK_SIZE)
+    {
+        compressBlock(content.data() + pos, std::min(OBJECT_BLOCK_SIZE, content.size() - pos), out);
+    }
+    return out;
+}
+
+// Decodes a run of blocks from memory, handing each to the sink
+bool decompressBlocks(const char* data, size_t size, const std::function<bool(const char*, size_t)>& sink)
+{
+    std::vector<char> buffer;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        uint32_t rawSize, storedSize;
+        if (size - pos < 8)
+        {
+            return false;
+        }
+        memcpy(&rawSize, data + pos, 4);
+        memcpy(&storedSize, data + pos + 4, 4);
+        pos += 8;
+        if (storedSize > size - pos)
+        {
+            return false;
+        }
+
+        if (storedSize == rawSize)
+        {
+            if (!sink(data + pos, rawSize))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            buffer.resize(rawSize);
+            if (!lzDecompress(data + pos, storedSize, buffer.data(), rawSize) || !sink(buffer.data(), rawSize))
+            {
+                return false;
+            }
+        }
+        pos += storedSize;
+    }
+    return true;
+}
+
+// Deltas
+//
+// A delta rebuilds a target from a base: varint base size, varint target
+// size, then instructions, each either
+//   0 <varint n> <n bytes>            insert literal bytes
+//   1 <varint offset> <varint n>      copy n bytes of the base
+
+const size_t DELTA_BLOCK = 16;
+
+void putVarint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+bool getVarint(const char*& p, const char* end, uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t byte = *p++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline uint64_t deltaBlockHash(const char* p)
+{
+    uint64_t a, b;
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+    return (a * 0x9E3779B97F4A7C15ULL) ^ (b * 0xC2B2AE3D27D4EB4FULL);
+}
+
+std::string makeDelta(const std::string& base, const std::string& target)
+{
+    // Index every aligned block of the base
+    std::unordered_map<uint64_t, uint32_t> blocks;
+    blocks.reserve(base.size() / DELTA_BLOCK + 1);
+    for (size_t pos = 0; pos + DELTA_BLOCK <= base.size(); pos += DELTA_BLOCK)
+    {
+        blocks.emplace(deltaBlockHash(base.data() + pos), pos);
+    }
+
+    std::string delta;
+    putVarint(delta, base.size());
+    putVarint(delta, target.size());
+
+    auto flushInsert = [&](size_t from, size_t to) {
+        if (to > from)
+        {
+            delta.push_back(0);
+            putVarint(delta, to - from);
+            delta.append(target, from, to - from);
+        }
+    };
+
+    size_t insertStart = 0;
+    size_t i = 0;
+    while (i + DELTA_BLOCK <= target.size())
+    {
+        auto it = blocks.find(deltaBlockHash(target.data() + i));
+        if (it == blocks.end() || memcmp(base.data() + it->second, target.data() + i, DELTA_BLOCK) != 0)
+        {
+            ++i;
+            continue;
+        }
+
+        // Grow the match in both directions
+        size_t basePos = it->second;
+        size_t length = DELTA_BLOCK;
+        while (basePos + length < base.size() && i + length < target.size() && base[basePos + length] == target[i + length])
+        {
+            ++length;
+        }
+        while (basePos > 0 && i > insertStart && base[basePos - 1] == target[i - 1])
+        {
+            --basePos;
+            --i;
+            ++length;
+        }
+
+        flushInsert(insertStart, i);
+        delta.push_back(1);
+        putVarint(delta, basePos);
+        putVarint(delta, length);
+        i += length;
+        insertStart = i;
+    }
+
+    flushInsert(insertStart, target.size());
+    return delta;
+}
+
+bool applyDelta(const std::string& base, const std::string& delta, std::string& out)
+{
+    const char* p = delta.data();
+    const char* end = p + delta.size();
+    uint64_t baseSize, targetSize;
+    if (!getVarint(p, end, baseSize) || !getVarint(p, end, targetSize) || baseSize != base.size())
+    {
+        return false;
+    }
+
+    out.clear();
+    out.reserve(targetSize);
+    while (p < end)
+    {
+        char op = *p++;
+        uint64_t offset = 0, length = 0;
+        if (op == 0)
+        {
+            if (!getVarint(p, end, length) || length > (uint64_t)(end - p))
+            {
+                return false;
+            }
+            out.append(p, length);
+            p += length;
+        }
+        else if (op == 1)
+        {
+            if (!getVarint(p, end, offset) || !getVarint(p, end, length) || offset > base.size() || length > base.size() - offset)
+            {
+                return false;
+            }
+            out.append(base, offset, length);
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return out.size() == targetSize;
+}
+
+// Packs
+
+const uint32_t PACK_VERSION = 1;
+const uint8_t PACK_FULL = 1;
+const uint8_t PACK_DELTA = 2;
+const int PACK_MAX_DELTA_DEPTH = 16;
+
+struct PackHeader
+{
+    char magic[4];      // "MGPK"
+    uint32_t version;
+    uint64_t count;
+};
+
+struct PackEntryHeader
+{
+    uint8_t type;       // PACK_FULL or PACK_DELTA
+    uint8_t reserved[7];
+    uint64_t base;      // pack offset of the delta base
+    uint64_t rawSize;   // size of the object, or of the delta
+    uint64_t storedSize;
+};
+
+struct PackIndexHeader
+{
+    char magic[4];      // "MGPI"
+    uint32_t version;
+    uint64_t count;
+};
+
+struct PackIndexEntry
+{
+    char id[COMMIT_ID_SIZE];
+    uint64_t offset;
+};
+
+struct PackFile
+{
+    std::string name;
+    void* packMap = nullptr;
+    size_t packSize = 0;
+    void* indexMap = nullptr;
+    size_t indexSize = 0;
+    const PackIndexEntry* entries = nullptr;
+    size_t count = 0;
+
+    PackFile() = default;
+    PackFile(const PackFile&) = delete;
+    PackFile& operator=(const PackFile&) = delete;
+
+    ~PackFile()
+    {
+        if (packMap) munmap(packMap, packSize);
+        if (indexMap) munmap(indexMap, indexSize);
+    }
+};
+
+// Packs are mapped once and reused until the pack directory changes
+std::mutex packLock;
+std::vector<std::shared_ptr<PackFile>> loadedPacks;
+struct timespec loadedPackTime = {-1, 0};
+
+std::vector<std::shared_ptr<PackFile>> currentPacks()
+{
+    struct stat st;
+    struct timespec dirTime = {0, 0};
+    if (stat(PACK_DIR.c_str(), &st) == 0)
+    {
+        dirTime = st.st_mtim;
+    }
+
+    std::lock_guard<std::mutex> guard(packLock);
+    if (dirTime.tv_sec == loadedPackTime.tv_sec && dirTime.tv_nsec == loadedPackTime.tv_nsec)
+    {
+        return loadedPacks;
+    }
+
+    loadedPacks.clear();
+    loadedPackTime = dirTime;
+    if (!fs::is_directory(PACK_DIR))
+    {
+        return loadedPacks;
+    }
+
+    for (const auto& entry : fs::directory_iterator(PACK_DIR))
+    {
+        std::string path = entry.path().string();
+        if (entry.path().extension() != ".idx")
+        {
+            continue;
+        }
+
+        auto pack = std::make_shared<PackFile>();
+        pack->name = entry.path().stem().string();
+        pack->indexMap = mapFile(path, pack->indexSize);
+        pack->packMap = mapFile(PACK_DIR + pack->name + ".pack", pack->packSize);
+        if (!pack->indexMap || !pack->packMap || pack->indexSize < sizeof(PackIndexHeader))
+        {
+            continue;
+        }
+
+        auto header = static_cast<const PackIndexHeader*>(pack->indexMap);
+        if (memcmp(header->magic, "MGPI", 4) != 0 || header->version != PACK_VERSION)
+        {
+            continue;
+        }
+        pack->entries = reinterpret_cast<const PackIndexEntry*>(header + 1);
+        pack->count = std::min<uint64_t>(header->count, (pack->indexSize - sizeof(PackIndexHeader)) / sizeof(PackIndexEntry));
+        loadedPacks.push_back(pack);
+    }
+
+    return loadedPacks;
+}
+
+const char* packIndexKey(const PackIndexEntry& entry)
+{
+    return entry.id;
+}
+
+const char* packIndexKey(const std::string& id)
+{
+    return id.c_str();
+}
+
+const PackIndexEntry* findPackEntry(const PackFile& pack, const std::string& id)
+{
+    const PackIndexEntry* end = pack.entries + pack.count;
+    const PackIndexEntry* it = std::lower_bound(pack.entries, end, id, [](const PackIndexEntry& entry, const std::string& key) {
+        return strncmp(entry.id, key.c_str(), COMMIT_ID_SIZE) < 0;
+    });
+    if (it != end && strncmp(it->id, id.c_str(), COMMIT_ID_SIZE) == 0)
+    {
+        return it;
+    }
+    return nullptr;
+}
+
+bool readPackEntry(const PackFile& pack, uint64_t offset, std::string& out, int depth = 0)
+{
+    if (depth > PACK_MAX_DELTA_DEPTH || offset + sizeof(PackEntryHeader) > pack.packSize)
+    {
+        return false;
+    }
+
+    PackEntryHeader header;
+    const char* base = static_cast<const char*>(pack.packMap);
+    memcpy(&header, base + offset, sizeof(header));
+    const char* payload = base + offset + sizeof(header);
+    if (header.storedSize > pack.packSize - offset - sizeof(header))
+    {
+        return false;
+    }
+
+    std::string raw;
+    raw.reserve(header.rawSize);
+    bool ok = decompressBlocks(payload, header.storedSize, [&](const char* data, size_t size) {
+        raw.append(data, size);
+        return true;
+    });
+    if (!ok || raw.size() != header.rawSize)
+    {
+        return false;
+    }
+
+    if (header.type == PACK_FULL)
+    {
+        out = std::move(raw);
+        return true;
+    }
+
+    std::string baseContent;
+    return header.type == PACK_DELTA
+        && readPackEntry(pack, header.base, baseContent, depth + 1)
+        && applyDelta(baseContent, raw, out);
+}
+
+bool readPackedObject(const std::string& id, std::string& content)
+{
+    for (const auto& pack : currentPacks())
+    {
+        const PackIndexEntry* entry = findPackEntry(*pack, id);
+        if (entry)
+        {
+            bool found = readPackEntry(*pack, entry->offset, content);
+            traceCount(TraceBytesRead, content.size());
+            return found;
+        }
+    }
+    return false;
+}
+
+// Reading
+
+bool objectExists(const std::string& id)
+{
+    if (id.empty())
+    {
+        return false;
+    }
+    if (access(objectPath(id).c_str(), F_OK) == 0)
+    {
+        return true;
+    }
+    for (const auto& pack : currentPacks())
+    {
+        if (findPackEntry(*pack, id))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Gives a loose object that is stored again a fresh mtime, so gc's grace
+// period covers it as if it had just been written; an object that is only
+// packed is never swept
+void freshenObject(const std::string& id)
+{
+    utimensat(AT_FDCWD, objectPath(id).c_str(), nullptr, 0);
+}
+
+// Hands the stored object to the sink piece by piece. Loose objects are
+// streamed with bounded memory; packed ones are rebuilt in memory first.
+bool streamStoredObject(const std::string& id, const std::function<bool(const char*, size_t)>& sink)
+{
+    if (id.empty())
+    {
+        return false;
+    }
+
+    int fd = open(objectPath(id).c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::string content;
+        return readPackedObject(id, content) && (content.empty() || sink(content.data(), content.size()));
+    }
+    traceCount(TraceFilesOpened);
+
+    std::vector<char> buffer(OBJECT_BLOCK_SIZE + 16);
+    auto readFully = [&](char* out, size_t size) {
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t got = read(fd, out + done, size - done);
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                break;
+            }
+            done += got;
+        }
+        traceCount(TraceBytesRead, done);
+        return done;
+    };
+
+    bool ok = true;
+    char header[16];
+    size_t got = readFully(header, sizeof(header));
+
+    if (got < sizeof(header) || memcmp(header, OBJECT_MAGIC, sizeof(OBJECT_MAGIC)) != 0)
+    {
+        // Plain object
+        ok = got == 0 || sink(header, got);
+        bool more = got == sizeof(header);
+        while (ok && more)
+        {
+            got = readFully(buffer.data(), OBJECT_BLOCK_SIZE);
+            more = got == OBJECT_BLOCK_SIZE;
+            ok = got == 0 || sink(buffer.data(), got);
+        }
+        close(fd);
+        return ok;
+    }
+
+    // Compressed object, one block at a time
+    uint64_t total;
+    memcpy(&total, header + 8, 8);
+    uint64_t produced = 0;
+    std::vector<char> raw(OBJECT_BLOCK_SIZE);
+
+    while (ok && produced < total)
+    {
+        uint32_t sizes[2];
+        if (readFully(reinterpret_cast<char*>(sizes), sizeof(sizes)) != sizeof(sizes) || sizes[0] > OBJECT_BLOCK_SIZE || sizes[1] > sizes[0])
+        {
+            ok = false;
+            break;
+        }
+        if (readFully(buffer.data(), sizes[1]) != sizes[1])
+        {
+            ok = false;
+            break;
+        }
+
+        if (sizes[1] == sizes[0])
+        {
+            ok = sink(buffer.data(), sizes[0]);
+        }
+        else
+        {
+            ok = lzDecompress(buffer.data(), sizes[1], raw.data(), sizes[0]) && sink(raw.data(), sizes[0]);
+        }
+        produced += sizes[0];
+    }
+
+    close(fd);
+    return ok && produced == total;
+}
+
+bool readStoredObject(const std::string& id, std::string& content)
+{
+    content.clear();
+    return streamStoredObject(id, [&](const char* data, size_t size) {
+        content.append(data, size);
+        return true;
+    });
+}
+
+struct ChunkRef
+{
+    uint64_t size;
+    std::string id;
+};
+
+bool parseManifest(const std::string& manifest, std::vector<ChunkRef>& chunks)
+{
+    chunks.clear();
+    if (manifest.size() < sizeof(CHUNK_MAGIC) || memcmp(manifest.data(), CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) != 0)
+    {
+        return false;
+    }
+
+    std::istringstream lines(manifest.substr(sizeof(CHUNK_MAGIC)));
+    ChunkRef chunk;
+    while (lines >> chunk.size >> chunk.id)
+    {
+        chunks.push_back(chunk);
+    }
+    return lines.eof();
+}
+
+// Hands the file content of a blob to the sink, reassembling chunked blobs.
+// If onChunk is given, the chunks of a chunked blob are handed to it instead,
+// so the caller can copy them by other means.
+bool streamObject(const std::string& id, const std::function<bool(const char*, size_t)>& sink,
+                  const std::function<bool(const ChunkRef&)>* onChunk = nullptr)
+{
+    // Hold back the first bytes until it is clear whether this is a manifest
+    std::string head;
+    bool decided = false, manifest = false;
+    bool ok = streamStoredObject(id, [&](const char* data, size_t size) {
+        if (decided && !manifest)
+        {
+            return sink(data, size);
+        }
+        head.append(data, size);
+        if (decided || head.size() < sizeof(CHUNK_MAGIC))
+        {
+            return true;
+        }
+
+        decided = true;
+        manifest = memcmp(head.data(), CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) == 0;
+        if (manifest)
+        {
+            return true;
+        }
+        bool result = sink(head.data(), head.size());
+        head.clear();
+        return result;
+    });
+
+    if (!ok)
+    {
+        return false;
+    }
+    if (!manifest)
+    {
+        return head.empty() || sink(head.data(), head.size());
+    }
+
+    std::vector<ChunkRef> chunks;
+    if (!parseManifest(head, chunks))
+    {
+        return false;
+    }
+    for (const auto& chunk : chunks)
+    {
+        if (onChunk)
+        {
+            if (!(*onChunk)(chunk))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        uint64_t produced = 0;
+        bool chunkOk = streamStoredObject(chunk.id, [&](const char* data, size_t size) {
+            produced += size;
+            return sink(data, size);
+        });
+        if (!chunkOk || produced != chunk.size)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Tells from the first bytes of a loose object whether it can be a chunk
+// manifest. A compressed manifest starts with a literal run that covers
+// CHUNK_MAGIC: no four bytes of the magic repeat, so the compressor cannot
+// have found a match inside it.
+bool mayBeManifest(const char* head, size_t size)
+{
+    const size_t magic = sizeof(CHUNK_MAGIC);
+    if (size >= magic && memcmp(head, CHUNK_MAGIC, magic) == 0)
+    {
+        return true;
+    }
+    if (size < magic || memcmp(head, OBJECT_MAGIC, magic) != 0)
+    {
+        return false;
+    }
+
+    // magic | uint64 size | uint32 raw size | uint32 stored size | block
+    size_t pos = magic + sizeof(uint64_t);
+    uint32_t rawSize, storedSize;
+    if (size < pos + 8)
+    {
+        return true; // too short to tell
+    }
+    memcpy(&rawSize, head + pos, 4);
+    memcpy(&storedSize, head + pos + 4, 4);
+    pos += 8;
+    if (storedSize < rawSize)
+    {
+        size_t literalCount = (uint8_t)head[pos] >> 4;
+        for (++pos; literalCount >= 15 && pos < size; ++pos)
+        {
+            literalCount += (uint8_t)head[pos];
+            if ((uint8_t)head[pos] != 255)
+            {
+                ++pos;
+                break;
+            }
+        }
+        if (literalCount < magic)
+        {
+            return false;
+        }
+    }
+    return size < pos + magic || memcmp(head + pos, CHUNK_MAGIC, magic) == 0;
+}
+
+// The chunks of a chunked blob; a plain blob has none. Loose objects are
+// told apart by their first bytes without reading the rest.
+std::vector<ChunkRef> blobChunks(const std::string& id)
+{
+    std::vector<ChunkRef> chunks;
+    int fd = open(objectPath(id).c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        traceCount(TraceFilesOpened);
+        char head[64];
+        ssize_t got = pread(fd, head, sizeof(head), 0);
+        close(fd);
+        if (got < 0 || !mayBeManifest(head, got))
+        {
+            return chunks;
+        }
+    }
+
+    // The sink refuses the first bytes of a plain blob, which stops the read
+    // right there
+    std::function<bool(const ChunkRef&)> onChunk = [&](const ChunkRef& chunk) {
+        chunks.push_back(chunk);
+        return true;
+    };
+    streamObject(id, [](const char*, size_t) { return false; }, &onChunk);
+    return chunks;
+}
+
+bool readObject(const std::string& id, std::string& content)
+{
+    content.clear();
+    return streamObject(id, [&](const char* data, size_t size) {
+        content.append(data, size);
+        return true;
+    });
+}
+
+// Writing
+//
+// ObjectWriter takes content in pieces of any size and writes a loose object
+// through a temporary file. The first block decides the format: if it does
+// not compress by at least 10% the object is stored plain, which keeps
+// incompressible data cheap to write and read. Callers can also ask for a
+// plain object up front. commit() renames the file to its final name once
+// the caller knows the ID.
+
+struct ObjectWriter
+{
+    int fd = -1;
+    char tmpPath[64];
+    bool compressed = false;
+    bool decided = false;
+    bool allowCompression = true;
+    bool loose = false; // store it loose even if a pack has it
+    uint64_t total = 0;
+    std::string pending; // data not yet written as a full block
+    std::string out;
+
+    bool open()
+    {
+        fs::create_directories(OBJECTS_DIR);
+        strcpy(tmpPath, ".minigit/objects/tmp_XXXXXX");
+        fd = mkstemp(tmpPath);
+        if (fd < 0)
+        {
+            return false;
+        }
+        fchmod(fd, 0644); // mkstemp creates it private
+        traceCount(TraceFilesOpened);
+        return true;
+    }
+
+    bool writeAll(const char* data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t done = ::write(fd, data, size);
+            if (done < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (done <= 0)
+            {
+                return false;
+            }
+            traceCount(TraceBytesWritten, done);
+            data += done;
+            size -= done;
+        }
+        return true;
+    }
+
+    bool decide(const char* data, size_t size)
+    {
+        decided = true;
+
+        // Plain content must never look like a compressed object
+        bool looksCompressed = size >= sizeof(OBJECT_MAGIC) && memcmp(data, OBJECT_MAGIC, sizeof(OBJECT_MAGIC)) == 0;
+        bool tryCompression = allowCompression && getConfig("compression", "lz") != "none";
+        if (!looksCompressed && !tryCompression)
+        {
+            compressed = false;
+            return writeAll(data, size);
+        }
+
+        out.clear();
+        compressBlock(data, size, out);
+        compressed = looksCompressed || out.size() - 8 < size * 9 / 10;
+        if (!compressed)
+        {
+            return writeAll(data, size);
+        }
+
+        // The total size is filled in by commit()
+        char header[16] = {};
+        memcpy(header, OBJECT_MAGIC, sizeof(OBJECT_MAGIC));
+        return writeAll(header, sizeof(header)) && writeAll(out.data(), out.size());
+    }
+
+    bool writeBlock(const char* data, size_t size)
+    {
+        if (!decided)
+        {
+            return decide(data, size);
+        }
+        if (!compressed)
+        {
+            return writeAll(data, size);
+        }
+        out.clear();
+        compressBlock(data, size, out);
+        return writeAll(out.data(), out.size());
+    }
+
+    bool write(const char* data, size_t size)
+    {
+        total += size;
+        if (pending.empty() && size == OBJECT_BLOCK_SIZE)
+        {
+            return writeBlock(data, size);
+        }
+
+        pending.append(data, size);
+        size_t pos = 0;
+        bool ok = true;
+        while (ok && pending.size() - pos >= OBJECT_BLOCK_SIZE)
+        {
+            ok = writeBlock(pending.data() + pos, OBJECT_BLOCK_SIZE);
+            pos += OBJECT_BLOCK_SIZE;
+        }
+        pending.erase(0, pos);
+        return ok;
+    }
+
+    // Finishes the object and moves it to objects/<id>
+    bool commit(const std::string& id)
+    {
+        bool ok = pending.empty() || writeBlock(pending.data(), pending.size());
+        pending.clear();
+        if (ok && compressed)
+        {
+            ok = pwrite(fd, &total, sizeof(total), sizeof(OBJECT_MAGIC)) == sizeof(total);
+        }
+        close(fd);
+        fd = -1;
+
+        if (!ok || (loose ? access(objectPath(id).c_str(), F_OK) == 0 : objectExists(id)))
+        {
+            unlink(tmpPath);
+            if (ok)
+            {
+                freshenObject(id);
+            }
+            return ok;
+        }
+
+        // The fan-out directory is created with its first object
+        std::string path = objectPath(id);
+        if (std::rename(tmpPath, path.c_str()) == 0)
+        {
+            return true;
+        }
+        std::error_code ec;
+        fs::create_directory(fs::path(path).parent_path(), ec);
+        if (std::rename(tmpPath, path.c_str()) == 0)
+        {
+            return true;
+        }
+        unlink(tmpPath);
+        return false;
+    }
+
+    void abort()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+            unlink(tmpPath);
+        }
+    }
+};
+
+// Stores content that is already in memory; compress = false stores it plain
+bool writeObject(const std::string& id, const std::string& content, bool compress = true)
+{
+    if (objectExists(id))
+    {
+        freshenObject(id);
+        return true;
+    }
+
+    ObjectWriter writer;
+    writer.allowCompression = compress;
+    if (!writer.open())
+    {
+        return false;
+    }
+    if (!writer.write(content.data(), content.size()))
+    {
+        writer.abort();
+        return false;
+    }
+    return writer.commit(id);
+}
+
+// pack command
+
+const size_t PACK_MAX_OBJECT_SIZE = 64 * 1024 * 1024;
+const size_t PACK_DELTA_WINDOW = 4;
+
+// Creates an empty file with a unique name in the pack directory for a pack
+// being written, and returns its descriptor, or -1
+int createPackTemp(const std::string& kind, std::string& path)
+{
+    std::string name = PACK_DIR + "tmp_" + kind + "_XXXXXX";
+    int fd = mkstemp(name.data());
+    if (fd >= 0)
+    {
+        fchmod(fd, 0644); // mkstemp creates it private
+        path = name;
+    }
+    return fd;
+}
+
+// Flushes a file, or with a directory its entries, to disk
+bool syncPath(int fd)
+{
+    traceCount(TraceFsyncs);
+    return fsync(fd) == 0;
+}
+
+bool syncDirectory(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    bool ok = fd >= 0 && syncPath(fd);
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+// Rolls every reachable object, loose or in existing packs, into one
+// packfile. Versions of the same path are delta-encoded against each other,
+// newest first, so the most recent version is always stored in full.
+//
+// What gc would not keep stays out of the pack, where gc could never remove
+// it: unreachable loose objects are left alone, and those in old packs are
+// written out as loose objects first, to go with the next gc.
+//
+// Nothing is deleted until the new pack and index are on disk under their
+// final names. If any object of an old pack cannot be copied, the old packs
+// and loose objects are all left as they are.
+bool walkTree(const std::string& id, const std::string& prefix, std::set<std::string>& seen,
+              const std::function<void(const std::string& path, const std::string& id)>& visit);
+bool reachableObjects(std::unordered_set<std::string>& ids);
+
+bool packObjects()
+{
+    TraceSpan span("pack");
+    std::unordered_set<std::string> reachable;
+    if (!reachableObjects(reachable))
+    {
+        std::cout << "Nothing was packed.\n";
+        return false;
+    }
+
+    // Gather every object and remember which path it was stored under
+    std::map<std::string, std::string> objectPaths; // id -> path
+    std::map<std::string, size_t> objectOrder;      // id -> last time it was seen
+    size_t order = 0;
+
+    auto notePath = [&](const std::string& file, const std::string& hash) {
+        if (!hash.empty() && objectPaths.count(hash) == 0)
+        {
+            objectPaths[hash] = file;
+        }
+        objectOrder[hash] = order++;
+    };
+
+    // Trees get their directory as path, so each is deltified against its
+    // previous version; unchanged subtrees are only walked once
+    std::set<std::string> seenTrees;
+    CommitArena history;
+    loadAllCommits(history);
+    for (const auto& c : history.commits)
+    {
+        if (!c.tree.empty())
+        {
+            walkTree(std::string(c.tree), "", seenTrees, notePath);
+        }
+        for (uint32_t f = c.filesBegin; f < c.filesEnd; ++f)
+        {
+            notePath(std::string(history.paths.strings[history.files[f].path]),
+                     std::string(history.blobs.strings[history.files[f].blob]));
+        }
+    }
+
+    std::string line;
+    std::ifstream staging(".minigit/staging.txt");
+    while (std::getline(staging, line))
+    {
+        size_t colon = line.find(":");
+        if (colon != std::string::npos)
+        {
+            notePath(line.substr(0, colon), line.substr(colon + 1));
+        }
+    }
+    staging.close();
+
+    std::set<std::string> ids, unreachable;
+    std::vector<std::pair<std::string, std::string>> looseFiles; // id, path
+    for (const auto& dir : fanOutDirectories())
+    {
+        for (const auto& [id, file] : looseObjectsIn(dir))
+        {
+            std::error_code ec;
+            if (!reachable.count(id))
+            {
+                unreachable.insert(id);
+            }
+            else if (id.size() <= COMMIT_ID_SIZE && fs::file_size(file, ec) <= PACK_MAX_OBJECT_SIZE && !ec)
+            {
+                ids.insert(id);
+                looseFiles.push_back({id, file});
+            }
+        }
+    }
+
+    auto oldPacks = currentPacks();
+    std::vector<std::string> unpack; // unreachable, and only in an old pack
+    for (const auto& pack : oldPacks)
+    {
+        for (size_t i = 0; i < pack->count; ++i)
+        {
+            std::string id(pack->entries[i].id, strnlen(pack->entries[i].id, COMMIT_ID_SIZE));
+            if (reachable.count(id))
+            {
+                ids.insert(id);
+            }
+            else if (unreachable.insert(id).second)
+            {
+                unpack.push_back(id);
+            }
+        }
+    }
+
+    if (ids.empty() && unpack.empty())
+    {
+        std::cout << "Nothing to pack.\n";
+        return true;
+    }
+
+    for (const auto& id : unpack)
+    {
+        std::string content;
+        ObjectWriter writer;
+        writer.loose = true;
+        if (!readStoredObject(id, content) || !writer.open())
+        {
+            std::cout << "Error: Could not read object " << id << "; nothing was repacked.\n";
+            return false;
+        }
+        if (!writer.write(content.data(), content.size()) || !writer.commit(id))
+        {
+            writer.abort();
+            std::cout << "Error: Could not write object " << id << "; nothing was repacked.\n";
+            return false;
+        }
+    }
+
+    // Same path together, newest version first; objects without a path last
+    std::vector<std::string> sorted(ids.begin(), ids.end());
+    std::stable_sort(sorted.begin(), sorted.end(), [&](const std::string& a, const std::string& b) {
+        auto pa = objectPaths.find(a), pb = objectPaths.find(b);
+        bool hasA = pa != objectPaths.end(), hasB = pb != objectPaths.end();
+        if (hasA != hasB) return hasA;
+        if (!hasA) return false;
+        if (pa->second != pb->second) return pa->second < pb->second;
+        return objectOrder[a] > objectOrder[b];
+    });
+
+    struct Candidate
+    {
+        std::string path;
+        std::string content;
+        uint64_t offset;
+        int depth;
+    };
+
+    // The temporary names are unique, so packs running at once do not write
+    // over each other
+    std::string tmpPack, tmpIndex;
+    fs::create_directories(PACK_DIR);
+    int packFd = createPackTemp("pack", tmpPack);
+    if (packFd < 0)
+    {
+        std::cout << "Error: Could not create the packfile.\n";
+        return false;
+    }
+    std::ofstream pack(tmpPack, std::ios::binary | std::ios::trunc);
+    PackHeader packHeader = {{'M', 'G', 'P', 'K'}, PACK_VERSION, 0};
+    pack.write(reinterpret_cast<const char*>(&packHeader), sizeof(packHeader));
+
+    std::vector<PackIndexEntry> index;
+    std::deque<Candidate> window;
+    uint64_t offset = sizeof(packHeader);
+    size_t deltas = 0;
+    uint64_t rawTotal = 0;
+    std::vector<std::string> unread;
+
+    for (const auto& id : sorted)
+    {
+        std::string content;
+        if (!readStoredObject(id, content) || content.size() > PACK_MAX_OBJECT_SIZE)
+        {
+            unread.push_back(id);
+            continue;
+        }
+        rawTotal += content.size();
+
+        auto pathIt = objectPaths.find(id);
+        std::string path = pathIt == objectPaths.end() ? "" : pathIt->second;
+        if (path.empty() || (!window.empty() && window.front().path != path))
+        {
+            window.clear();
+        }
+
+        // Try the last few versions of this path and keep the smallest delta
+        std::string bestDelta;
+        const Candidate* bestBase = nullptr;
+        for (const auto& candidate : window)
+        {
+            if (candidate.depth >= PACK_MAX_DELTA_DEPTH)
+            {
+                continue;
+            }
+            std::string delta = makeDelta(candidate.content, content);
+            if (delta.size() < content.size() / 2 && (!bestBase || delta.size() < bestDelta.size()))
+            {
+                bestDelta = std::move(delta);
+                bestBase = &candidate;
+            }
+        }
+
+        PackEntryHeader entry = {};
+        std::string payload;
+        int depth = 0;
+        if (bestBase)
+        {
+            entry.type = PACK_DELTA;
+            entry.base = bestBase->offset;
+            entry.rawSize = bestDelta.size();
+            payload = compressBlocks(bestDelta);
+            depth = bestBase->depth + 1;
+            ++deltas;
+        }
+        else
+        {
+            entry.type = PACK_FULL;
+            entry.rawSize = content.size();
+            payload = compressBlocks(content);
+        }
+        entry.storedSize = payload.size();
+
+        pack.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        pack.write(payload.data(), payload.size());
+
+        PackIndexEntry indexEntry = {};
+        memcpy(indexEntry.id, id.data(), std::min(id.size(), COMMIT_ID_SIZE));
+        indexEntry.offset = offset;
+        index.push_back(indexEntry);
+        offset += sizeof(entry) + payload.size();
+
+        if (!path.empty())
+        {
+            window.push_back({path, std::move(content), indexEntry.offset, depth});
+            if (window.size() > PACK_DELTA_WINDOW)
+            {
+                window.pop_front();
+            }
+        }
+    }
+
+    packHeader.count = index.size();
+    pack.seekp(0);
+    pack.write(reinterpret_cast<const char*>(&packHeader), sizeof(packHeader));
+    pack.close();
+    bool packWritten = pack && syncPath(packFd);
+    close(packFd);
+    if (!packWritten)
+    {
+        std::cout << "Error: Could not write the packfile.\n";
+        std::remove(tmpPack.c_str());
+        return false;
+    }
+
+    // An object that could not be read is only safe to leave out if it
+    // stays behind as a loose object
+    std::set<std::string> loose;
+    for (const auto& [id, file] : looseFiles)
+    {
+        loose.insert(id);
+    }
+    for (const auto& id : unread)
+    {
+        if (!loose.count(id))
+        {
+            std::cout << "Error: Could not read object " << id << "; nothing was repacked.\n";
+            std::remove(tmpPack.c_str());
+            return false;
+        }
+    }
+
+    std::sort(index.begin(), index.end(), [](const PackIndexEntry& a, const PackIndexEntry& b) {
+        return strncmp(a.id, b.id, COMMIT_ID_SIZE) < 0;
+    });
+
+    // The pack is named after the objects it holds
+    HashState nameHash(HashAlgorithm::Sha256);
+    for (const auto& entry : index)
+    {
+        hashUpdate(nameHash, entry.id, COMMIT_ID_SIZE);
+    }
+    std::string name = "pack-" + hashDigest(nameHash);
+
+    int indexFd = createPackTemp("idx", tmpIndex);
+    std::ofstream indexFile(tmpIndex, std::ios::binary | std::ios::trunc);
+    PackIndexHeader indexHeader = {{'M', 'G', 'P', 'I'}, PACK_VERSION, index.size()};
+    indexFile.write(reinterpret_cast<const char*>(&indexHeader), sizeof(indexHeader));
+    indexFile.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(PackIndexEntry));
+    indexFile.close();
+    bool indexWritten = indexFd >= 0 && indexFile && syncPath(indexFd);
+    if (indexFd >= 0) close(indexFd);
+
+    // The .pack goes first so an .idx never points at a missing pack, and
+    // both names are on disk before anything is deleted
+    if (!indexWritten || std::rename(tmpPack.c_str(), (PACK_DIR + name + ".pack").c_str()) != 0
+        || std::rename(tmpIndex.c_str(), (PACK_DIR + name + ".idx").c_str()) != 0 || !syncDirectory(PACK_DIR))
+    {
+        std::cout << "Error: Could not write the pack index; nothing was removed.\n";
+        std::remove(tmpPack.c_str());
+        std::remove(tmpIndex.c_str());
+        return false;
+    }
+
+    for (const auto& pack : oldPacks)
+    {
+        if (pack->name != name)
+        {
+            std::remove((PACK_DIR + pack->name + ".idx").c_str());
+            std::remove((PACK_DIR + pack->name + ".pack").c_str());
+        }
+    }
+    for (const auto& [id, file] : looseFiles)
+    {
+        bool packed = std::binary_search(index.begin(), index.end(), id, [](const auto& a, const auto& b) {
+            return strncmp(packIndexKey(a), packIndexKey(b), COMMIT_ID_SIZE) < 0;
+        });
+        if (packed)
+        {
+            std::remove(file.c_str());
+        }
+    }
+
+    std::cout << "Packed " << index.size() << " objects (" << deltas << " deltas) into " << name << ".pack\n";
+    std::cout << "Size: " << rawTotal << " bytes -> " << fs::file_size(PACK_DIR + name + ".pack") << " bytes\n";
+    if (!unreachable.empty())
+    {
+        std::cout << unreachable.size() << " unreachable objects were left loose for gc.\n";
+    }
+    return true;
+}
@@ -0,0 +1,364 @@
+// Ref store
+//
+// Branches used to live together in branches.txt, which every update read
+// and rewrote in full. Now each branch is looked up in two places:
+//
+//   .minigit/refs/heads/<name>   one file per branch holding its commit ID
+//                                (empty for a branch without commits yet)
+//   .minigit/packed-refs         "name:hash" lines sorted by name, searched
+//                                with a binary search over the mapped file
+//
+// A loose file wins over a packed entry. Updates only ever touch the loose
+// file: the new value goes to <name>.lock, created exclusively so concurrent
+// writers cannot interleave, is synced, and then renamed over the old file.
+// A crash leaves either the old or the new value, never a torn file. The
+// pack-refs command folds loose refs back into packed-refs.
+//
+// Repositories that still have a branches.txt are converted on first use.
+
+const std::string REFS_DIR = ".minigit/refs/heads/";
+const std::string PACKED_REFS_PATH = ".minigit/packed-refs";
+const std::string LEGACY_BRANCHES_PATH = ".minigit/branches.txt";
+
+bool validRefName(const std::string& name)
+{
+    if (name.empty() || name.front() == '/' || name.back() == '/' || name.find("..") != std::string::npos
+        || name.find("//") != std::string::npos || name.find(':') != std::string::npos)
+    {
+        return false;
+    }
+    if (name.size() >= 5 && name.compare(name.size() - 5, 5, ".lock") == 0)
+    {
+        return false;
+    }
+    for (unsigned char c : name)
+    {
+        if (c <= ' ' || c == 0x7f)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Holds path.lock, created exclusively, until commit() renames it over path
+// or the lock is released
+struct LockFile
+{
+    std::string path;
+    std::string lockPath;
+    int fd = -1;
+
+    bool acquire(const std::string& target)
+    {
+        std::error_code ec;
+        fs::create_directories(fs::path(target).parent_path(), ec);
+
+        path = target;
+        lockPath = target + ".lock";
+        fd = open(lockPath.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0)
+        {
+            traceCount(TraceFilesOpened);
+        }
+        return fd >= 0;
+    }
+
+    // Replaces path with content. Without sync the caller has made the
+    // change durable some other way, e.g. through the journal.
+    bool commit(const std::string& content, bool sync = true)
+    {
+        bool ok = writeAll(fd, content.data(), content.size());
+        if (ok && sync)
+        {
+            traceCount(TraceFsyncs);
+            ok = fsync(fd) == 0;
+        }
+        ok = close(fd) == 0 && ok;
+        fd = -1;
+        if (!ok || std::rename(lockPath.c_str(), path.c_str()) != 0)
+        {
+            unlink(lockPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void release()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+            unlink(lockPath.c_str());
+        }
+    }
+
+    ~LockFile()
+    {
+        release();
+    }
+};
+
+// Writes content to path through path.lock and an atomic rename. Fails if
+// the lock is already held. check runs while the lock is held and can veto
+// the update.
+bool writeLocked(const std::string& path, const std::string& content, const std::function<bool()>& check = nullptr)
+{
+    LockFile lock;
+    if (!lock.acquire(path))
+    {
+        return false;
+    }
+    return (!check || check()) && lock.commit(content);
+}
+
+// Converts branches.txt, or sets up an empty store, once per process
+void ensureRefStore()
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        if (!fs::exists(".minigit") || fs::exists(REFS_DIR))
+        {
+            return;
+        }
+
+        std::map<std::string, std::string> branches;
+        std::ifstream in(LEGACY_BRANCHES_PATH);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            size_t colon = line.find(":");
+            if (colon != std::string::npos)
+            {
+                branches[line.substr(0, colon)] = line.substr(colon + 1);
+            }
+        }
+        in.close();
+
+        std::string packed;
+        for (const auto& [name, hash] : branches)
+        {
+            packed += name + ":" + hash + "\n";
+        }
+        if ((branches.empty() || writeLocked(PACKED_REFS_PATH, packed)) && fs::create_directories(REFS_DIR))
+        {
+            std::remove(LEGACY_BRANCHES_PATH.c_str());
+        }
+    });
+}
+
+// packed-refs stays mapped until the file is replaced
+struct PackedRefs
+{
+    void* map = nullptr;
+    size_t size = 0;
+
+    ~PackedRefs()
+    {
+        if (map) munmap(map, size);
+    }
+};
+
+std::shared_ptr<PackedRefs> currentPackedRefs()
+{
+    static std::mutex cacheLock;
+    static std::shared_ptr<PackedRefs> cached;
+    static struct stat cachedStat;
+
+    struct stat st = {};
+    stat(PACKED_REFS_PATH.c_str(), &st);
+
+    std::lock_guard<std::mutex> guard(cacheLock);
+    if (!cached || !sameFileState(st, cachedStat))
+    {
+        cached = std::make_shared<PackedRefs>();
+        cached->map = mapFile(PACKED_REFS_PATH, cached->size);
+        cachedStat = st;
+    }
+    return cached;
+}
+
+// Binary search over the sorted lines of packed-refs
+bool findPackedRef(const std::string& name, std::string& hash)
+{
+    std::shared_ptr<PackedRefs> packed = currentPackedRefs();
+    if (!packed->map)
+    {
+        return false;
+    }
+
+    size_t size = packed->size;
+    const char* data = static_cast<const char*>(packed->map);
+    size_t lo = 0, hi = size;
+    bool found = false;
+    while (lo < hi)
+    {
+        // Widen the midpoint to the line around it
+        size_t start = lo + (hi - lo) / 2;
+        while (start > lo && data[start - 1] != '\n')
+        {
+            --start;
+        }
+        const char* lineEnd = static_cast<const char*>(memchr(data + start, '\n', size - start));
+        size_t end = lineEnd ? lineEnd - data : size;
+
+        const char* colon = static_cast<const char*>(memchr(data + start, ':', end - start));
+        std::string_view lineName(data + start, (colon ? colon - data : end) - start);
+        int order = lineName.compare(name);
+        if (order == 0 && colon)
+        {
+            hash.assign(colon + 1, data + end);
+            found = true;
+            break;
+        }
+        if (order < 0)
+        {
+            lo = end + 1;
+        }
+        else
+        {
+            hi = start;
+        }
+    }
+
+    return found;
+}
+
+// Looks a branch up. Returns false if it does not exist; a branch without
+// commits exists with an empty hash.
+bool readRef(const std::string& name, std::string& hash)
+{
+    ensureRefStore();
+    hash.clear();
+    if (!validRefName(name))
+    {
+        return false;
+    }
+
+    std::string path = REFS_DIR + name;
+    std::error_code ec;
+    if (fs::is_regular_file(path, ec))
+    {
+        std::ifstream loose(path);
+        std::getline(loose, hash);
+        return true;
+    }
+    return findPackedRef(name, hash);
+}
+
+// Points a branch at a commit. If expected is given, the update only happens
+// if the branch still holds that value, so a concurrent update is never lost.
+bool updateRef(const std::string& name, const std::string& hash, const std::string* expected = nullptr)
+{
+    ensureRefStore();
+    if (!validRefName(name))
+    {
+        return false;
+    }
+
+    return writeLocked(REFS_DIR + name, hash + "\n", [&] {
+        std::string current;
+        return !expected || (readRef(name, current) && current == *expected);
+    });
+}
+
+// Creates a branch; fails if it already exists
+bool createRef(const std::string& name, const std::string& hash)
+{
+    ensureRefStore();
+    if (!validRefName(name))
+    {
+        return false;
+    }
+
+    return writeLocked(REFS_DIR + name, hash + "\n", [&] {
+        std::string current;
+        return !readRef(name, current);
+    });
+}
+
+// Every branch with its commit, sorted by name
+std::map<std::string, std::string> listRefs()
+{
+    ensureRefStore();
+    std::map<std::string, std::string> refs;
+
+    std::ifstream packed(PACKED_REFS_PATH);
+    std::string line;
+    while (std::getline(packed, line))
+    {
+        size_t colon = line.find(":");
+        if (colon != std::string::npos)
+        {
+            refs[line.substr(0, colon)] = line.substr(colon + 1);
+        }
+    }
+    packed.close();
+
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(REFS_DIR, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+    {
+        std::string name = it->path().lexically_relative(REFS_DIR).generic_string();
+        if (!it->is_regular_file() || !validRefName(name))
+        {
+            continue; // directories and .lock files
+        }
+        std::ifstream loose(it->path());
+        std::string hash;
+        std::getline(loose, hash);
+        refs[name] = hash;
+    }
+
+    return refs;
+}
+
+// pack-refs command: moves every loose ref into packed-refs
+bool packRefs()
+{
+    std::map<std::string, std::string> refs = listRefs();
+
+    std::string packed;
+    for (const auto& [name, hash] : refs)
+    {
+        packed += name + ":" + hash + "\n";
+    }
+    if (!writeLocked(PACKED_REFS_PATH, packed))
+    {
+        std::cout << "Error: Could not write packed-refs. Is another minigit running?\n";
+        return false;
+    }
+
+    // Only drop loose files that still hold the packed value
+    size_t moved = 0;
+    for (const auto& [name, hash] : refs)
+    {
+        // Holding the ref's lock keeps concurrent updates out meanwhile
+        std::string path = REFS_DIR + name;
+        std::string lockPath = path + ".lock";
+        int lock = open(lockPath.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (lock < 0)
+        {
+            continue;
+        }
+        std::ifstream loose(path);
+        std::string current;
+        if (loose && std::getline(loose, current) && current == hash && std::remove(path.c_str()) == 0)
+        {
+            ++moved;
+        }
+        loose.close();
+        close(lock);
+        unlink(lockPath.c_str());
+
+        std::error_code ec;
+        fs::path dir = fs::path(path).parent_path();
+        while (dir != fs::path(REFS_DIR).parent_path() && fs::is_empty(dir, ec) && fs::remove(dir, ec))
+        {
+            dir = dir.parent_path();
+        }
+    }
+
+    std::cout << "Packed " << refs.size() << " refs (" << moved << " loose files removed).\n";
+    return true;
+}
@@ -0,0 +1,675 @@
+// Rename and copy detection
+//
+// Comparing two trees shows a moved file as one path removed and another
+// added. findRenames pairs them up again by content, so diff can show what
+// changed in a renamed file and merge can follow it.
+//
+// Every blob gets a MinHash signature: its non-blank lines, trailing
+// whitespace dropped, are hashed, and for each of SIGNATURE_SIZE mixing
+// functions the signature keeps the smallest mixed value over all lines. The
+// share of positions on which two signatures agree estimates the share of
+// distinct lines the two files have in common. Pairs from
+// RENAME_MIN_SIMILARITY percent up are renames.
+//
+// Comparing every removed file with every added one would be quadratic, so
+// candidates come from banding: the signature is cut into bands of
+// SIGNATURE_BAND positions, and only files that agree on all of some band
+// are compared. Two files half alike share a band with near certainty,
+// unrelated files almost never do. Files with identical content are paired
+// by blob ID before any of this and are never read.
+//
+// A signature depends only on the blob, so signatures are kept in
+// .minigit/signatures (a header, then fixed-size records appended as blobs
+// are first seen) and every blob is read for it once. The kernel that mixes
+// the lines runs on AVX2 when the CPU has it, eight positions at a time;
+// MINIGIT_SIMILARITY_KERNEL=generic forces the portable one.
+
+const std::string SIGNATURES_PATH = ".minigit/signatures";
+const uint32_t SIGNATURES_VERSION = 1;
+const size_t SIGNATURE_SIZE = 64;
+const size_t SIGNATURE_BAND = 2;
+const size_t SIGNATURE_LINE_BATCH = 256; // line hashes handed to the kernel at a time
+const int RENAME_MIN_SIMILARITY = 50;    // percent
+const size_t RENAME_BUCKET_LIMIT = 64;   // a band value shared by more sources is skipped
+
+using FileChange = std::array<std::string, 3>; // path, old blob, new blob
+
+struct BlobSignature
+{
+    uint32_t lines = 0;  // non-blank lines
+    uint32_t binary = 0; // 1 for binary or unreadable blobs, which only match by ID
+    uint32_t mins[SIGNATURE_SIZE];
+};
+
+struct SignatureHeader
+{
+    char magic[4]; // "MGSG"
+    uint32_t version;
+};
+
+struct SignatureRecord
+{
+    char id[COMMIT_ID_SIZE]; // blob ID, NUL-padded
+    BlobSignature signature;
+};
+
+std::array<uint32_t, SIGNATURE_SIZE> makeMinHashSeeds()
+{
+    // splitmix64, so the seeds, and with them every stored signature, are
+    // the same in every build
+    std::array<uint32_t, SIGNATURE_SIZE> seeds;
+    uint64_t state = 0;
+    for (auto& seed : seeds)
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        seed = uint32_t(z ^ (z >> 31));
+    }
+    return seeds;
+}
+
+const std::array<uint32_t, SIGNATURE_SIZE> MINHASH_SEEDS = makeMinHashSeeds();
+
+// The murmur3 finalizer; with a different seed XORed in first it acts as a
+// different hash function for every signature position
+inline uint32_t minHashMix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+void minHashGeneric(const uint32_t* hashes, size_t count, uint32_t* mins)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (size_t k = 0; k < SIGNATURE_SIZE; ++k)
+        {
+            mins[k] = std::min(mins[k], minHashMix(hashes[i] ^ MINHASH_SEEDS[k]));
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// AVX2 kernel: the whole signature stays in eight registers while every line
+// hash is broadcast and mixed against eight seeds per instruction
+__attribute__((target("avx2")))
+void minHashAvx2(const uint32_t* hashes, size_t count, uint32_t* mins)
+{
+    const size_t vectors = SIGNATURE_SIZE / 8;
+    __m256i seeds[vectors], best[vectors];
+    for (size_t k = 0; k < vectors; ++k)
+    {
+        seeds[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&MINHASH_SEEDS[k * 8]));
+        best[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mins + k * 8));
+    }
+    const __m256i multiplier1 = _mm256_set1_epi32((int)0x85EBCA6B);
+    const __m256i multiplier2 = _mm256_set1_epi32((int)0xC2B2AE35);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        __m256i hash = _mm256_set1_epi32((int)hashes[i]);
+        for (size_t k = 0; k < vectors; ++k)
+        {
+            __m256i h = _mm256_xor_si256(hash, seeds[k]);
+            h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+            h = _mm256_mullo_epi32(h, multiplier1);
+            h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+            h = _mm256_mullo_epi32(h, multiplier2);
+            h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+            best[k] = _mm256_min_epu32(best[k], h);
+        }
+    }
+
+    for (size_t k = 0; k < vectors; ++k)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(mins + k * 8), best[k]);
+    }
+}
+#endif
+
+using MinHashFunction = void (*)(const uint32_t*, size_t, uint32_t*);
+
+MinHashFunction selectMinHashKernel()
+{
+    const char* forced = std::getenv("MINIGIT_SIMILARITY_KERNEL");
+    if (forced && std::string(forced) == "generic")
+    {
+        return minHashGeneric;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init(); // runs before main, so the CPU is not known yet
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return minHashAvx2;
+    }
+#endif
+    return minHashGeneric;
+}
+
+const MinHashFunction minHashLines = selectMinHashKernel();
+
+// Builds a signature from a blob's content, handed over in pieces of any size
+struct SignatureBuilder
+{
+    BlobSignature signature;
+    std::vector<uint32_t> hashes;
+    std::string partial; // a line split between two pieces
+    size_t checked = 0;  // bytes searched for a NUL so far
+
+    SignatureBuilder()
+    {
+        std::fill(signature.mins, signature.mins + SIGNATURE_SIZE, UINT32_MAX);
+        hashes.reserve(SIGNATURE_LINE_BATCH);
+    }
+
+    void addLine(const char* begin, const char* end)
+    {
+        while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        {
+            --end;
+        }
+        if (begin == end)
+        {
+            return;
+        }
+
+        // FNV-1a, folded to 32 bits
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (const char* p = begin; p < end; ++p)
+        {
+            hash = (hash ^ (uint8_t)*p) * 0x100000001B3ULL;
+        }
+        hashes.push_back(uint32_t(hash ^ (hash >> 32)));
+        ++signature.lines;
+        if (hashes.size() == SIGNATURE_LINE_BATCH)
+        {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        minHashLines(hashes.data(), hashes.size(), signature.mins);
+        hashes.clear();
+    }
+
+    // Like git, a NUL byte near the start marks a blob as binary; there is
+    // no use reading on after that
+    bool add(const char* data, size_t size)
+    {
+        if (checked < 8000)
+        {
+            size_t window = std::min(size, 8000 - checked);
+            checked += window;
+            if (memchr(data, '\0', window))
+            {
+                signature.binary = 1;
+                return false;
+            }
+        }
+
+        const char* end = data + size;
+        while (data < end)
+        {
+            const char* newline = static_cast<const char*>(memchr(data, '\n', end - data));
+            if (!newline)
+            {
+                partial.append(data, end);
+                break;
+            }
+            if (partial.empty())
+            {
+                addLine(data, newline);
+            }
+            else
+            {
+                partial.append(data, newline);
+                addLine(partial.data(), partial.data() + partial.size());
+                partial.clear();
+            }
+            data = newline + 1;
+        }
+        return true;
+    }
+
+    BlobSignature finish()
+    {
+        if (!signature.binary)
+        {
+            addLine(partial.data(), partial.data() + partial.size());
+            flush();
+        }
+        return signature;
+    }
+};
+
+struct SignatureCache
+{
+    std::mutex lock;
+    bool loaded = false;
+    std::unordered_map<std::string, BlobSignature> signatures;
+};
+
+SignatureCache& signatureCache()
+{
+    static SignatureCache cache;
+    return cache;
+}
+
+// Reads .minigit/signatures into the cache; a torn last record is ignored
+void loadSignatures(SignatureCache& cache)
+{
+    cache.loaded = true;
+    size_t size;
+    void* map = mapFile(SIGNATURES_PATH, size);
+    if (!map)
+    {
+        return;
+    }
+    const char* data = static_cast<const char*>(map);
+    SignatureHeader header;
+    if (size >= sizeof(header))
+    {
+        memcpy(&header, data, sizeof(header));
+    }
+    if (size >= sizeof(header) && memcmp(header.magic, "MGSG", 4) == 0 && header.version == SIGNATURES_VERSION)
+    {
+        for (size_t pos = sizeof(header); pos + sizeof(SignatureRecord) <= size; pos += sizeof(SignatureRecord))
+        {
+            SignatureRecord record;
+            memcpy(&record, data + pos, sizeof(record));
+            cache.signatures[std::string(record.id, strnlen(record.id, COMMIT_ID_SIZE))] = record.signature;
+        }
+    }
+    munmap(map, size);
+}
+
+// Appends new signatures to .minigit/signatures. Another process may be
+// appending at the same time, so the file is locked while it is checked and
+// written. Losing signatures only means computing them again, so failures
+// are ignored.
+void saveSignatures(const std::vector<std::pair<std::string, BlobSignature>>& fresh)
+{
+    std::string records;
+    for (const auto& [id, signature] : fresh)
+    {
+        SignatureRecord record = {};
+        memcpy(record.id, id.data(), std::min(id.size(), COMMIT_ID_SIZE));
+        record.signature = signature;
+        records.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+
+    int fd = open(SIGNATURES_PATH.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+    traceCount(TraceFilesOpened);
+    struct stat st;
+    SignatureHeader header;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return;
+    }
+
+    // A file from another version is started over, and a torn record cut off
+    off_t end = st.st_size;
+    bool valid = end >= (off_t)sizeof(header) && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header.magic, "MGSG", 4) == 0 && header.version == SIGNATURES_VERSION;
+    if (!valid)
+    {
+        header = {{'M', 'G', 'S', 'G'}, SIGNATURES_VERSION};
+        end = sizeof(header);
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        {
+            close(fd);
+            return;
+        }
+    }
+    end -= (end - sizeof(header)) % sizeof(SignatureRecord);
+    if (ftruncate(fd, end) == 0)
+    {
+        ssize_t written = pwrite(fd, records.data(), records.size(), end);
+        (void)written;
+    }
+    close(fd);
+}
+
+// Signatures of the given blobs, from the cache or computed now. Blobs not
+// seen before are read in batches and their signatures computed on all
+// cores.
+std::vector<BlobSignature> blobSignatures(const std::vector<std::string>& ids)
+{
+    TraceSpan span("similarity: signatures");
+    SignatureCache& cache = signatureCache();
+    std::vector<BlobSignature> result(ids.size());
+    std::vector<size_t> missing;
+    {
+        std::lock_guard<std::mutex> guard(cache.lock);
+        if (!cache.loaded)
+        {
+            loadSignatures(cache);
+        }
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            auto it = cache.signatures.find(ids[i]);
+            if (it != cache.signatures.end())
+            {
+                result[i] = it->second;
+            }
+            else
+            {
+                missing.push_back(i);
+            }
+        }
+    }
+
+    std::vector<std::pair<std::string, BlobSignature>> fresh;
+    for (size_t start = 0; start < missing.size(); start += IO_BATCH_FILES)
+    {
+        size_t count = std::min(IO_BATCH_FILES, missing.size() - start);
+        std::vector<std::string> batch, contents;
+        for (size_t i = 0; i < count; ++i)
+        {
+            batch.push_back(ids[missing[start + i]]);
+        }
+        std::vector<bool> loaded;
+        readObjects(batch, IO_BATCH_MAX_FILE, contents, loaded);
+
+        std::vector<char> readable(count, true);
+        runParallel(count, [&](size_t i) {
+            SignatureBuilder builder;
+            if (loaded[i])
+            {
+                builder.add(contents[i].data(), contents[i].size());
+            }
+            else
+            {
+                readable[i] = streamObject(batch[i], [&](const char* data, size_t size) {
+                    return builder.add(data, size);
+                }) || builder.signature.binary;
+            }
+            BlobSignature& signature = result[missing[start + i]];
+            signature = builder.finish();
+            signature.binary |= !readable[i];
+        });
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            // A blob that could not be read may turn up later
+            if (readable[i])
+            {
+                fresh.push_back({batch[i], result[missing[start + i]]});
+            }
+        }
+    }
+
+    if (!fresh.empty())
+    {
+        saveSignatures(fresh);
+        std::lock_guard<std::mutex> guard(cache.lock);
+        for (const auto& [id, signature] : fresh)
+        {
+            cache.signatures[id] = signature;
+        }
+    }
+    return result;
+}
+
+// Estimated percentage of distinct lines two blobs have in common
+int signatureSimilarity(const BlobSignature& a, const BlobSignature& b)
+{
+    size_t same = 0;
+    for (size_t k = 0; k < SIGNATURE_SIZE; ++k)
+    {
+        same += a.mins[k] == b.mins[k];
+    }
+    return (int)((same * 100 + SIGNATURE_SIZE / 2) / SIGNATURE_SIZE);
+}
+
+uint64_t signatureBand(const BlobSignature& signature, size_t band)
+{
+    uint64_t key = 0;
+    for (size_t k = band * SIGNATURE_BAND; k < (band + 1) * SIGNATURE_BAND; ++k)
+    {
+        key = (key << 32 | key >> 32) ^ signature.mins[k];
+    }
+    return key ^ (band * 0x9E3779B97F4A7C15ULL);
+}
+
+struct RenameMatch
+{
+    size_t source;  // index into the changes: the file it came from
+    size_t target;  // the added file
+    int similarity; // percent
+    bool copy;      // the source is still there
+};
+
+// Pairs the added files in changes with the removed files they were renamed
+// from and, if copies is set, with removed or modified files they were
+// copied from. The most similar pairs are taken first, and a removed file is
+// the source of one rename at most. Matches come back ordered by target.
+std::vector<RenameMatch> findRenames(const std::vector<FileChange>& changes, bool copies)
+{
+    TraceSpan span("similarity: renames");
+    std::vector<RenameMatch> matches;
+    std::vector<size_t> sources, targets;
+    for (size_t i = 0; i < changes.size(); ++i)
+    {
+        if (changes[i][2].empty())
+        {
+            sources.push_back(i);
+        }
+        else if (changes[i][1].empty())
+        {
+            targets.push_back(i);
+        }
+        else if (copies)
+        {
+            sources.push_back(i); // copied from its old version
+        }
+    }
+    if (sources.empty() || targets.empty())
+    {
+        return matches;
+    }
+
+    auto removed = [&](size_t source) { return changes[source][2].empty(); };
+    std::vector<bool> sourceUsed(changes.size()), targetDone(changes.size());
+
+    // Identical content first; empty files are all alike, so they are left out
+    HashState empty;
+    std::string emptyBlob = hashDigest(empty);
+    std::unordered_map<std::string, std::vector<size_t>> byBlob;
+    for (size_t source : sources)
+    {
+        if (changes[source][1] != emptyBlob)
+        {
+            byBlob[changes[source][1]].push_back(source);
+        }
+    }
+    for (size_t target : targets)
+    {
+        auto it = byBlob.find(changes[target][2]);
+        if (it == byBlob.end())
+        {
+            continue;
+        }
+        for (size_t source : it->second)
+        {
+            if (removed(source) && !sourceUsed[source])
+            {
+                matches.push_back({source, target, 100, false});
+                sourceUsed[source] = targetDone[target] = true;
+                break;
+            }
+        }
+        if (!targetDone[target] && copies)
+        {
+            matches.push_back({it->second.front(), target, 100, true});
+            targetDone[target] = true;
+        }
+    }
+
+    // Then by signature, for what is left. A copy may come from any source.
+    std::vector<size_t> openSources, openTargets;
+    for (size_t source : sources)
+    {
+        if (copies || !sourceUsed[source])
+        {
+            openSources.push_back(source);
+        }
+    }
+    for (size_t target : targets)
+    {
+        if (!targetDone[target])
+        {
+            openTargets.push_back(target);
+        }
+    }
+    if (openSources.empty() || openTargets.empty())
+    {
+        std::sort(matches.begin(), matches.end(), [](const RenameMatch& a, const RenameMatch& b) { return a.target < b.target; });
+        return matches;
+    }
+
+    std::vector<std::string> ids;
+    std::unordered_map<std::string, size_t> idIndex;
+    auto signatureOf = [&](const std::string& blob) {
+        auto [it, added] = idIndex.insert({blob, ids.size()});
+        if (added)
+        {
+            ids.push_back(blob);
+        }
+        return it->second;
+    };
+    std::vector<size_t> sourceSignature, targetSignature;
+    for (size_t source : openSources)
+    {
+        sourceSignature.push_back(signatureOf(changes[source][1]));
+    }
+    for (size_t target : openTargets)
+    {
+        targetSignature.push_back(signatureOf(changes[target][2]));
+    }
+    std::vector<BlobSignature> signatures = blobSignatures(ids);
+    auto usable = [](const BlobSignature& signature) { return !signature.binary && signature.lines > 0; };
+
+    // Band values of every source, sorted so each target can look its own up
+    span.restart("similarity: candidates");
+    const size_t bands = SIGNATURE_SIZE / SIGNATURE_BAND;
+    std::vector<std::pair<uint64_t, uint32_t>> sourceBands; // band value, position in openSources
+    for (size_t i = 0; i < openSources.size(); ++i)
+    {
+        const BlobSignature& signature = signatures[sourceSignature[i]];
+        for (size_t band = 0; usable(signature) && band < bands; ++band)
+        {
+            sourceBands.push_back({signatureBand(signature, band), (uint32_t)i});
+        }
+    }
+    std::sort(sourceBands.begin(), sourceBands.end());
+
+    struct Candidate
+    {
+        int similarity;
+        size_t target, source;
+    };
+    std::vector<Candidate> candidates;
+    std::vector<size_t> comparedWith(openSources.size(), SIZE_MAX); // last target compared against
+    for (size_t j = 0; j < openTargets.size(); ++j)
+    {
+        const BlobSignature& signature = signatures[targetSignature[j]];
+        for (size_t band = 0; usable(signature) && band < bands; ++band)
+        {
+            auto range = std::equal_range(sourceBands.begin(), sourceBands.end(),
+                                          std::make_pair(signatureBand(signature, band), uint32_t(0)),
+                                          [](const auto& a, const auto& b) { return a.first < b.first; });
+            if (range.second - range.first > (ptrdiff_t)RENAME_BUCKET_LIMIT)
+            {
+                continue; // a line nearly everything has; other bands decide
+            }
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (comparedWith[it->second] == j)
+                {
+                    continue;
+                }
+                comparedWith[it->second] = j;
+                // Only identical blobs, paired above, are shown as 100% alike
+                int similarity = std::min(99, signatureSimilarity(signatures[sourceSignature[it->second]], signature));
+                if (similarity >= RENAME_MIN_SIMILARITY)
+                {
+                    candidates.push_back({similarity, openTargets[j], openSources[it->second]});
+                }
+            }
+        }
+    }
+
+    // Most similar first; ties go by path order, so the result is stable
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return std::tie(b.similarity, a.target, a.source) < std::tie(a.similarity, b.target, b.source);
+    });
+    for (const auto& c : candidates)
+    {
+        if (!targetDone[c.target] && removed(c.source) && !sourceUsed[c.source])
+        {
+            matches.push_back({c.source, c.target, c.similarity, false});
+            sourceUsed[c.source] = targetDone[c.target] = true;
+        }
+    }
+    for (const auto& c : candidates)
+    {
+        if (copies && !targetDone[c.target])
+        {
+            matches.push_back({c.source, c.target, c.similarity, true});
+            targetDone[c.target] = true;
+        }
+    }
+
+    std::sort(matches.begin(), matches.end(), [](const RenameMatch& a, const RenameMatch& b) { return a.target < b.target; });
+    return matches;
+}
+
+// Where a file in a list of changes came from, if it was renamed or copied
+struct FileOrigin
+{
+    std::string path; // empty if it was not
+    int similarity = 0;
+    bool copy = false;
+};
+
+// Runs findRenames and folds every match into one change: the added file
+// gets its source's blob as the old side, and a renamed file's removal is
+// dropped. origins comes back parallel to changes.
+void foldRenames(std::vector<FileChange>& changes, std::vector<FileOrigin>& origins, bool copies)
+{
+    std::vector<RenameMatch> matches = findRenames(changes, copies);
+    origins.assign(changes.size(), FileOrigin());
+    std::vector<bool> dropped(changes.size());
+    for (const auto& match : matches)
+    {
+        origins[match.target] = {changes[match.source][0], match.similarity, match.copy};
+        changes[match.target][1] = changes[match.source][1];
+        dropped[match.source] = dropped[match.source] || !match.copy;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < changes.size(); ++i)
+    {
+        if (!dropped[i] && kept++ != i)
+        {
+            changes[kept - 1] = std::move(changes[i]);
+            origins[kept - 1] = std::move(origins[i]);
+        }
+    }
+    changes.resize(kept);
+    origins.resize(kept);
+}
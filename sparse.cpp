@@ -0,0 +1,147 @@
+// Sparse checkout
+//
+// `checkout <branch> -- <pathspec>...` restores only the paths that match
+// one of the pathspecs, and .minigit/sparse-checkout remembers them, one per
+// line, for every later checkout and merge. A pathspec is either
+//
+//   a path      matches the file itself or everything below the directory
+//   a pattern   with *, ? or [...], matched against the whole path; * also
+//               matches across '/'
+//
+// `checkout <branch> -- .` goes back to the whole tree and removes the file.
+// Paths outside the spec stay in every commit as they were; they are only
+// left out of the working directory and the index, so status does not miss
+// them and a commit does not drop them.
+//
+// Checkouts compare trees with the spec as a filter, so directories that
+// cannot hold a matching path are never read.
+
+const std::string SPARSE_PATH = ".minigit/sparse-checkout";
+
+struct SparseSpec
+{
+    std::vector<std::string> patterns; // empty for the whole tree
+
+    bool full() const
+    {
+        return patterns.empty();
+    }
+
+    static bool isGlob(const std::string& pattern)
+    {
+        return pattern.find_first_of("*?[") != std::string::npos;
+    }
+
+    // Whether a file at path is checked out
+    bool includes(const std::string& path) const
+    {
+        if (full())
+        {
+            return true;
+        }
+        for (const auto& pattern : patterns)
+        {
+            if (isGlob(pattern) ? fnmatch(pattern.c_str(), path.c_str(), 0) == 0
+                                : path == pattern || (path.size() > pattern.size() && path[pattern.size()] == '/'
+                                                      && path.compare(0, pattern.size(), pattern) == 0))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Whether anything below dir, which ends in '/', may be checked out
+    bool mayContain(const std::string& dir) const
+    {
+        if (full())
+        {
+            return true;
+        }
+        for (const auto& pattern : patterns)
+        {
+            // Only the part of a glob before its first wildcard is known
+            std::string fixed = isGlob(pattern) ? pattern.substr(0, pattern.find_first_of("*?[")) : pattern + "/";
+            size_t common = std::min(fixed.size(), dir.size());
+            if (fixed.compare(0, common, dir, 0, common) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // As a filter for diffTrees
+    TreeFilter filter() const
+    {
+        if (full())
+        {
+            return TreeFilter();
+        }
+        return [this](const std::string& path) {
+            return path.back() == '/' ? mayContain(path) : includes(path);
+        };
+    }
+};
+
+// Turns pathspecs as typed into a spec. Fails on a path outside the
+// repository; "." anywhere means the whole tree.
+bool makeSparse(const std::vector<std::string>& pathspecs, SparseSpec& spec)
+{
+    spec = SparseSpec();
+    std::set<std::string> patterns;
+    for (const auto& pathspec : pathspecs)
+    {
+        std::string pattern = fs::path(pathspec).lexically_normal().generic_string();
+        while (pattern.size() > 1 && pattern.back() == '/')
+        {
+            pattern.pop_back();
+        }
+        if (pattern.empty() || pattern == ".")
+        {
+            spec = SparseSpec();
+            return true;
+        }
+        if (pattern[0] == '/' || pattern == ".." || pattern.rfind("../", 0) == 0)
+        {
+            std::cout << "Error: '" << pathspec << "' is outside the repository.\n";
+            return false;
+        }
+        patterns.insert(pattern);
+    }
+    spec.patterns.assign(patterns.begin(), patterns.end());
+    return true;
+}
+
+// The spec the working directory was checked out with
+SparseSpec loadSparse()
+{
+    SparseSpec spec;
+    std::ifstream in(SPARSE_PATH);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (!line.empty())
+        {
+            spec.patterns.push_back(line);
+        }
+    }
+    return spec;
+}
+
+bool saveSparse(const SparseSpec& spec)
+{
+    if (spec.full())
+    {
+        return unlink(SPARSE_PATH.c_str()) == 0 || errno == ENOENT;
+    }
+
+    std::string tmp = SPARSE_PATH + ".tmp";
+    std::ofstream out(tmp, std::ios::trunc);
+    for (const auto& pattern : spec.patterns)
+    {
+        out << pattern << "\n";
+    }
+    out.close();
+    return out && rename(tmp.c_str(), SPARSE_PATH.c_str()) == 0;
+}
@@ -0,0 +1,248 @@
+// Stat index
+//
+// .minigit/index remembers, for every path minigit has added or checked out,
+// the hash it had and the stat data of the file at that moment. If a file's
+// size, mtime, ctime and inode still match, its content is assumed unchanged
+// and does not need to be read again.
+//
+// File layout: IndexHeader, then per entry an IndexRecord followed by the path
+// and the hash bytes. Entries are sorted by path.
+//
+// An entry whose mtime is not older than the index file itself is "racily
+// clean": the file could have been changed again within the same timestamp
+// tick, so it is always rehashed.
+//
+// Version 1 records had no flags; they are still read, with none set.
+
+const std::string INDEX_PATH = ".minigit/index";
+const uint32_t INDEX_VERSION = 2;
+
+// IndexRecord flags
+const uint32_t INDEX_LAZY = 1; // the file was checked out as a placeholder
+
+struct IndexHeader
+{
+    char magic[4];      // "MGIX"
+    uint32_t version;
+    uint64_t count;
+};
+
+struct IndexRecord
+{
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    int64_t ctimeSec;
+    int64_t ctimeNsec;
+    uint64_t inode;
+    uint32_t pathLength;
+    uint32_t hashLength;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct IndexEntry
+{
+    std::string path;
+    std::string hash;
+    IndexRecord stat = {};
+};
+
+struct StatIndex
+{
+    std::vector<IndexEntry> entries; // sorted by path
+    struct timespec written = {0, 0};
+    bool changed = false;
+};
+
+IndexRecord statRecord(const struct stat& st)
+{
+    IndexRecord record = {};
+    record.size = st.st_size;
+    record.mtimeSec = st.st_mtim.tv_sec;
+    record.mtimeNsec = st.st_mtim.tv_nsec;
+    record.ctimeSec = st.st_ctim.tv_sec;
+    record.ctimeNsec = st.st_ctim.tv_nsec;
+    record.inode = st.st_ino;
+    return record;
+}
+
+bool loadIndex(StatIndex& index)
+{
+    TraceSpan span("index: load");
+    index = StatIndex();
+
+    size_t size;
+    void* map = mapFile(INDEX_PATH, size);
+    if (!map)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (stat(INDEX_PATH.c_str(), &st) == 0)
+    {
+        index.written = st.st_mtim;
+    }
+
+    const char* data = static_cast<const char*>(map);
+    const char* end = data + size;
+    IndexHeader header;
+    bool ok = size >= sizeof(header);
+    if (ok)
+    {
+        memcpy(&header, data, sizeof(header));
+        ok = memcmp(header.magic, "MGIX", 4) == 0 && (header.version == 1 || header.version == INDEX_VERSION);
+    }
+    size_t recordSize = ok && header.version == 1 ? offsetof(IndexRecord, flags) : sizeof(IndexRecord);
+
+    const char* p = data + sizeof(header);
+    for (uint64_t i = 0; ok && i < header.count; ++i)
+    {
+        IndexEntry entry;
+        if ((size_t)(end - p) < recordSize)
+        {
+            ok = false;
+            break;
+        }
+        memcpy(&entry.stat, p, recordSize);
+        p += recordSize;
+        if ((size_t)(end - p) < (size_t)entry.stat.pathLength + entry.stat.hashLength)
+        {
+            ok = false;
+            break;
+        }
+        entry.path.assign(p, entry.stat.pathLength);
+        p += entry.stat.pathLength;
+        entry.hash.assign(p, entry.stat.hashLength);
+        p += entry.stat.hashLength;
+        index.entries.push_back(std::move(entry));
+    }
+
+    munmap(map, size);
+    if (!ok)
+    {
+        index = StatIndex();
+    }
+    return ok;
+}
+
+bool saveIndex(StatIndex& index)
+{
+    TraceSpan span("index: save");
+    std::string out;
+    IndexHeader header = {{'M', 'G', 'I', 'X'}, INDEX_VERSION, index.entries.size()};
+    out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for (auto& entry : index.entries)
+    {
+        entry.stat.pathLength = entry.path.size();
+        entry.stat.hashLength = entry.hash.size();
+        out.append(reinterpret_cast<const char*>(&entry.stat), sizeof(IndexRecord));
+        out += entry.path;
+        out += entry.hash;
+    }
+
+    std::string tmpPath = INDEX_PATH + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file.write(out.data(), out.size());
+    file.close();
+    if (!file || std::rename(tmpPath.c_str(), INDEX_PATH.c_str()) != 0)
+    {
+        return false;
+    }
+
+    index.changed = false;
+    return true;
+}
+
+const IndexEntry* findIndexEntry(const StatIndex& index, const std::string& path)
+{
+    auto it = std::lower_bound(index.entries.begin(), index.entries.end(), path, [](const IndexEntry& entry, const std::string& key) {
+        return entry.path < key;
+    });
+    return it != index.entries.end() && it->path == path ? &*it : nullptr;
+}
+
+void setIndexEntry(StatIndex& index, const std::string& path, const std::string& hash, const IndexRecord& record)
+{
+    auto it = std::lower_bound(index.entries.begin(), index.entries.end(), path, [](const IndexEntry& entry, const std::string& key) {
+        return entry.path < key;
+    });
+    if (it == index.entries.end() || it->path != path)
+    {
+        it = index.entries.insert(it, IndexEntry{path, "", {}});
+    }
+    it->hash = hash;
+    it->stat = record;
+    index.changed = true;
+}
+
+// Applies many updates at once; cheaper than setIndexEntry in a loop
+void setIndexEntries(StatIndex& index, std::vector<IndexEntry> updates)
+{
+    if (updates.empty())
+    {
+        return;
+    }
+
+    std::stable_sort(updates.begin(), updates.end(), [](const IndexEntry& a, const IndexEntry& b) {
+        return a.path < b.path;
+    });
+
+    std::vector<IndexEntry> merged;
+    merged.reserve(index.entries.size() + updates.size());
+    size_t i = 0, j = 0;
+    while (i < index.entries.size() || j < updates.size())
+    {
+        if (j == updates.size() || (i < index.entries.size() && index.entries[i].path < updates[j].path))
+        {
+            merged.push_back(std::move(index.entries[i++]));
+            continue;
+        }
+
+        // The last update for a path wins, and replaces the old entry
+        while (j + 1 < updates.size() && updates[j + 1].path == updates[j].path)
+        {
+            ++j;
+        }
+        if (i < index.entries.size() && index.entries[i].path == updates[j].path)
+        {
+            ++i;
+        }
+        merged.push_back(std::move(updates[j++]));
+    }
+
+    index.entries = std::move(merged);
+    index.changed = true;
+}
+
+// Drops the entries of many paths in one pass over the index
+void removeIndexEntries(StatIndex& index, std::vector<std::string> paths)
+{
+    std::sort(paths.begin(), paths.end());
+    auto end = std::remove_if(index.entries.begin(), index.entries.end(), [&](const IndexEntry& entry) {
+        return std::binary_search(paths.begin(), paths.end(), entry.path);
+    });
+    if (end != index.entries.end())
+    {
+        index.entries.erase(end, index.entries.end());
+        index.changed = true;
+    }
+}
+
+// True if the file still looks exactly like it did when the entry was made
+bool statMatches(const StatIndex& index, const IndexEntry& entry, const struct stat& st)
+{
+    const IndexRecord& r = entry.stat;
+    if (entry.hash.empty() || r.size != (uint64_t)st.st_size || r.inode != st.st_ino
+        || r.mtimeSec != st.st_mtim.tv_sec || r.mtimeNsec != st.st_mtim.tv_nsec
+        || r.ctimeSec != st.st_ctim.tv_sec || r.ctimeNsec != st.st_ctim.tv_nsec)
+    {
+        return false;
+    }
+
+    // Racily clean: modified in the same tick the index was written
+    return r.mtimeSec < index.written.tv_sec
+        || (r.mtimeSec == index.written.tv_sec && r.mtimeNsec < index.written.tv_nsec);
+}
@@ -0,0 +1,520 @@
+#!/bin/sh
+# Command-line tests for minigit
+#
+#   tests/cli-tests.sh <path to minigit binary>
+#
+# Every test runs in a fresh repository in a temporary directory and checks
+# what the commands print and the status they exit with.
+
+MINIGIT=$(realpath "${1:?usage: $0 <path to minigit binary>}")
+ROOT=$(mktemp -d)
+trap 'rm -rf "$ROOT"' EXIT
+failures=0
+
+fail()
+{
+    echo "FAIL: $current: $*"
+    failures=$((failures + 1))
+}
+
+# Runs minigit in the current repository, output discarded
+mg()
+{
+    "$MINIGIT" "$@" > /dev/null
+}
+
+# expect_status <status> <command...>: runs minigit and checks its exit status
+expect_status()
+{
+    expected=$1
+    shift
+    "$MINIGIT" "$@" > "$ROOT/out" 2>&1
+    actual=$?
+    if [ "$actual" -ne "$expected" ]; then
+        fail "'minigit $*' exited with $actual, expected $expected: $(cat "$ROOT/out")"
+    fi
+}
+
+# Starts a test in an empty repository
+begin()
+{
+    current=$1
+    rm -rf "$ROOT/repo"
+    mkdir "$ROOT/repo" && cd "$ROOT/repo" || exit 1
+    mg init
+}
+
+test_readers_share_the_commit_graph()
+{
+    begin "reading commands do not wait for other readers"
+    command -v flock > /dev/null && command -v timeout > /dev/null || return 0
+    echo a > a.txt && mg add a.txt && mg commit -m first
+    flock -s .minigit/commit-graph sleep 4 &
+    sleep 1
+    timeout 2 "$MINIGIT" log > "$ROOT/out" 2>&1 || fail "log waited for another reader of the commit graph"
+    wait
+}
+
+test_failing_commands_report_status()
+{
+    begin "failing commands report a non-zero status"
+    echo a > a.txt
+    expect_status 0 add a.txt
+    expect_status 0 commit -m first
+    expect_status 1 commit -m empty
+    echo b > b.txt && mg add b.txt
+    expect_status 1 commit -m "fix
+TREE deadbeef
+END"
+    expect_status 0 commit -m second
+    if grep -qx "TREE deadbeef" .minigit/commits.txt; then
+        fail "a commit message with newlines was written into the commit record"
+    fi
+
+    expect_status 1 checkout nosuchbranch
+    expect_status 1 merge nosuchbranch
+    expect_status 1 diff 0000 1111
+    expect_status 1 add missing.txt
+    expect_status 0 status
+
+    mg branch dev
+    echo ours > a.txt && mg add a.txt && mg commit -m ours
+    mg checkout dev
+    echo theirs > a.txt && mg add a.txt && mg commit -m theirs
+    expect_status 1 merge main
+
+    printf 'add missing.txt\nstatus\n' | "$MINIGIT" batch > "$ROOT/out"
+    if ! grep -qx -- '--- 1' "$ROOT/out" || ! grep -qx -- '--- 0' "$ROOT/out"; then
+        fail "batch mode did not report the status of each command: $(cat "$ROOT/out")"
+    fi
+}
+
+test_status_outside_repository()
+{
+    begin "status outside a repository"
+    rm -rf .minigit
+    echo a > a.txt
+    expect_status 1 status
+    if grep -q "a.txt" "$ROOT/out"; then
+        fail "status listed files outside a repository: $(cat "$ROOT/out")"
+    fi
+}
+
+test_identical_commits_in_one_second()
+{
+    begin "identical commits made back to back"
+    echo 1 > a.txt
+    printf 'add a.txt\ncommit -m same\nadd a.txt\ncommit -m same\n' | "$MINIGIT" batch > "$ROOT/out"
+    ids=$("$MINIGIT" log | awk '/^Commit ID:/ {print $NF}')
+    if [ "$(echo "$ids" | sort -u | wc -l)" -ne 2 ]; then
+        fail "expected two commits with different IDs, log shows: $ids"
+    fi
+    first=$(echo "$ids" | tail -n 1)
+    second=$(echo "$ids" | head -n 1)
+    if ! grep -A 4 "^COMMIT $second" .minigit/commits.txt | grep -qx "PARENT $first"; then
+        fail "the second commit does not have the first as its parent"
+    fi
+}
+
+test_add_stages_removals()
+{
+    begin "add stages the removal of deleted files"
+    mkdir dir
+    echo a > a.txt && echo b > b.txt && echo x > dir/x.txt && echo y > dir/y.txt
+    mg add a.txt b.txt dir && mg commit -m first
+    first=$("$MINIGIT" log | awk '/^Commit ID:/ {print $NF; exit}')
+
+    rm b.txt dir/x.txt
+    expect_status 0 add b.txt
+    expect_status 0 add dir
+    expect_status 0 commit -m second
+    second=$("$MINIGIT" log | awk '/^Commit ID:/ {print $NF; exit}')
+
+    changed=$("$MINIGIT" diff --name-only "$first" "$second" | tr '\n' ' ')
+    if [ "$changed" != "b.txt dir/x.txt " ]; then
+        fail "expected b.txt and dir/x.txt to be removed, diff shows: $changed"
+    fi
+    if "$MINIGIT" status | grep -q "deleted"; then
+        fail "status still reports a deletion after it was committed"
+    fi
+    expect_status 1 add never-tracked.txt
+}
+
+test_merge_keeps_local_edits()
+{
+    begin "merge refuses to overwrite local edits"
+    echo a > a.txt && mg add a.txt && mg commit -m first
+    mg branch dev && mg checkout dev
+    echo theirs > a.txt && mg add a.txt && mg commit -m theirs
+    mg checkout main
+    echo "local edit" > a.txt
+    expect_status 1 merge dev
+    if [ "$(cat a.txt)" != "local edit" ]; then
+        fail "merge overwrote a local edit"
+    fi
+    if ! grep -q "a.txt" "$ROOT/out"; then
+        fail "merge did not name the file with local edits: $(cat "$ROOT/out")"
+    fi
+}
+
+test_merge_keeps_missing_final_newline()
+{
+    begin "merge keeps a missing final newline"
+    printf 'one\ntwo\nthree' > a.txt && mg add a.txt && mg commit -m first
+    mg branch dev && mg checkout dev
+    printf 'one\ntwo\nTHREE' > a.txt && mg add a.txt && mg commit -m theirs
+    mg checkout main
+    printf 'ONE\ntwo\nthree' > a.txt && mg add a.txt && mg commit -m ours
+    expect_status 0 merge dev
+    if [ "$(od -c a.txt)" != "$(printf 'ONE\ntwo\nTHREE' | od -c)" ]; then
+        fail "merged file is '$(cat a.txt)', expected no final newline"
+    fi
+}
+
+test_merge_binary_conflict()
+{
+    begin "binary files changed on both sides conflict"
+    printf 'a\000base' > b.bin && mg add b.bin && mg commit -m first
+    mg branch dev && mg checkout dev
+    printf 'a\000theirs' > b.bin && mg add b.bin && mg commit -m theirs
+    mg checkout main
+    printf 'a\000ours' > b.bin && mg add b.bin && mg commit -m ours
+    expect_status 1 merge dev
+    if ! grep -q "CONFLICT (binary)" "$ROOT/out"; then
+        fail "expected a binary conflict: $(cat "$ROOT/out")"
+    fi
+    if [ "$(od -c b.bin)" != "$(printf 'a\000ours' | od -c)" ]; then
+        fail "the binary file was not left as this side's version"
+    fi
+}
+
+test_merge_conflict_in_renamed_file()
+{
+    begin "a conflict in a file the other branch moved keeps the file"
+    mkdir d
+    seq 1 30 > d/a.txt && mg add d && mg commit -m first
+    mg branch dev && mg checkout dev
+    mkdir e && sed 's/^2$/two/' d/a.txt > e/a.txt && rm -r d
+    mg add d e && mg commit -m moved
+    mg checkout main
+    sed -i 's/^2$/TWO/' d/a.txt && mg add d/a.txt && mg commit -m ours
+    expect_status 1 merge dev
+    if ! grep -q "CONFLICT: both modified e/a.txt" "$ROOT/out"; then
+        fail "expected a conflict in e/a.txt: $(cat "$ROOT/out")"
+    fi
+    if [ ! -f e/a.txt ] || ! grep -qx "TWO" e/a.txt || ! grep -qx "two" e/a.txt; then
+        fail "the conflict was not written to e/a.txt"
+    fi
+}
+
+test_add_freshens_existing_objects()
+{
+    begin "adding content that is already stored freshens its object"
+    echo one > a.txt && mg add a.txt
+    blob=$(sed -n 's/^a.txt://p' .minigit/staging.txt)
+    object=.minigit/objects/$(echo "$blob" | cut -c1-2)/$(echo "$blob" | cut -c3-)
+    echo two > a.txt && mg add a.txt && mg commit -m first
+    touch -d "2 hours ago" "$object"
+    echo one > a.txt && mg add a.txt
+    if [ -z "$(find "$object" -mmin -10)" ]; then
+        fail "the stored object kept its old mtime, so gc could remove it"
+    fi
+}
+
+test_failed_checkout_keeps_head()
+{
+    begin "a checkout that cannot write a file keeps HEAD"
+    echo a > a.txt && mg add a.txt && mg commit -m first
+    mg branch dev && mg checkout dev
+    mkdir d && echo x > d/x.txt && echo b > a.txt && mg add a.txt d && mg commit -m second
+    mg checkout main
+    echo "in the way" > d
+    expect_status 1 checkout dev
+    if ! grep -q "d/x.txt" "$ROOT/out"; then
+        fail "checkout did not name the file it could not write: $(cat "$ROOT/out")"
+    fi
+    [ "$(cat .minigit/HEAD.txt)" = "main" ] || fail "HEAD moved to $(cat .minigit/HEAD.txt)"
+    "$MINIGIT" status > "$ROOT/out"
+    grep -q "a.txt" "$ROOT/out" || fail "status does not show the file checkout changed: $(cat "$ROOT/out")"
+}
+
+test_chunked_blobs()
+{
+    begin "large files are stored as chunks and read back whole"
+    head -c 3000000 /dev/urandom > big.bin && cp big.bin "$ROOT/v1"
+    mg add big.bin && mg commit -m first
+    mg branch old
+    before=$(find .minigit/objects -type f | wc -l)
+    if [ "$before" -lt 10 ]; then
+        fail "a 3 MB file was stored as $before objects, expected chunks"
+    fi
+
+    # An edit in the middle only adds the chunks around it
+    printf 'edit' | dd of=big.bin bs=1 seek=1500000 conv=notrunc 2> /dev/null
+    cp big.bin "$ROOT/v2"
+    mg add big.bin && mg commit -m second
+    after=$(find .minigit/objects -type f | wc -l)
+    if [ $((after - before)) -gt 6 ]; then
+        fail "an edit of 4 bytes added $((after - before)) objects"
+    fi
+
+    # Small content that looks like a manifest is still stored as itself
+    printf '\211MGC\r\n\032\nnot a manifest\n' > fake && cp fake "$ROOT/fake"
+    mg add fake && mg commit -m third
+
+    for round in loose packed; do
+        rm -f fake
+        expect_status 0 checkout old
+        cmp -s big.bin "$ROOT/v1" || fail "the first version did not read back ($round)"
+        expect_status 0 checkout main
+        cmp -s big.bin "$ROOT/v2" || fail "the second version did not read back ($round)"
+        cmp -s fake "$ROOT/fake" || fail "a file that looks like a manifest did not read back ($round)"
+        mg pack
+    done
+}
+
+test_pack_round_trip()
+{
+    begin "packed objects read back as they were stored"
+    seq 1 3000 > big.txt && printf 'bin\000ary\001\002' > b.bin
+    mg add big.txt b.bin && mg commit -m first
+    mg branch old
+    cp big.txt "$ROOT/v1" && cp b.bin "$ROOT/b.bin"
+    sed 's/^1500$/changed/' "$ROOT/v1" > big.txt && mg add big.txt && mg commit -m second
+    cp big.txt "$ROOT/v2"
+
+    expect_status 0 pack
+    if ! grep -q "(1 deltas)" "$ROOT/out"; then
+        fail "the second version of big.txt was not stored as a delta: $(cat "$ROOT/out")"
+    fi
+    if [ -n "$(find .minigit/objects -type f ! -path '*/pack/*')" ]; then
+        fail "pack left loose objects behind"
+    fi
+
+    # A second pack copies every entry out of the first one
+    expect_status 0 pack
+    for round in 1 2; do
+        expect_status 0 checkout old
+        cmp -s big.txt "$ROOT/v1" && cmp -s b.bin "$ROOT/b.bin" || fail "the first commit did not read back from the pack"
+        expect_status 0 checkout main
+        cmp -s big.txt "$ROOT/v2" || fail "the delta of big.txt did not read back from the pack"
+        mg pack
+    done
+    old=$("$MINIGIT" log | awk '/^Commit ID:/ {print $NF}' | tail -n 1)
+    new=$("$MINIGIT" log | awk '/^Commit ID:/ {print $NF; exit}')
+    "$MINIGIT" diff "$old" "$new" | grep -q "changed" || fail "diff could not read the packed versions"
+}
+
+test_packed_refs()
+{
+    begin "branches are found in packed-refs"
+    echo 0 > f && mg add f && mg commit -m first
+    names="a ab a-b feature/x feature/y zz"
+    for i in 1 2 3 4 5 6 7 8 9 10 11 12; do
+        names="$names b$i"
+    done
+    for name in $names; do
+        mg branch "$name"
+    done
+    mg checkout ab && echo ab > f && mg add f && mg commit -m ab
+
+    expect_status 0 pack-refs
+    if [ -n "$(find .minigit/refs/heads -type f)" ]; then
+        fail "pack-refs left loose refs behind"
+    fi
+    for name in $names main; do
+        grep -q "^$name:" .minigit/packed-refs || fail "$name is missing from packed-refs"
+        expect_status 0 checkout "$name"
+    done
+    expect_status 1 branch feature/x
+    expect_status 1 checkout feature
+
+    # A commit after packing goes to a loose ref, which wins
+    mg checkout ab
+    [ "$(cat f)" = "ab" ] || fail "checkout of a packed branch did not restore its files"
+    echo ab2 > f && mg add f && mg commit -m ab2
+    "$MINIGIT" log | grep -q "Message  : ab2" || fail "log does not start at the loose ref"
+    mg checkout a && mg checkout ab
+    [ "$(cat f)" = "ab2" ] || fail "checkout used the packed value of a branch with a loose ref"
+    expect_status 0 pack-refs
+    [ "$(grep -c "^ab:" .minigit/packed-refs)" -eq 1 ] || fail "packed-refs lists ab more than once"
+    "$MINIGIT" log | grep -q "Message  : ab2" || fail "pack-refs lost the update of a loose ref"
+}
+
+test_journal_replay()
+{
+    begin "the journal restores a commit a crash cut short"
+    echo 0 > f && mg add f && mg commit -m first
+    cp .minigit/commits.txt "$ROOT/commits" && cp .minigit/refs/heads/main "$ROOT/ref"
+    echo 1 > f && mg add f && mg commit -m second
+    cp .minigit/journal "$ROOT/journal"
+    second=$(cat .minigit/refs/heads/main)
+
+    # Journal synced, but neither commits.txt nor the branch were updated
+    crash()
+    {
+        sed '$d' "$ROOT/journal" > .minigit/journal
+        cp "$ROOT/commits" .minigit/commits.txt && cp "$ROOT/ref" .minigit/refs/heads/main
+    }
+    crash
+    expect_status 0 log
+    grep -q "Message  : second" "$ROOT/out" || fail "the journal was not replayed: $(cat "$ROOT/out")"
+    [ "$(cat .minigit/refs/heads/main)" = "$second" ] || fail "the branch was not moved to the replayed commit"
+    [ ! -s .minigit/journal ] || fail "the journal was not emptied after the replay"
+    echo 2 > f && mg add f && expect_status 0 commit -m third
+
+    # A transaction whose checksum does not match is never replayed
+    crash
+    sed -i 's/^MESSAGE second$/MESSAGE forged/' .minigit/journal
+    expect_status 0 log
+    if grep -q "Message  : \(second\|forged\)" "$ROOT/out"; then
+        fail "a damaged transaction was replayed: $(cat "$ROOT/out")"
+    fi
+
+    # Nor is one torn off before its END line
+    crash
+    head -n $(($(wc -l < "$ROOT/journal") - 4)) "$ROOT/journal" > .minigit/journal
+    expect_status 0 log
+    grep -q "Message  : second" "$ROOT/out" && fail "a torn transaction was replayed"
+    expect_status 0 status
+}
+
+test_log_paths()
+{
+    begin "log -- <path> lists the commits that changed the path"
+    mkdir -p dir dir2 deep/x
+    echo a > dir/a.txt && mg add dir && mg commit -m "dir a"
+    echo b > dir/b.txt && mg add dir && mg commit -m "dir b"
+    echo o > other.txt && mg add other.txt && mg commit -m "other"
+    echo c > dir2/c.txt && mg add dir2 && mg commit -m "dir2"
+    echo y > deep/x/y.txt && mg add deep && mg commit -m "deep"
+    echo a2 > dir/a.txt && mg add dir && mg commit -m "dir a again"
+
+    # More changed paths than a filter holds
+    mkdir many
+    i=0
+    while [ $i -lt 600 ]; do
+        echo $i > many/$i.txt
+        i=$((i + 1))
+    done
+    mg add many && mg commit -m "many"
+
+    messages()
+    {
+        "$MINIGIT" log -- "$@" | sed -n 's/^Message  : //p' | tr '\n' ','
+    }
+    check()
+    {
+        expected=$1
+        shift
+        actual=$(messages "$@")
+        [ "$actual" = "$expected" ] || fail "log -- $* listed '$actual', expected '$expected'"
+    }
+    for round in 1 2; do
+        check "dir a again,dir b,dir a," dir
+        check "dir a again,dir a," dir/a.txt
+        check "other," other.txt
+        check "deep," deep/x
+        check "dir2,other," dir2 other.txt
+        check "many," many/599.txt
+        check "" nothing.txt
+        # The same answers when the graph and its filters are built anew
+        rm -f .minigit/commit-graph*
+    done
+    "$MINIGIT" log -- nothing.txt | grep -q "No matching commits" || fail "log -- <path> with no match said nothing"
+}
+
+test_gc_after_pack()
+{
+    begin "gc removes garbage that was packed"
+    echo one > a.txt && mg add a.txt && mg pack
+    echo two > a.txt && mg add a.txt && mg commit -m first
+    expect_status 0 pack
+    expect_status 0 gc --prune=now
+    if ! grep -q "^Removed 1 unreachable objects" "$ROOT/out"; then
+        fail "gc did not remove the unreachable packed blob: $(cat "$ROOT/out")"
+    fi
+    touch .minigit/objects/pack/tmp_pack_left
+    expect_status 0 gc --prune=now
+    [ -e .minigit/objects/pack/tmp_pack_left ] && fail "gc left a temporary pack file behind"
+    rm -f a.txt && mg checkout main
+    [ "$(cat a.txt)" = "two" ] || fail "a packed file could not be checked out after gc"
+}
+
+test_checkout_restores_deleted_files()
+{
+    begin "checkout restores deleted tracked files"
+    mkdir dir
+    echo a > a.txt && echo x > dir/x.txt
+    mg add a.txt dir && mg commit -m first
+    for spec in "" "-- a.txt" "-- ." "-- dir"; do
+        rm -f a.txt dir/x.txt
+        expect_status 0 checkout main $spec
+        case "$spec" in
+            "-- dir") expected=dir/x.txt ;;
+            "-- a.txt") expected=a.txt ;;
+            *) expected="a.txt dir/x.txt" ;;
+        esac
+        for file in $expected; do
+            [ -f "$file" ] || fail "'checkout main $spec' did not restore $file"
+        done
+    done
+
+    echo "materialize:lazy" >> .minigit/config.txt
+    rm -f dir/x.txt
+    expect_status 0 checkout main
+    [ -f dir/x.txt ] || fail "a lazy checkout did not restore dir/x.txt"
+}
+
+test_only_lazy_files_are_placeholders()
+{
+    begin "only lazily checked out files are taken for placeholders"
+    echo a > a.txt && mg add a.txt && mg commit -m first
+    blob=$(sed -n 's/^FILE a.txt://p' .minigit/commits.txt)
+    printf '\211MGP\r\n\032\n%s\n' "$blob" > b.txt
+    cp b.txt expected
+    expect_status 0 add b.txt
+    staged=$(sed -n 's/^b.txt://p' .minigit/staging.txt)
+    if [ -z "$staged" ] || [ "$staged" = "$blob" ]; then
+        fail "a file that looks like a placeholder was staged as '$staged'"
+    fi
+    mg commit -m second
+
+    echo "materialize:lazy" >> .minigit/config.txt
+    rm a.txt b.txt
+    expect_status 0 checkout main
+    expect_status 0 status
+    if grep -q "modified" "$ROOT/out"; then
+        fail "status reports placeholders as modified: $(cat "$ROOT/out")"
+    fi
+    expect_status 0 hydrate
+    if [ "$(cat a.txt)" != "a" ] || ! cmp -s b.txt expected; then
+        fail "hydrate did not restore the files' own content"
+    fi
+}
+
+test_failing_commands_report_status
+test_readers_share_the_commit_graph
+test_status_outside_repository
+test_identical_commits_in_one_second
+test_add_stages_removals
+test_merge_keeps_local_edits
+test_merge_keeps_missing_final_newline
+test_merge_binary_conflict
+test_merge_conflict_in_renamed_file
+test_checkout_restores_deleted_files
+test_failed_checkout_keeps_head
+test_pack_round_trip
+test_chunked_blobs
+test_gc_after_pack
+test_packed_refs
+test_journal_replay
+test_log_paths
+test_add_freshens_existing_objects
+test_only_lazy_files_are_placeholders
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures failed"
+    exit 1
+fi
+echo "All tests passed"
@@ -0,0 +1,234 @@
+// Tracing
+//
+// `minigit --trace <command>` prints where the command spent its time to
+// stderr once it finishes; `--trace=<file>` writes a Chrome trace-event file
+// instead, which chrome://tracing and Perfetto can open. Setting MINIGIT_TRACE
+// traces everything the process runs (a whole batch session, for example):
+// "1" or "summary" prints the table, any other value is the output file.
+//
+// A TraceSpan times the scope it lives in; restart() ends it and begins the
+// next phase of the same function. traceCount() adds to one of the I/O
+// counters. Both only test traceEnabled when tracing is off.
+
+enum TraceCounter
+{
+    TraceBytesRead,
+    TraceBytesWritten,
+    TraceFilesOpened,
+    TraceFsyncs,
+    TraceObjectsHashed,
+    TraceCounterCount
+};
+
+const char* const TRACE_COUNTER_NAMES[TraceCounterCount] = {"bytes read", "bytes written", "files opened", "fsyncs", "objects hashed"};
+
+bool traceEnabled = false;
+
+struct TraceEvent
+{
+    const char* name;
+    int64_t start; // microseconds since the trace began
+    int64_t duration;
+    uint32_t thread;
+};
+
+struct TraceLog
+{
+    std::mutex lock;
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> counters[TraceCounterCount] = {};
+    std::chrono::steady_clock::time_point origin;
+    std::string output; // Chrome trace file, or empty for the summary
+};
+
+TraceLog& traceLog()
+{
+    static TraceLog log;
+    return log;
+}
+
+int64_t traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - traceLog().origin).count();
+}
+
+// Small per-thread numbers read better in a trace viewer than thread IDs
+uint32_t traceThread()
+{
+    static std::atomic<uint32_t> next{0};
+    thread_local uint32_t id = next++;
+    return id;
+}
+
+inline void traceCount(TraceCounter counter, uint64_t amount = 1)
+{
+    if (traceEnabled)
+    {
+        traceLog().counters[counter].fetch_add(amount, std::memory_order_relaxed);
+    }
+}
+
+// Times its scope. name must outlive the trace, so use a string literal.
+struct TraceSpan
+{
+    const char* name;
+    int64_t start = -1;
+
+    explicit TraceSpan(const char* name) : name(name)
+    {
+        if (traceEnabled)
+        {
+            start = traceNow();
+        }
+    }
+
+    ~TraceSpan()
+    {
+        end();
+    }
+
+    void end()
+    {
+        if (start < 0)
+        {
+            return;
+        }
+        TraceEvent event{name, start, traceNow() - start, traceThread()};
+        start = -1;
+
+        TraceLog& log = traceLog();
+        std::lock_guard<std::mutex> guard(log.lock);
+        log.events.push_back(event);
+    }
+
+    // Ends this phase and starts the next one
+    void restart(const char* next)
+    {
+        end();
+        name = next;
+        if (traceEnabled)
+        {
+            start = traceNow();
+        }
+    }
+};
+
+void startTrace(const std::string& output)
+{
+    TraceLog& log = traceLog();
+    log.events.clear();
+    for (auto& counter : log.counters)
+    {
+        counter = 0;
+    }
+    log.output = output;
+    log.origin = std::chrono::steady_clock::now();
+    traceEnabled = true;
+}
+
+void writeChromeTrace(const TraceLog& log, int64_t end)
+{
+    std::ofstream out(log.output);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (const auto& event : log.events)
+    {
+        out << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+            << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << "},\n";
+    }
+    out << "{\"name\":\"I/O\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":" << end << ",\"args\":{";
+    for (int i = 0; i < TraceCounterCount; ++i)
+    {
+        out << (i ? "," : "") << "\"" << TRACE_COUNTER_NAMES[i] << "\":" << log.counters[i].load();
+    }
+    out << "}}\n]}\n";
+
+    if (!out)
+    {
+        std::cerr << "Error: Could not write trace to '" << log.output << "'.\n";
+    }
+}
+
+// Spans with the same name are added up; the slowest come first
+void writeTraceSummary(const TraceLog& log, int64_t end)
+{
+    struct Total
+    {
+        size_t calls = 0;
+        int64_t total = 0;
+        int64_t max = 0;
+    };
+    std::map<std::string, Total> totals;
+    for (const auto& event : log.events)
+    {
+        Total& total = totals[event.name];
+        ++total.calls;
+        total.total += event.duration;
+        total.max = std::max(total.max, event.duration);
+    }
+
+    std::vector<std::pair<std::string, Total>> rows(totals.begin(), totals.end());
+    std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.second.total > b.second.total; });
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "\nTrace (" << end / 1000.0 << " ms)\n";
+    out << std::left << std::setw(28) << "  span" << std::right << std::setw(8) << "calls" << std::setw(12) << "total ms"
+        << std::setw(12) << "max ms" << "\n";
+    for (const auto& [name, total] : rows)
+    {
+        out << "  " << std::left << std::setw(26) << name << std::right << std::setw(8) << total.calls << std::setw(12)
+            << total.total / 1000.0 << std::setw(12) << total.max / 1000.0 << "\n";
+    }
+    for (int i = 0; i < TraceCounterCount; ++i)
+    {
+        out << "  " << std::left << std::setw(26) << TRACE_COUNTER_NAMES[i] << std::right << std::setw(8)
+            << log.counters[i].load() << "\n";
+    }
+    std::cerr << out.str();
+}
+
+void finishTrace()
+{
+    if (!traceEnabled)
+    {
+        return;
+    }
+    traceEnabled = false;
+
+    TraceLog& log = traceLog();
+    int64_t end = traceNow();
+    std::lock_guard<std::mutex> guard(log.lock);
+    if (log.output.empty())
+    {
+        writeTraceSummary(log, end);
+    }
+    else
+    {
+        writeChromeTrace(log, end);
+    }
+    log.events.clear();
+}
+
+// Traces from construction to destruction, unless a trace is already running
+struct TraceSession
+{
+    bool active = false;
+
+    explicit TraceSession(const char* setting)
+    {
+        if (setting && !traceEnabled)
+        {
+            std::string output = setting;
+            startTrace(output == "1" || output == "summary" ? "" : output);
+            active = true;
+        }
+    }
+
+    ~TraceSession()
+    {
+        if (active)
+        {
+            finishTrace();
+        }
+    }
+};
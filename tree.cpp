@@ -0,0 +1,443 @@
+// Trees
+//
+// A tree object lists one directory, one line per entry, sorted by name:
+//
+//   blob <id> <name>
+//   tree <id> <name>
+//
+// and is stored like any other object, under the hash of that text. Every
+// commit names its root tree on a TREE line, so it describes the whole
+// project and not only the files staged for it.
+//
+// A commit's tree is its parent's tree with the staged files put in. Only
+// the trees on the way to a changed file are rewritten; every other subtree
+// keeps its ID and is shared with the parent. For the same reason two trees
+// are compared without reading any subtree that has the same ID on both
+// sides.
+//
+// Commits from before trees have no TREE line. Their snapshot is still built
+// from FILE lines along first parents, and the first commit on top of one
+// stores that snapshot as a tree.
+
+struct TreeEntry
+{
+    std::string name;
+    bool isTree = false;
+    std::string id;
+};
+
+// Reads a tree object. The empty ID is the empty tree.
+bool readTree(const std::string& id, std::vector<TreeEntry>& entries)
+{
+    entries.clear();
+    if (id.empty())
+    {
+        return true;
+    }
+
+    TraceSpan span("tree: read");
+    std::string content;
+    if (!readObject(id, content))
+    {
+        return false;
+    }
+
+    size_t pos = 0;
+    while (pos < content.size())
+    {
+        size_t end = content.find('\n', pos);
+        if (end == std::string::npos)
+        {
+            end = content.size();
+        }
+        size_t space1 = content.find(' ', pos);
+        size_t space2 = space1 == std::string::npos ? space1 : content.find(' ', space1 + 1);
+        if (space2 == std::string::npos || space2 >= end)
+        {
+            return false;
+        }
+
+        TreeEntry entry;
+        entry.isTree = content.compare(pos, space1 - pos, "tree") == 0;
+        entry.id = content.substr(space1 + 1, space2 - space1 - 1);
+        entry.name = content.substr(space2 + 1, end - space2 - 1);
+        entries.push_back(std::move(entry));
+        pos = end + 1;
+    }
+    return true;
+}
+
+// Stores a tree whose entries are sorted by name and returns its ID, or an
+// empty string if it could not be written
+std::string writeTree(const std::vector<TreeEntry>& entries)
+{
+    TraceSpan span("tree: write");
+    std::string content;
+    for (const auto& entry : entries)
+    {
+        content += (entry.isTree ? "tree " : "blob ") + entry.id + " " + entry.name + "\n";
+    }
+
+    HashState state;
+    hashUpdate(state, content.data(), content.size());
+    std::string id = hashDigest(state);
+
+    // Loose trees are stored plain: they are read on every commit and
+    // checkout, and pack deltas each one against its previous version,
+    // which saves far more than compressing it would
+    return writeObject(id, content, false) ? id : "";
+}
+
+// Puts changes (path relative to this tree -> blob) into the tree baseId and
+// writes the result. An empty blob removes the path, and a directory left
+// empty goes with it. Subtrees without changes are reused as they are. The IDs
+// of the trees written are added to written, if given.
+bool buildTree(const std::string& baseId, const std::map<std::string, std::string>& changes, std::string& id,
+               std::vector<std::string>* written = nullptr)
+{
+    std::vector<TreeEntry> base;
+    if (!readTree(baseId, base))
+    {
+        return false;
+    }
+
+    std::map<std::string, TreeEntry> entries;
+    for (auto& entry : base)
+    {
+        entries[entry.name] = std::move(entry);
+    }
+
+    std::map<std::string, std::map<std::string, std::string>> subdirs;
+    for (const auto& [path, blob] : changes)
+    {
+        size_t slash = path.find('/');
+        if (slash == std::string::npos && blob.empty())
+        {
+            entries.erase(path);
+        }
+        else if (slash == std::string::npos)
+        {
+            entries[path] = {path, false, blob};
+        }
+        else
+        {
+            subdirs[path.substr(0, slash)][path.substr(slash + 1)] = blob;
+        }
+    }
+
+    HashState empty;
+    std::string emptyTree = subdirs.empty() ? "" : hashDigest(empty);
+    for (const auto& [name, subChanges] : subdirs)
+    {
+        // A file that becomes a directory starts from an empty tree
+        auto it = entries.find(name);
+        std::string subBase = it != entries.end() && it->second.isTree ? it->second.id : "";
+        std::string subId;
+        if (!buildTree(subBase, subChanges, subId, written))
+        {
+            return false;
+        }
+        if (subId == emptyTree)
+        {
+            entries.erase(name);
+        }
+        else
+        {
+            entries[name] = {name, true, subId};
+        }
+    }
+
+    std::vector<TreeEntry> sorted;
+    for (auto& [name, entry] : entries)
+    {
+        sorted.push_back(std::move(entry));
+    }
+    id = writeTree(sorted);
+    if (written && !id.empty())
+    {
+        written->push_back(id);
+    }
+    return !id.empty();
+}
+
+// Adds every file below the tree to files, keyed by its full path. Paths
+// already in files are kept.
+bool readTreeFiles(const std::string& id, const std::string& prefix, std::map<std::string, std::string>& files)
+{
+    std::vector<TreeEntry> entries;
+    if (!readTree(id, entries))
+    {
+        return false;
+    }
+    for (const auto& entry : entries)
+    {
+        if (entry.isTree)
+        {
+            if (!readTreeFiles(entry.id, prefix + entry.name + "/", files))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            files.insert({prefix + entry.name, entry.id});
+        }
+    }
+    return true;
+}
+
+// The ID of the blob or tree at path below the tree id, or an empty string
+// if there is nothing there. Only the trees on the way are read.
+std::string findTreeEntry(const std::string& id, const std::string& path)
+{
+    std::string current = id;
+    size_t pos = 0;
+    while (!current.empty())
+    {
+        size_t slash = path.find('/', pos);
+        std::string name = path.substr(pos, slash == std::string::npos ? std::string::npos : slash - pos);
+
+        std::vector<TreeEntry> entries;
+        if (!readTree(current, entries))
+        {
+            return "";
+        }
+        auto it = std::lower_bound(entries.begin(), entries.end(), name,
+                                   [](const TreeEntry& entry, const std::string& key) { return entry.name < key; });
+        if (it == entries.end() || it->name != name)
+        {
+            return "";
+        }
+        if (slash == std::string::npos)
+        {
+            return it->id;
+        }
+        if (!it->isTree)
+        {
+            return "";
+        }
+        current = it->id;
+        pos = slash + 1;
+    }
+    return "";
+}
+
+// Visits every tree and blob below the tree id with the path it was found
+// under; a directory's path ends in '/'. Trees already in seen are skipped
+// along with everything below them.
+bool walkTree(const std::string& id, const std::string& prefix, std::set<std::string>& seen,
+              const std::function<void(const std::string& path, const std::string& id)>& visit)
+{
+    if (!seen.insert(id).second)
+    {
+        return true;
+    }
+    visit(prefix, id);
+
+    std::vector<TreeEntry> entries;
+    if (!readTree(id, entries))
+    {
+        return false;
+    }
+    for (const auto& entry : entries)
+    {
+        if (entry.isTree)
+        {
+            if (!walkTree(entry.id, prefix + entry.name + "/", seen, visit))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            visit(prefix + entry.name, entry.id);
+        }
+    }
+    return true;
+}
+
+using TreeChange = std::function<void(const std::string& path, const std::string& oldBlob, const std::string& newBlob)>;
+
+// Which paths to look at; a directory's path ends in '/'. An empty filter
+// takes everything.
+using TreeFilter = std::function<bool(const std::string& path)>;
+
+// Reports every file that differs between two trees: oldBlob is empty for an
+// added file and newBlob for a removed one. Subtrees with the same ID on both
+// sides are skipped without being read, and so are files and directories the
+// filter leaves out. When a file and a directory swap places, the old side is
+// reported first, so callers can apply the changes in order.
+bool diffTrees(const std::string& oldId, const std::string& newId, const std::string& prefix, const TreeChange& onChange,
+               const TreeFilter& filter)
+{
+    if (oldId == newId)
+    {
+        return true;
+    }
+
+    std::vector<TreeEntry> oldEntries, newEntries;
+    if (!readTree(oldId, oldEntries) || !readTree(newId, newEntries))
+    {
+        return false;
+    }
+
+    static const TreeEntry none;
+    auto wanted = [&](const TreeEntry& entry) {
+        return !filter || filter(prefix + entry.name + (entry.isTree ? "/" : ""));
+    };
+    auto reportOld = [&](const TreeEntry& entry) {
+        return !wanted(entry)
+            || (entry.isTree ? diffTrees(entry.id, "", prefix + entry.name + "/", onChange, filter)
+                             : (onChange(prefix + entry.name, entry.id, ""), true));
+    };
+    auto reportNew = [&](const TreeEntry& entry) {
+        return !wanted(entry)
+            || (entry.isTree ? diffTrees("", entry.id, prefix + entry.name + "/", onChange, filter)
+                             : (onChange(prefix + entry.name, "", entry.id), true));
+    };
+
+    size_t i = 0, j = 0;
+    bool ok = true;
+    while (ok && (i < oldEntries.size() || j < newEntries.size()))
+    {
+        const TreeEntry& a = i < oldEntries.size() ? oldEntries[i] : none;
+        const TreeEntry& b = j < newEntries.size() ? newEntries[j] : none;
+
+        if (j == newEntries.size() || (i < oldEntries.size() && a.name < b.name))
+        {
+            ok = reportOld(a);
+            ++i;
+        }
+        else if (i == oldEntries.size() || b.name < a.name)
+        {
+            ok = reportNew(b);
+            ++j;
+        }
+        else
+        {
+            if (a.isTree && b.isTree)
+            {
+                ok = !wanted(a) || diffTrees(a.id, b.id, prefix + a.name + "/", onChange, filter);
+            }
+            else if (!a.isTree && !b.isTree)
+            {
+                if (a.id != b.id && wanted(a))
+                {
+                    onChange(prefix + a.name, a.id, b.id);
+                }
+            }
+            else
+            {
+                ok = reportOld(a) && reportNew(b);
+            }
+            ++i;
+            ++j;
+        }
+    }
+    return ok;
+}
+
+bool diffTrees(const std::string& oldId, const std::string& newId, const std::string& prefix, const TreeChange& onChange)
+{
+    return diffTrees(oldId, newId, prefix, onChange, TreeFilter());
+}
+
+const size_t SNAPSHOT_CACHE_SIZE = 4;
+
+// Collects the full file list of a commit from its tree. For commits from
+// before trees, the snapshot is the commit's own files plus, for every path
+// it does not list, the newest version along its first parents.
+// Commits never change, so the last few snapshots are cached by ID.
+bool commitSnapshot(const std::string& id, std::map<std::string, std::string>& files)
+{
+    TraceSpan span("snapshot");
+    files.clear();
+
+    static std::mutex cacheLock;
+    static std::deque<std::pair<std::string, std::map<std::string, std::string>>> cache;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        for (const auto& [cachedID, cachedFiles] : cache)
+        {
+            if (cachedID == id)
+            {
+                files = cachedFiles;
+                return true;
+            }
+        }
+    }
+
+    CommitGraph graph;
+    if (!openCommitGraph(graph))
+    {
+        return false;
+    }
+
+    int64_t index = findCommitIndex(graph, id);
+    if (index < 0)
+    {
+        return false;
+    }
+
+    std::shared_ptr<CommitLog> log = currentCommitLog();
+    while (index >= 0)
+    {
+        CommitView c;
+        if (!parseCommitView(*log, graph.entries[index].offset, c))
+        {
+            return false;
+        }
+        if (!c.tree.empty())
+        {
+            // The tree already holds everything older
+            if (!readTreeFiles(std::string(c.tree), "", files))
+            {
+                return false;
+            }
+            break;
+        }
+        // Newer versions win, and within a commit the last line does
+        std::map<std::string, std::string> listed;
+        forEachCommitFile(c, [&](std::string_view file, std::string_view hash) {
+            listed[std::string(file)] = hash;
+        });
+        files.insert(listed.begin(), listed.end());
+
+        uint32_t parent = graph.entries[index].parent;
+        index = parent == NO_PARENT ? -1 : (int64_t)parent;
+    }
+
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cache.push_front({id, files});
+    if (cache.size() > SNAPSHOT_CACHE_SIZE)
+    {
+        cache.pop_back();
+    }
+    return true;
+}
+
+// Finds the root tree of a commit; no commit (an empty ID) has the empty
+// tree. A commit from before trees gets its snapshot stored as a tree, and
+// the trees written for it are added to written, if given.
+bool commitTree(const std::string& id, std::string& tree, std::vector<std::string>* written = nullptr)
+{
+    tree.clear();
+    if (id.empty())
+    {
+        return true;
+    }
+
+    Commit commit;
+    if (!lookupCommit(id, commit))
+    {
+        return false;
+    }
+    if (!commit.tree.empty())
+    {
+        tree = commit.tree;
+        return true;
+    }
+
+    std::map<std::string, std::string> files;
+    return commitSnapshot(id, files) && buildTree("", files, tree, written);
+}
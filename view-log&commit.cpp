@@ -1,14 +1,10 @@
 // 3.
-std::string generateCommitID(const std::string &message)
+// A commit's ID is the hash of its whole record after the COMMIT line: time,
+// message, author, parents, tree and files. Two commits made in the same
+// second with the same message still differ in their parent.
+std::string generateCommitID(const std::string &fields)
 {
-
-    // Gets the current timestamp
-    std::time_t currentTime = std::time(nullptr);
-
-    // Converts time to string and concatenate it with the message
-    std::string base = std::to_string(currentTime) + message;
-
-    return hashFunc(base);
+    return hashFunc(fields);
 }
 
 std::vector<std::pair<std::string, std::string>> getStagedFiles()
@@ -34,6 +30,18 @@ std::vector<std::pair<std::string, std::string>> getStagedFiles()
     return staged;
 }
 
+// The "author" setting, or else the user name
+std::string commitAuthor()
+{
+    std::string author = getConfig("author");
+    const char* user = std::getenv("USER");
+    if (author.empty())
+    {
+        author = user && *user ? user : "unknown";
+    }
+    return author;
+}
+
 std::string getParentHash()
 {
     std::ifstream headFile(".minigit/HEAD.txt");
@@ -41,112 +49,250 @@ std::string getParentHash()
     std::getline(headFile, currentHead);
     headFile.close();
 
-    // If
-    std::ifstream branches(".minigit/branches.txt");
-    std::string line;
-    while (std::getline(branches, line))
+    std::string branchHash;
+    readRef(currentHead, branchHash);
+    return branchHash;
+}
+
+bool createCommit(const std::string &message)
+{
+    TraceSpan span("commit");
+
+    // The message is one line of the commit record
+    if (message.find_first_of("\r\n") != std::string::npos)
     {
-        size_t colon = line.find(":");
-        if (colon != std::string::npos)
-        {
-            std::string branch = line.substr(0, colon);
-            std::string branchHash = line.substr(colon + 1);
-            if (branch == currentHead)
-            {
-                branches.close();
-                return branchHash;
-            }
-        }
+        std::cout << "Error: A commit message must be a single line.\n";
+        return false;
     }
 
-    branches.close();
-    return "";
-}
+    TraceSpan phase("commit: read staging");
 
-void createCommit(const std::string &message)
-{
     // Gets staged files
     auto stagedFiles = getStagedFiles();
     if (stagedFiles.empty())
     {
         std::cout << "There is nothing inside staging.txt to commit.\n";
-        return;
+        return false;
     }
 
-    // Generates commit ID
-    std::string commitID = generateCommitID(message);
-
     // Gets parent hash
     std::string parentHash = getParentHash();
 
+    // A merge that stopped on conflicts records the merged branch as well
+    std::string mergeParent;
+    std::ifstream mergeHead(".minigit/MERGE_HEAD.txt");
+    std::getline(mergeHead, mergeParent);
+    mergeHead.close();
+
+    // Only commits on top of the branch as it is now
+    std::ifstream headFile(".minigit/HEAD.txt");
+    std::string currentBranch;
+    std::getline(headFile, currentBranch);
+    headFile.close();
+
+    // The parent's tree with the staged files put in; later entries for the
+    // same path win
+    phase.restart("commit: build tree");
+    JournalTransaction txn;
+    txn.branch = currentBranch;
+    txn.oldHash = parentHash;
+    std::string parentTree, tree;
+    std::map<std::string, std::string> changes(stagedFiles.rbegin(), stagedFiles.rend());
+    if (!commitTree(parentHash, parentTree, &txn.objects) || !buildTree(parentTree, changes, tree, &txn.objects))
+    {
+        std::cout << "Error: Could not write the tree for this commit.\n";
+        return false;
+    }
+
     // Gets timestamp
     std::time_t now = std::time(nullptr);
     std::string timeStr = std::ctime(&now);
     timeStr.pop_back();
 
-    // Writes commit data
-    std::ofstream commits(".minigit/commits.txt", std::ios::app);
-    commits << "COMMIT " << commitID << "\n";
-    commits << "TIME " << timeStr << "\n";
-    commits << "MESSAGE " << message << "\n";
-    commits << "PARENT " << parentHash << "\n";
-    for (const auto &[fileName, hash] : stagedFiles)
+    // Builds the commit record; its ID comes from everything in it
+    std::ostringstream record;
+    record << "TIME " << timeStr << "\n";
+    record << "MESSAGE " << message << "\n";
+    record << "AUTHOR " << commitAuthor() << "\n";
+    record << "PARENT " << parentHash << "\n";
+    if (!mergeParent.empty())
+    {
+        record << "PARENT2 " << mergeParent << "\n";
+    }
+    record << "TREE " << tree << "\n";
+    for (const auto &[fileName, hash] : changes)
+    {
+        // Removals staged by a merge live in the tree only
+        if (!hash.empty())
+        {
+            record << "FILE " << fileName << ":" << hash << "\n";
+            txn.objects.push_back(hash);
+        }
+    }
+    std::string commitID = generateCommitID(record.str());
+    txn.commitID = commitID;
+    txn.record = "COMMIT " + commitID + "\n" + record.str() + "END\n";
+
+    // Writes the commit and moves the branch as one journal transaction,
+    // only if nobody else moved the branch in the meantime
+    phase.restart("commit: write");
+    if (!journalCommit(txn))
     {
-        commits << "FILE " << fileName << ":" << hash << "\n";
+        std::cout << "Error: Could not update branch '" << currentBranch << "'; it is locked or was moved by another command.\n";
+        return false;
     }
-    commits << "END\n";
-    commits.close();
 
-    // Updates HEAD and branch pointers
-    std::ifstream headFile(".minigit/HEAD.txt");
-    std::string currentBranch;
-    std::getline(headFile, currentBranch);
-    headFile.close();
+    // Clear staging area
+    std::ofstream staging(".minigit/staging.txt");
+    staging.close();
+    std::remove(".minigit/MERGE_HEAD.txt");
 
-    std::ifstream in(".minigit/branches.txt");
-    std::ostringstream updatedBranches;
-    std::string line;
-    bool found = false;
+    std::cout << "Commited! ID: " << commitID << "\n";
+    return true;
+}
+
+// 4.
+struct LogOptions
+{
+    size_t maxCount = std::numeric_limits<size_t>::max();
+    int64_t since = 0;              // only commits from this time on
+    std::string author;             // only commits whose author contains this
+    std::vector<std::string> paths; // only commits that changed one of these
+};
+
+// Understands "2026-10-01", "2026-10-01 14:30[:00]" and "<n> days ago" (also
+// hours, weeks, or with dots: "2.weeks.ago")
+bool parseSince(std::string text, int64_t& since)
+{
+    std::replace(text.begin(), text.end(), '.', ' ');
+    std::istringstream relative(text);
+    long amount;
+    std::string unit, ago;
+    if (relative >> amount >> unit >> ago && ago == "ago")
+    {
+        if (unit.back() == 's')
+        {
+            unit.pop_back();
+        }
+        static const std::map<std::string, int64_t> units = {
+            {"minute", 60}, {"hour", 3600}, {"day", 86400}, {"week", 7 * 86400}};
+        auto it = units.find(unit);
+        if (it == units.end())
+        {
+            return false;
+        }
+        since = std::time(nullptr) - amount * it->second;
+        return true;
+    }
 
-    while (std::getline(in, line))
+    for (const char* format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"})
     {
-        size_t colon = line.find(":");
-        if (colon != std::string::npos)
+        std::tm tm = {};
+        const char* end = strptime(text.c_str(), format, &tm);
+        if (end && *end == '\0')
         {
-            std::string branch = line.substr(0, colon);
-            if (branch == currentBranch)
+            tm.tm_isdst = -1;
+            since = std::mktime(&tm);
+            return true;
+        }
+    }
+    return false;
+}
+
+// log [-n <count> | --max-count=<count>] [--since=<date>] [--author=<name>] [-- <path>...]
+bool parseLogOptions(const std::vector<std::string>& args, LogOptions& options)
+{
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        const std::string& arg = args[i];
+        auto value = [&](const std::string& name, std::string& out) {
+            if (arg == name && i + 1 < args.size())
+            {
+                out = args[++i];
+                return true;
+            }
+            if (arg.rfind(name + "=", 0) == 0)
+            {
+                out = arg.substr(name.size() + 1);
+                return true;
+            }
+            return false;
+        };
+
+        std::string text;
+        if (arg == "--")
+        {
+            for (++i; i < args.size(); ++i)
+            {
+                std::string path = fs::path(args[i]).lexically_normal().generic_string();
+                while (!path.empty() && path.back() == '/')
+                {
+                    path.pop_back();
+                }
+                if (path.empty() || path == "." || path.rfind("../", 0) == 0)
+                {
+                    return false;
+                }
+                options.paths.push_back(path);
+            }
+        }
+        else if (value("--max-count", text) || value("-n", text))
+        {
+            char* end;
+            unsigned long long count = std::strtoull(text.c_str(), &end, 10);
+            if (text.empty() || *end != '\0')
             {
-                updatedBranches << branch << ":" << commitID << "\n";
-                found = true;
+                return false;
             }
-            else
+            options.maxCount = count;
+        }
+        else if (value("--since", text))
+        {
+            if (!parseSince(text, options.since))
             {
-                updatedBranches << line << "\n";
+                return false;
             }
         }
+        else if (!value("--author", options.author))
+        {
+            return false;
+        }
     }
+    return true;
+}
 
-    in.close();
-
-    if (!found)
+// Whether a commit changed path, a file or a directory, compared with its
+// first parent
+bool commitChangedPath(const CommitLog& log, const CommitGraph& graph, int64_t index, const CommitView& c,
+                       const std::string& path)
+{
+    if (!c.tree.empty())
     {
-        updatedBranches << currentBranch << ":" << commitID << "\n";
+        uint32_t parent = graph.entries[index].parent;
+        CommitView parentCommit;
+        if (parent == NO_PARENT || (parseCommitView(log, graph.entries[parent].offset, parentCommit)
+                                    && !parentCommit.tree.empty()))
+        {
+            return findTreeEntry(std::string(c.tree), path) != findTreeEntry(std::string(parentCommit.tree), path);
+        }
     }
 
-    std::ofstream out(".minigit/branches.txt");
-    out << updatedBranches.str();
-    out.close();
-
-    // Clear staging area
-    std::ofstream staging(".minigit/staging.txt");
-    staging.close();
-
-    std::cout << "Commited! ID: " << commitID << "\n";
+    // Before trees, a commit lists the files it changed
+    bool changed = false;
+    forEachCommitFile(c, [&](std::string_view file, std::string_view) {
+        changed = changed || file == path
+            || (file.size() > path.size() && file.compare(0, path.size(), path) == 0 && file[path.size()] == '/');
+    });
+    return changed;
 }
 
-// 4.
-void viewlog()
+// Prints the first-parent history of the current branch, newest first, as
+// it is walked. With paths, a commit whose changed-path filter rules them
+// all out is skipped without reading it. --since stops at the first older
+// commit.
+bool viewlog(const LogOptions& options = LogOptions())
 {
+    TraceSpan span("log");
 
     // read HEAD, branches, and latest commit hash
     std::ifstream headFile(".minigit/HEAD.txt");
@@ -154,87 +300,96 @@ void viewlog()
     std::getline(headFile, currentBranch);
     headFile.close();
 
-    std::ifstream branchesFile(".minigit/branches.txt");
     std::string commitHash;
-    std::string line;
-
-    while (std::getline(branchesFile, line))
+    readRef(currentBranch, commitHash);
+    if (commitHash.empty())
     {
-        size_t colon = line.find(":");
-        if (colon != std::string::npos)
-        {
-            std::string branch = line.substr(0, colon);
-            if (branch == currentBranch)
-            {
-                commitHash = line.substr(colon + 1);
-                break;
-            }
-        }
+        std::cout << "No commits found on branch '" << currentBranch << "'.\n";
+        return false;
     }
 
-    branchesFile.close();
-    if (commitHash.empty())
+    // Walks the commit chain through the commit graph
+    CommitGraph graph;
+    if (!openCommitGraph(graph))
     {
-        std::cout << "No commits found on branch '" << currentBranch << "'.\n";
-        return;
+        std::cout << "Error: Could not read the commit graph.\n";
+        return false;
     }
 
-    // Parse all commits from commits.txt
-    std::ifstream commitsFile(".minigit/commits.txt");
-    std::vector<Commit> allCommits;
-    Commit current;
+    int64_t index = findCommitIndex(graph, commitHash);
+    std::shared_ptr<CommitLog> log = currentCommitLog();
+
+    std::vector<BloomKey> keys;
+    for (const auto& path : options.paths)
+    {
+        keys.push_back(bloomKey(path));
+    }
+    bool filtered = !options.paths.empty() || !options.author.empty() || options.since != 0;
 
-    while (std::getline(commitsFile, line))
+    std::cout << "\nCommit history:\n";
+    size_t shown = 0;
+    while (!commitHash.empty() && shown < options.maxCount)
     {
-        if (line.rfind("COMMIT ", 0) == 0)
+        if (index < 0)
         {
-            current.id = line.substr(7);
+            std::cout << "Error: Commit with ID " << commitHash << " not found.\n";
+            return false;
         }
-        else if (line.rfind("TIME ", 0) == 0)
+        const GraphEntry& entry = graph.entries[index];
+        if (options.since != 0 && entry.timestamp < options.since)
         {
-            current.time = line.substr(5);
+            break;
         }
-        else if (line.rfind("MESSAGE ", 0) == 0)
+
+        // Go to parent
+        int64_t current = index;
+        index = entry.parent == NO_PARENT ? -1 : (int64_t)entry.parent;
+        commitHash = index < 0 ? "" : entryID(graph.entries[index]);
+        if (!keys.empty() && !commitMayChange(graph, current, keys))
         {
-            current.message = line.substr(8);
+            continue;
         }
-        else if (line.rfind("PARENT ", 0) == 0)
+
+        CommitView c;
+        if (!parseCommitView(*log, entry.offset, c))
         {
-            current.parent = line.substr(7);
+            std::cout << "Error: Commit with ID " << entryID(entry) << " not found.\n";
+            return false;
         }
-        else if (line == "END")
+        if (!options.author.empty() && c.author.find(options.author) == std::string::npos)
         {
-            allCommits.push_back(current);
-            current = Commit();
+            continue;
+        }
+        bool touched = options.paths.empty();
+        for (size_t i = 0; i < options.paths.size() && !touched; ++i)
+        {
+            touched = commitChangedPath(*log, graph, current, c, options.paths[i]);
+        }
+        if (!touched)
+        {
+            continue;
         }
-    }
-
-    commitsFile.close();
 
-    // Follows the commit chain using parent hashes
-    std::cout << "\nCommit history:\n";
-    while (!commitHash.empty())
-    {
-        // Find the commit with matching ID
-        bool found = false;
-        for (const Commit &c : allCommits)
+        std::cout << "----------------------------\n";
+        std::cout << "Commit ID: " << c.id << "\n";
+        if (!c.author.empty())
         {
-            if (c.id == commitHash)
-            {
-                std::cout << "----------------------------\n";
-                std::cout << "Commit ID: " << c.id << "\n";
-                std::cout << "Time     : " << c.time << "\n";
-                std::cout << "Message  : " << c.message << "\n";
-                commitHash = c.parent; // Go to parent
-                found = true;
-                break;
-            }
+            std::cout << "Author   : " << c.author << "\n";
         }
+        std::cout << "Time     : " << c.time << "\n";
+        std::cout << "Message  : " << c.message << "\n";
+        ++shown;
 
-        if (!found)
+        // A filtered search can take a while; show results as they are found
+        if (filtered)
         {
-            std::cout << "Error: Commit with ID " << commitHash << " not found.\n";
-            break;
+            std::cout.flush();
         }
     }
-}
\ No newline at end of file
+
+    if (filtered && shown == 0)
+    {
+        std::cout << "No matching commits.\n";
+    }
+    return true;
+}
@@ -0,0 +1,119 @@
+// Work-stealing worker pool
+//
+// runParallel(count, task) calls task(0) .. task(count - 1) on all cores.
+// The indices are split into one contiguous block per worker; a worker takes
+// items from the front of its own block and, once that runs dry, steals from
+// the back of the others. This keeps neighbouring items on the same thread
+// while still balancing uneven work (one huge file among many small ones).
+
+// Number of threads to use. MINIGIT_THREADS overrides the core count.
+size_t workerCount()
+{
+    const char* env = std::getenv("MINIGIT_THREADS");
+    if (env && std::atoi(env) > 0)
+    {
+        return std::atoi(env);
+    }
+
+    size_t cores = std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+}
+
+struct WorkQueue
+{
+    std::mutex lock;
+    std::deque<size_t> items;
+};
+
+void runParallel(size_t count, const std::function<void(size_t)>& task)
+{
+    size_t workers = std::min(workerCount(), count);
+    if (workers <= 1)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            task(i);
+        }
+        return;
+    }
+
+    std::vector<WorkQueue> queues(workers);
+    for (size_t w = 0; w < workers; ++w)
+    {
+        size_t begin = count * w / workers;
+        size_t end = count * (w + 1) / workers;
+        for (size_t i = begin; i < end; ++i)
+        {
+            queues[w].items.push_back(i);
+        }
+    }
+
+    std::mutex errorLock;
+    std::exception_ptr error;
+
+    auto worker = [&](size_t self) {
+        while (true)
+        {
+            size_t item = 0;
+            bool found = false;
+
+            // Own queue first, then steal from the others
+            for (size_t k = 0; k < workers && !found; ++k)
+            {
+                WorkQueue& queue = queues[(self + k) % workers];
+                std::lock_guard<std::mutex> guard(queue.lock);
+                if (queue.items.empty())
+                {
+                    continue;
+                }
+                if (k == 0)
+                {
+                    item = queue.items.front();
+                    queue.items.pop_front();
+                }
+                else
+                {
+                    item = queue.items.back();
+                    queue.items.pop_back();
+                }
+                found = true;
+            }
+
+            if (!found)
+            {
+                return;
+            }
+
+            try
+            {
+                task(item);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(errorLock);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        }
+    };
+
+    // The calling thread works too
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; ++w)
+    {
+        threads.emplace_back(worker, w);
+    }
+    worker(0);
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}